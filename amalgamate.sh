@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# concatenates the library into libws.h, a single header where every
+# function is static inline, so the parser and the callbacks bound with
+# WS_FRAME_CB and WS_HEADER_CB can inline into the caller
+#
+# usage: sh amalgamate.sh > libws.h (or make amalgamate)
+
+cd "$(dirname "$0")" || exit 1
+
+headers="ws_metrics.h ws.h ws_h2.h sha1.h base64.h"
+
+# sha1.c goes last, its one letter macros would leak into the others
+sources="ws_metrics.c ws.c ws_frame.c ws_http.c ws_hpack.c ws_h2.c base64.c sha1.c"
+
+cat <<'EOF'
+/*
+ * libws.h, generated by amalgamate.sh, do not edit
+ *
+ * include it in the file that uses the library, optionally defining
+ * WS_FRAME_CB and WS_HEADER_CB first to the names of callbacks declared
+ * above the include. include it before any system header or build with
+ * _POSIX_C_SOURCE >= 199309L, and include <errno.h> after it, struct
+ * ws_parser has a member named errno.
+ */
+
+#ifndef LIBWS_H
+#define LIBWS_H
+
+#if !defined(_POSIX_C_SOURCE) && !defined(_GNU_SOURCE)
+# define _POSIX_C_SOURCE 199309L
+#endif
+
+#define WS_AMALGAMATION
+#define WS_API static inline
+EOF
+
+for f in $headers $sources; do
+    printf '\n/* %s */\n\n' "$f"
+
+    # the local headers are already above, the feature macro is set once
+    sed -e '/^#include "/d' -e '/^#define _POSIX_C_SOURCE/d' "$f"
+done
+
+# keep the helpers' macros out of the including file
+printf '\n/* internal macros */\n\n'
+sed -n 's/^# *define[ 	]\{1,\}\([A-Za-z_][A-Za-z0-9_]*\).*/\1/p' $sources |
+    grep -v -e '^_POSIX_C_SOURCE$' -e '^BYTE_ORDER$' -e '_ENDIAN$' |
+    sort -u | sed 's/^/#undef /'
+
+printf '\n#endif\n'
@@ -21,6 +21,11 @@
 extern "C" {
 #endif
 
+/* static in the single header build, see amalgamate.sh */
+#ifndef WS_API
+# define WS_API
+#endif
+
 /* Simple BASE64 encode/decode functions.
  *
  * As we might encode binary strings, hence we require the length of
@@ -50,7 +55,7 @@ extern "C" {
  * @param len_plain_src The length of the plain text string
  * @return the length of the encoded string
  */
-int base64_encode(char *coded_dst, const unsigned char *plain_src,
+WS_API int base64_encode(char *coded_dst, const unsigned char *plain_src,
     int len_plain_src);
 
 #ifdef __cplusplus
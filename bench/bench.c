@@ -0,0 +1,287 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// microbenchmarks for the parser, handshake and hashing
+// usage: bench [filter]
+//
+// bench_single runs the same cases against the single header build
+// (make amalgamate), with frame_cb bound at compile time
+
+#define _POSIX_C_SOURCE 199309L
+
+#ifdef BENCH_SINGLE
+# include <stdint.h>
+struct ws_frame;
+static int frame_cb(struct ws_frame *frame, void *data);
+# define WS_FRAME_CB frame_cb
+# include "../libws.h"
+#else
+# include "../ws.h"
+# include "../sha1.h"
+# include "../base64.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define MIN_TIME 0.2 // seconds per benchmark
+
+static const char *handshake =
+    "GET /chat HTTP/1.1\r\n"
+    "Host: server.example.com\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Origin: http://example.com\r\n"
+    "Sec-WebSocket-Protocol: chat, superchat\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "\r\n";
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// keeps results alive so the compiler can't drop the work
+static volatile uint64_t sink;
+
+static void report(const char *name, double elapsed, uint64_t ops,
+    uint64_t bytes)
+{
+    printf("%-40s %10.1f ns/op", name, elapsed * 1e9 / ops);
+    if (bytes)
+        printf(" %10.1f MB/s", bytes / elapsed / 1e6);
+    printf("\n");
+}
+
+// run fn until MIN_TIME has passed, doubling the batch size
+#define BENCH(name, bytes_per_op, setup, body) \
+    do { \
+        if (filter && !strstr(name, filter)) \
+            break; \
+        setup; \
+        uint64_t ops = 0, batch = 1; \
+        double start = now(), elapsed; \
+        do { \
+            for (uint64_t i_ = 0; i_ < batch; i_++) { \
+                body; \
+            } \
+            ops += batch; \
+            batch *= 2; \
+        } while ((elapsed = now() - start) < MIN_TIME); \
+        report(name, elapsed, ops, (uint64_t)(bytes_per_op) * ops); \
+    } while (0)
+
+// parser
+
+// reassembly copies the payload out, the other cases only count it
+static int frame_cb(struct ws_frame *frame, void *data)
+{
+    if (data)
+        memcpy((char *)data + frame->chunk_offset, frame->chunk_data,
+            frame->chunk_len);
+    else
+        sink += frame->chunk_len;
+
+    return 0;
+}
+
+// fill buf with frames of payload size len, returns the bytes written
+static size_t build_frames(char *buf, size_t size, size_t len, int masked)
+{
+    size_t pos = 0;
+
+    while (pos + WS_FRAME_HEADER_SIZE + 4 + len <= size) {
+        int n = ws_write_frame_header(buf + pos, WS_BINARY, len);
+        if (masked) {
+            buf[pos + 1] |= 0x80;
+            memcpy(buf + pos + n, "\x12\x34\x56\x78", 4);
+            n += 4;
+        }
+        memset(buf + pos + n, 'x', len);
+        pos += n + len;
+    }
+
+    return pos;
+}
+
+static void parser_ready(struct ws_parser *parser)
+{
+    ws_parser_init(parser);
+    parser->frame_cb = frame_cb;
+    ws_read_next_frame(parser);
+}
+
+// feed buf to the parser in recv-sized pieces
+static void parse_pieces(struct ws_parser *parser, char *buf, size_t len,
+    size_t piece)
+{
+    for (size_t pos = 0; pos < len; pos += piece) {
+        size_t n = len - pos < piece ? len - pos : piece;
+        ws_parse_all(parser, buf + pos, n);
+    }
+}
+
+static void bench_parser(const char *filter)
+{
+    static char buf[1 << 20];
+    static const size_t sizes[] = { 16, 125, 1024, 16384, 65536 };
+    static const size_t pieces[] = { 1 << 20, 1500, 7 };
+
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (int masked = 0; masked < 2; masked++) {
+            for (int p = 0; p < sizeof(pieces) / sizeof(pieces[0]); p++) {
+                char name[64];
+                snprintf(name, sizeof(name), "ws_parse_all/%zu/%s/recv%zu",
+                    sizes[s], masked ? "masked" : "unmasked", pieces[p]);
+
+                // zeroed, freeing it is fine when the filter skips setup
+                struct ws_parser parser = { 0 };
+                size_t len = build_frames(buf, sizeof(buf), sizes[s], masked);
+
+                BENCH(name, len, parser_ready(&parser),
+                    parse_pieces(&parser, buf, len, pieces[p]));
+
+                ws_parser_free(&parser);
+            }
+        }
+    }
+}
+
+// the same parse with token buckets that never run dry
+
+static void bench_rate_limit(const char *filter)
+{
+    static char buf[1 << 20];
+    size_t len = build_frames(buf, sizeof(buf), 16, 1);
+    struct ws_parser parser;
+
+    BENCH("ws_parse_all/16/masked/recv1500/rate_limited", len,
+        parser_ready(&parser);
+        ws_set_rate_limit(&parser, 1e12, 1e12, 1e15, 1e15),
+        parse_pieces(&parser, buf, len, 1500));
+}
+
+// message reassembly: unmask in place and copy, or unmask into place
+
+static char message[1 << 16];
+
+static char *dest_cb(struct ws_frame *frame, void *data)
+{
+    return message + frame->chunk_offset;
+}
+
+static void bench_reassembly(const char *filter)
+{
+    static char buf[1 << 20];
+    size_t len = build_frames(buf, sizeof(buf), sizeof(message), 1);
+    struct ws_parser parser;
+
+    BENCH("reassemble/65536/copy", len,
+        parser_ready(&parser);
+        parser.data = message,
+        parse_pieces(&parser, buf, len, 1 << 16));
+
+    BENCH("reassemble/65536/dest", len,
+        parser_ready(&parser);
+        parser.dest_cb = dest_cb,
+        parse_pieces(&parser, buf, len, 1 << 16));
+
+    sink += message[0];
+}
+
+// handshake
+
+static void bench_handshake(const char *filter)
+{
+    size_t len = strlen(handshake);
+    char request[WS_BUFFER_SIZE];
+    struct ws_parser parser;
+
+    BENCH("ws_read_http_header", len, ,
+        memcpy(request, handshake, len);
+        ws_parser_init(&parser);
+        ws_parse_all(&parser, request, len);
+        sink += parser.header.websocket_key != NULL;
+        ws_parser_free(&parser));
+
+    char response[WS_HTTP_RESPONSE_SIZE];
+    char key[] = "dGhlIHNhbXBsZSBub25jZQ==";
+
+    BENCH("ws_write_http_handshake", 0, ,
+        sink += ws_write_http_handshake(response, key));
+
+    struct ws_handshake_cache cache = { 0 };
+    struct ws_handshake *chat =
+        ws_handshake_get(&cache, "chat", "permessage-deflate");
+    char reply[256];
+
+    BENCH("ws_handshake_write/protocol+extensions", 0, ,
+        sink += ws_handshake_write(chat, reply, sizeof(reply), key));
+
+    ws_handshake_unref(&cache, chat);
+}
+
+// hashing and encoding
+
+static void bench_hash(const char *filter)
+{
+    static unsigned char data[4096];
+    unsigned char result[SHA1_RESULTLEN];
+    char encoded[base64_encode_len(SHA1_RESULTLEN)];
+    struct sha1_ctxt ctx;
+
+    BENCH("sha1_loop/60", 60, ,
+        sha1_init(&ctx);
+        sha1_loop(&ctx, data, 60);
+        sha1_result(&ctx, result);
+        sink += result[0]);
+
+    BENCH("sha1_loop/4096", sizeof(data), ,
+        sha1_init(&ctx);
+        sha1_loop(&ctx, data, sizeof(data));
+        sha1_result(&ctx, result);
+        sink += result[0]);
+
+    BENCH("base64_encode/20", SHA1_RESULTLEN, ,
+        base64_encode(encoded, result, SHA1_RESULTLEN);
+        sink += encoded[0]);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filter = argc > 1 ? argv[1] : NULL;
+
+    bench_parser(filter);
+    bench_rate_limit(filter);
+    bench_reassembly(filter);
+    bench_handshake(filter);
+    bench_hash(filter);
+
+    return 0;
+}
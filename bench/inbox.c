@@ -0,0 +1,197 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// cross-thread sends through a sev_inbox
+// usage: inbox [producers] [count]
+//
+// a sev server runs its loop in a thread of its own. once the client
+// connects, each producer thread posts count messages to it with
+// sev_post, tagged with the producer and a sequence number. the client
+// checks that every message arrives exactly once and in the order its
+// producer posted it
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "../example/sev/sev.h"
+#include "../example/sev/sev_inbox.h"
+
+#define PORT 8892
+
+struct message {
+    uint32_t producer;
+    uint32_t seq;
+};
+
+static int producers = 4;
+static int count = 100000;
+
+// the loop thread still uses them while main returns
+static struct sev_server server;
+static struct sev_inbox inbox;
+static sev_handle client;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *produce(void *arg)
+{
+    struct message message = { (long)arg, 0 };
+
+    for (; message.seq < (uint32_t)count; message.seq++)
+        if (sev_post(&inbox, client, (char *)&message, sizeof(message))) {
+            perror("sev_post");
+            exit(1);
+        }
+
+    return NULL;
+}
+
+static void open_cb(struct sev_stream *stream)
+{
+    client = sev_stream_handle(stream);
+
+    for (long i = 0; i < producers; i++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, produce, (void *)i);
+        pthread_detach(thread);
+    }
+}
+
+static void read_cb(struct sev_stream *stream, char *data, size_t len)
+{
+}
+
+static void close_cb(struct sev_stream *stream)
+{
+}
+
+static void *loop(void *arg)
+{
+#ifdef SEV_URING
+    sev_uring_run();
+#else
+    ev_loop(EV_DEFAULT_ 0);
+#endif
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+        producers = atoi(argv[1]);
+    if (argc > 2)
+        count = atoi(argv[2]);
+
+    if (sev_listen(&server, PORT)) {
+        perror("sev_listen");
+        return 1;
+    }
+
+    server.open_cb = open_cb;
+    server.read_cb = read_cb;
+    server.close_cb = close_cb;
+
+    if (sev_inbox_init(&inbox)) {
+        perror("sev_inbox_init");
+        return 1;
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, loop, NULL);
+    pthread_detach(thread);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sd == -1 || connect(sd, (struct sockaddr *)&addr, sizeof(addr))) {
+        perror("connect");
+        return 1;
+    }
+
+    uint32_t *next = calloc(producers, sizeof(uint32_t));
+    long total = (long)producers * count, received = 0;
+
+    char buffer[1 << 16];
+    size_t len = 0;
+
+    double start = now();
+
+    while (received < total) {
+        ssize_t n = read(sd, buffer + len, sizeof(buffer) - len);
+        if (n <= 0) {
+            fprintf(stderr, "closed after %ld messages\n", received);
+            return 1;
+        }
+
+        len += n;
+
+        size_t pos = 0;
+        for (; len - pos >= sizeof(struct message);
+            pos += sizeof(struct message)) {
+            struct message message;
+            memcpy(&message, buffer + pos, sizeof(message));
+
+            if (message.producer >= (uint32_t)producers ||
+                message.seq != next[message.producer]) {
+                fprintf(stderr, "producer %u sent %u, expected %u\n",
+                    message.producer, message.seq,
+                    message.producer < (uint32_t)producers ?
+                    next[message.producer] : 0);
+                return 1;
+            }
+
+            next[message.producer]++;
+            received++;
+        }
+
+        memmove(buffer, buffer + pos, len - pos);
+        len -= pos;
+    }
+
+    double elapsed = now() - start;
+
+    printf("%ld messages from %d producers in %.2fs, %.0f/s\n", total,
+        producers, elapsed, total / elapsed);
+
+    close(sd);
+    free(next);
+    return 0;
+}
@@ -0,0 +1,460 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// loopback load generator for the example server
+//
+// usage: loadgen [-h host] [-p port] [-c conns] [-s size] [-d secs]
+//                [-w window] [-m echo|broadcast] [-P server_pid] [-T]
+//
+// echo: every connection subscribes to its own resource and keeps
+// window messages in flight. broadcast: all connections share one
+// resource and the first one publishes each time its own copy comes
+// back. run it against example and example_uring to compare backends.
+//
+// -T connects over tls, for builds with -DBENCH_TLS (make tls). compare
+// example_tls with -U (userspace tls), without it (kernel tls when
+// available) and example for plaintext.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef BENCH_TLS
+# include <openssl/ssl.h>
+#endif
+#include "../ws.h"
+// after ws.h, which has a member named errno
+#include <errno.h>
+
+struct conn {
+    int sd;
+#ifdef BENCH_TLS
+    SSL *tls;
+#endif
+    struct ws_parser parser;
+    char stamp[sizeof(double)];
+    char *out;
+    size_t out_len;
+    size_t out_pos;
+};
+
+static struct conn *conns;
+static struct pollfd *fds;
+static int num_conns = 100;
+static size_t msg_size = 64;
+static int window = 1;
+static int broadcast;
+
+#ifdef BENCH_TLS
+static SSL_CTX *tls_ctx;
+#endif
+
+static double *samples;
+static size_t num_samples;
+static size_t max_samples;
+static uint64_t received;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void fail(const char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+// resident set size of pid in KiB, or -1
+static long rss_kb(int pid)
+{
+    char path[64], line[256];
+    long kb = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+
+    while (fgets(line, sizeof(line), fp))
+        if (sscanf(line, "VmRSS: %ld", &kb) == 1)
+            break;
+
+    fclose(fp);
+    return kb;
+}
+
+#ifdef BENCH_TLS
+static ssize_t tls_result(struct conn *conn, int ret)
+{
+    if (ret > 0)
+        return ret;
+
+    switch (SSL_get_error(conn->tls, ret)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    default:
+        errno = EIO;
+        return -1;
+    }
+}
+#endif
+
+static ssize_t conn_send(struct conn *conn, const char *data, size_t len)
+{
+#ifdef BENCH_TLS
+    if (conn->tls)
+        return tls_result(conn, SSL_write(conn->tls, data, len));
+#endif
+    return send(conn->sd, data, len, MSG_NOSIGNAL);
+}
+
+static ssize_t conn_recv(struct conn *conn, char *data, size_t len)
+{
+#ifdef BENCH_TLS
+    if (conn->tls)
+        return tls_result(conn, SSL_read(conn->tls, data, len));
+#endif
+    return recv(conn->sd, data, len, 0);
+}
+
+// decrypted data that poll won't report
+static int conn_pending(struct conn *conn)
+{
+#ifdef BENCH_TLS
+    return conn->tls && SSL_pending(conn->tls) > 0;
+#else
+    return 0;
+#endif
+}
+
+static void flush(struct conn *conn)
+{
+    while (conn->out_pos < conn->out_len) {
+        ssize_t n = conn_send(conn, conn->out + conn->out_pos,
+            conn->out_len - conn->out_pos);
+
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                return;
+            fail("send");
+        }
+
+        conn->out_pos += n;
+    }
+
+    conn->out_pos = conn->out_len = 0;
+}
+
+// queue a masked binary frame carrying the current time
+static void send_message(struct conn *conn)
+{
+    size_t need = conn->out_len + WS_FRAME_HEADER_SIZE + 4 + msg_size;
+    conn->out = realloc(conn->out, need);
+
+    char *p = conn->out + conn->out_len;
+    int n = ws_write_frame_header(p, WS_BINARY, msg_size);
+
+    // the payload goes out with a zero mask, so no xor is needed
+    p[1] |= 0x80;
+    memset(p + n, 0, 4);
+    n += 4;
+
+    double t = now();
+    memset(p + n, 'x', msg_size);
+    memcpy(p + n, &t, sizeof(t));
+
+    conn->out_len += n + msg_size;
+    flush(conn);
+}
+
+static void record(double latency)
+{
+    if (num_samples == max_samples) {
+        max_samples = max_samples ? max_samples * 2 : 4096;
+        samples = realloc(samples, max_samples * sizeof(double));
+    }
+
+    samples[num_samples++] = latency;
+}
+
+static int frame_cb(struct ws_frame *frame, void *data)
+{
+    struct conn *conn = data;
+
+    // the timestamp may be split across chunks
+    if (frame->chunk_offset < sizeof(double)) {
+        size_t n = sizeof(double) - frame->chunk_offset;
+        if (n > frame->chunk_len)
+            n = frame->chunk_len;
+        memcpy(conn->stamp + frame->chunk_offset, frame->chunk_data, n);
+    }
+
+    if (frame->chunk_offset + frame->chunk_len < frame->len)
+        return 0;
+
+    double sent;
+    memcpy(&sent, conn->stamp, sizeof(sent));
+    record(now() - sent);
+    received++;
+
+    if (!broadcast || conn == conns)
+        send_message(conn);
+
+    return 0;
+}
+
+static void connect_one(struct conn *conn, struct addrinfo *ai, int i)
+{
+    char request[512], response[WS_BUFFER_SIZE], path[32];
+
+    conn->sd = socket(ai->ai_family, SOCK_STREAM, 0);
+    if (conn->sd < 0)
+        fail("socket");
+
+    if (connect(conn->sd, ai->ai_addr, ai->ai_addrlen) < 0)
+        fail("connect");
+
+    int one = 1;
+    setsockopt(conn->sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+#ifdef BENCH_TLS
+    if (tls_ctx) {
+        conn->tls = SSL_new(tls_ctx);
+        SSL_set_fd(conn->tls, conn->sd);
+        if (SSL_connect(conn->tls) != 1) {
+            fprintf(stderr, "tls handshake failed\n");
+            exit(1);
+        }
+    }
+#endif
+
+    if (broadcast)
+        strcpy(path, "/bench");
+    else
+        snprintf(path, sizeof(path), "/bench/%d", i);
+
+    int len = snprintf(request, sizeof(request),
+        "GET %s HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "\r\n", path);
+
+    if (conn_send(conn, request, len) != len)
+        fail("send");
+
+    // read the response byte by byte so no frame data is consumed
+    size_t pos = 0;
+    while (pos < sizeof(response) - 1) {
+        if (conn_recv(conn, response + pos, 1) != 1)
+            fail("recv");
+        pos++;
+        if (pos >= 4 && !memcmp(response + pos - 4, "\r\n\r\n", 4))
+            break;
+    }
+
+    if (strncmp(response, "HTTP/1.1 101", 12)) {
+        fprintf(stderr, "handshake failed\n");
+        exit(1);
+    }
+
+    ws_parser_init(&conn->parser);
+    conn->parser.frame_cb = frame_cb;
+    conn->parser.data = conn;
+    ws_read_next_frame(&conn->parser);
+
+    if (fcntl(conn->sd, F_SETFL, O_NONBLOCK) < 0)
+        fail("fcntl");
+}
+
+static void run(double duration)
+{
+    static char buf[65536];
+    double end = now() + duration;
+
+    for (int i = 0; i < num_conns; i++) {
+        fds[i].fd = conns[i].sd;
+        fds[i].events = POLLIN;
+    }
+
+    if (broadcast)
+        send_message(conns);
+    else
+        for (int i = 0; i < num_conns; i++)
+            for (int j = 0; j < window; j++)
+                send_message(&conns[i]);
+
+    while (now() < end) {
+        for (int i = 0; i < num_conns; i++)
+            fds[i].events = conns[i].out_len ? POLLIN | POLLOUT : POLLIN;
+
+        if (poll(fds, num_conns, 100) < 0) {
+            if (errno == EINTR)
+                continue;
+            fail("poll");
+        }
+
+        for (int i = 0; i < num_conns; i++) {
+            struct conn *conn = &conns[i];
+
+            if (fds[i].revents & POLLOUT)
+                flush(conn);
+
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+
+            do {
+                ssize_t n = conn_recv(conn, buf, sizeof(buf));
+                if (n == 0) {
+                    fprintf(stderr, "server closed connection %d\n", i);
+                    exit(1);
+                }
+                if (n < 0) {
+                    if (errno == EAGAIN || errno == EINTR)
+                        break;
+                    fail("recv");
+                }
+
+                if (ws_parse_all(&conn->parser, buf, n)) {
+                    fprintf(stderr, "parse error on connection %d\n", i);
+                    exit(1);
+                }
+            } while (conn_pending(conn));
+        }
+    }
+}
+
+static int compare(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double q)
+{
+    if (!num_samples)
+        return 0;
+
+    return samples[(size_t)(q * (num_samples - 1))];
+}
+
+int main(int argc, char *argv[])
+{
+    const char *host = "127.0.0.1";
+    const char *port = "8888";
+    double duration = 5;
+    int pid = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:c:s:d:w:m:P:T")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 'c': num_conns = atoi(optarg); break;
+        case 's': msg_size = atoi(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'w': window = atoi(optarg); break;
+        case 'm': broadcast = !strcmp(optarg, "broadcast"); break;
+        case 'P': pid = atoi(optarg); break;
+#ifdef BENCH_TLS
+        case 'T':
+            // a benchmark against a local self-signed cert, no verification
+            tls_ctx = SSL_CTX_new(TLS_client_method());
+            SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+            break;
+#endif
+        default:
+            fprintf(stderr, "usage: %s [-h host] [-p port] [-c conns] "
+                "[-s size] [-d secs] [-w window] [-m echo|broadcast] "
+                "[-P server_pid] [-T]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (msg_size < sizeof(double))
+        msg_size = sizeof(double);
+
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *ai;
+    int err = getaddrinfo(host, port, &hints, &ai);
+    if (err) {
+        fprintf(stderr, "%s\n", gai_strerror(err));
+        return 1;
+    }
+
+    conns = calloc(num_conns, sizeof(struct conn));
+    fds = calloc(num_conns, sizeof(struct pollfd));
+
+    long rss_before = pid ? rss_kb(pid) : -1;
+
+    for (int i = 0; i < num_conns; i++)
+        connect_one(&conns[i], ai, i);
+
+    freeaddrinfo(ai);
+
+    long rss_idle = pid ? rss_kb(pid) : -1;
+
+    double start = now();
+    run(duration);
+    double elapsed = now() - start;
+
+    long rss_busy = pid ? rss_kb(pid) : -1;
+
+    qsort(samples, num_samples, sizeof(double), compare);
+
+    printf("mode       %s\n", broadcast ? "broadcast" : "echo");
+    printf("conns      %d\n", num_conns);
+    printf("size       %zu\n", msg_size);
+    printf("msgs/sec   %.0f\n", received / elapsed);
+    printf("MB/sec     %.1f\n", received * msg_size / elapsed / 1e6);
+    printf("p50        %.1f us\n", percentile(0.5) * 1e6);
+    printf("p99        %.1f us\n", percentile(0.99) * 1e6);
+    printf("p999       %.1f us\n", percentile(0.999) * 1e6);
+
+    if (rss_before >= 0 && rss_idle >= 0 && rss_busy >= 0) {
+        printf("rss        %ld KiB idle, %ld KiB busy\n", rss_idle, rss_busy);
+        printf("rss/conn   %.1f KiB\n",
+            (double)(rss_idle - rss_before) / num_conns);
+    }
+
+    return 0;
+}
@@ -0,0 +1,295 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// replays a capture written by sev_capture_open through the parser
+//
+// usage: replay [-t] [-n loops] capture-file
+//
+// -t keeps the original timing between records, otherwise records are
+// fed as fast as possible. the capture is mapped read only and parsed
+// with dest_cb, so it is never copied or modified
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../ws.h"
+#include "../example/sev/sev_capture.h"
+
+static struct ws_parser **parsers;
+static size_t num_parsers;
+
+static uint64_t handshakes;
+static uint64_t frames;
+static uint64_t errors;
+
+static uint64_t *latencies;
+static size_t num_latencies;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int header_cb(struct ws_header *header, void *data)
+{
+    handshakes++;
+    return 0;
+}
+
+static int frame_cb(struct ws_frame *frame, void *data)
+{
+    if (frame->chunk_offset + frame->chunk_len == frame->len)
+        frames++;
+    return 0;
+}
+
+static char *dest_cb(struct ws_frame *frame, void *data)
+{
+    // chunks never exceed WS_BUFFER_SIZE - 1 bytes
+    static char scratch[WS_BUFFER_SIZE];
+    return scratch;
+}
+
+static struct ws_parser *parser_get(uint32_t id)
+{
+    if (id >= num_parsers) {
+        size_t n = num_parsers ? num_parsers : 64;
+        while (n <= id)
+            n *= 2;
+
+        parsers = realloc(parsers, n * sizeof(struct ws_parser *));
+        memset(parsers + num_parsers, 0,
+            (n - num_parsers) * sizeof(struct ws_parser *));
+        num_parsers = n;
+    }
+
+    if (!parsers[id]) {
+        parsers[id] = malloc(sizeof(struct ws_parser));
+        ws_parser_init(parsers[id]);
+        parsers[id]->header_cb = header_cb;
+        parsers[id]->frame_cb = frame_cb;
+        parsers[id]->dest_cb = dest_cb;
+    }
+
+    return parsers[id];
+}
+
+static void parser_drop(uint32_t id)
+{
+    if (id >= num_parsers || !parsers[id])
+        return;
+
+    ws_parser_free(parsers[id]);
+    free(parsers[id]);
+    parsers[id] = NULL;
+}
+
+// feed every record once, returns the time spent parsing in ns
+static uint64_t replay(const char *map, size_t size, int timing)
+{
+    const char *p = map + SEV_CAPTURE_MAGIC_LEN;
+    const char *end = map + size;
+    uint64_t parse_ns = 0;
+    uint64_t first = 0, start = now_ns();
+
+    while (end - p >= sizeof(struct sev_capture_record)) {
+        struct sev_capture_record record;
+        memcpy(&record, p, sizeof(record));
+        p += sizeof(record);
+
+        if (record.len > end - p) {
+            fprintf(stderr, "truncated record\n");
+            break;
+        }
+
+        const char *data = p;
+        p += record.len;
+
+        if (timing) {
+            if (!first)
+                first = record.time;
+
+            int64_t wait = (record.time - first) - (now_ns() - start);
+            if (wait > 0) {
+                struct timespec ts = { wait / 1000000000, wait % 1000000000 };
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        if (record.type == SEV_CAPTURE_OPEN) {
+            parser_drop(record.stream);
+            parser_get(record.stream);
+        }
+        else if (record.type == SEV_CAPTURE_CLOSE) {
+            parser_drop(record.stream);
+        }
+        else if (record.type == SEV_CAPTURE_DATA) {
+            struct ws_parser *parser = parser_get(record.stream);
+
+            // a stream that failed once is ignored until it reopens
+            if (parser->errno)
+                continue;
+
+            uint64_t t = now_ns();
+            if (ws_parse_all(parser, (char *)data, record.len) == -1) {
+                if (!parser->errno)
+                    parser->errno = WS_ERROR;
+                errors++;
+            }
+            t = now_ns() - t;
+
+            parse_ns += t;
+            latencies[num_latencies++] = t;
+        }
+    }
+
+    for (uint32_t id = 0; id < num_parsers; id++)
+        parser_drop(id);
+
+    return parse_ns;
+}
+
+// counts data records and bytes, returns -1 if the file isn't a capture
+static int scan(const char *map, size_t size, size_t *records,
+    uint64_t *bytes)
+{
+    if (size < SEV_CAPTURE_MAGIC_LEN ||
+        memcmp(map, SEV_CAPTURE_MAGIC, SEV_CAPTURE_MAGIC_LEN))
+        return -1;
+
+    const char *p = map + SEV_CAPTURE_MAGIC_LEN;
+    const char *end = map + size;
+
+    *records = 0;
+    *bytes = 0;
+
+    while (end - p >= sizeof(struct sev_capture_record)) {
+        struct sev_capture_record record;
+        memcpy(&record, p, sizeof(record));
+        p += sizeof(record);
+
+        if (record.len > end - p)
+            break;
+
+        if (record.type == SEV_CAPTURE_DATA) {
+            (*records)++;
+            *bytes += record.len;
+        }
+
+        p += record.len;
+    }
+
+    return 0;
+}
+
+static int compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double q)
+{
+    if (!num_latencies)
+        return 0;
+
+    return latencies[(size_t)(q * (num_latencies - 1))] / 1e3;
+}
+
+int main(int argc, char *argv[])
+{
+    int timing = 0;
+    int loops = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "tn:")) != -1) {
+        switch (opt) {
+        case 't': timing = 1; break;
+        case 'n': loops = atoi(optarg); break;
+        default:
+            optind = argc;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-t] [-n loops] capture-file\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    const char *map = "";
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            return 1;
+        }
+    }
+
+    size_t records;
+    uint64_t bytes;
+    if (scan(map, st.st_size, &records, &bytes) == -1) {
+        fprintf(stderr, "%s: not a capture file\n", argv[optind]);
+        return 1;
+    }
+
+    latencies = malloc((records * loops + 1) * sizeof(uint64_t));
+
+    uint64_t parse_ns = 0;
+    for (int i = 0; i < loops; i++)
+        parse_ns += replay(map, st.st_size, timing);
+
+    qsort(latencies, num_latencies, sizeof(uint64_t), compare);
+
+    double seconds = parse_ns / 1e9;
+
+    printf("records    %zu x %d\n", records, loops);
+    printf("bytes      %llu x %d\n", (unsigned long long)bytes, loops);
+    printf("handshakes %llu\n", (unsigned long long)handshakes);
+    printf("frames     %llu\n", (unsigned long long)frames);
+    printf("errors     %llu\n", (unsigned long long)errors);
+    printf("parse      %.3f ms\n", seconds * 1e3);
+    if (seconds > 0)
+        printf("throughput %.1f MB/s\n", bytes * loops / seconds / 1e6);
+    printf("p50        %.2f us\n", percentile(0.5));
+    printf("p99        %.2f us\n", percentile(0.99));
+    printf("p999       %.2f us\n", percentile(0.999));
+    printf("max        %.2f us\n", percentile(1));
+
+    return 0;
+}
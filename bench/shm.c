@@ -0,0 +1,165 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// round trips over a sev_shm channel, against example -S path
+// usage: shm path [count] [size]
+//
+// sends a masked text frame, waits for all of it to come back, then
+// sends the next.
+// the latency printed is the whole round trip, both wakeups included
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../example/sev/sev_shm.h"
+#include "../ws.h"
+
+static int count = 100000;
+static size_t size = 64;
+
+static char *frame;
+static size_t frame_len;
+
+static double *samples;
+static int done;
+static size_t received;
+static double sent_at;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void send_next(struct sev_shm *shm)
+{
+    sent_at = now();
+    sev_shm_send(shm, frame, frame_len);
+}
+
+static int frame_cb(struct ws_frame *frame, void *data)
+{
+    struct sev_shm *shm = data;
+
+    // the example echoes each chunk as a frame of its own
+    received += frame->chunk_len;
+    if (received < size)
+        return 0;
+
+    received = 0;
+
+    samples[done++] = now() - sent_at;
+
+    if (done == count)
+        ev_break(EV_DEFAULT_ EVBREAK_ALL);
+    else
+        send_next(shm);
+
+    return 0;
+}
+
+static void read_cb(struct sev_shm *shm, char *data, size_t len)
+{
+    if (ws_parse_all(shm->data, data, len) == -1) {
+        fprintf(stderr, "bad frame\n");
+        exit(1);
+    }
+}
+
+static void close_cb(struct sev_shm *shm)
+{
+    fprintf(stderr, "closed after %d round trips\n", done);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: shm path [count] [size]\n");
+        return 1;
+    }
+
+    if (argc > 2)
+        count = atoi(argv[2]);
+    if (argc > 3)
+        size = atoi(argv[3]);
+
+    // like a client's, masked with a zero key
+    frame = malloc(WS_FRAME_HEADER_SIZE + 4 + size);
+    frame_len = ws_write_frame_header(frame, WS_TEXT, size);
+    frame[1] |= 0x80;
+    memset(frame + frame_len, 0, 4);
+    memset(frame + frame_len + 4, 'x', size);
+    frame_len += 4 + size;
+
+    samples = malloc(count * sizeof(double));
+
+    struct sev_shm *shm = sev_shm_connect(argv[1]);
+    if (shm == NULL) {
+        perror("sev_shm_connect");
+        return 1;
+    }
+
+    struct ws_parser parser;
+    ws_parser_init(&parser);
+    ws_read_next_frame(&parser);
+    parser.frame_cb = frame_cb;
+    parser.data = shm;
+
+    shm->read_cb = read_cb;
+    shm->close_cb = close_cb;
+    shm->data = &parser;
+
+    double start = now();
+    send_next(shm);
+    ev_loop(EV_DEFAULT_ 0);
+    double elapsed = now() - start;
+
+    qsort(samples, count, sizeof(double), compare);
+
+    printf("%d round trips of %zu bytes in %.2fs, %.0f/s\n", count, size,
+        elapsed, count / elapsed);
+    printf("p50 %.1fus p99 %.1fus p999 %.1fus max %.1fus\n",
+        samples[count / 2] * 1e6, samples[count * 99 / 100] * 1e6,
+        samples[count * 999 / 1000] * 1e6, samples[count - 1] * 1e6);
+
+    // the server sees the socket close
+    shm->close_cb = NULL;
+    sev_shm_close(shm);
+    ws_parser_free(&parser);
+
+    free(samples);
+    free(frame);
+    return 0;
+}
@@ -0,0 +1,257 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// MSG_ZEROCOPY against plain send for a range of sizes, to pick
+// sev_server.zerocopy_threshold
+// usage: zerocopy [host port]
+//
+// without arguments it sends to a sink thread over loopback, where the
+// kernel copies on delivery and zero copy rarely pays off. give the
+// address of a remote sink (e.g. nc -l port > /dev/null) to measure a
+// real nic.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#define MIN_TIME 0.3 // seconds per run
+
+static const size_t sizes[] = {
+    4 << 10, 16 << 10, 32 << 10, 64 << 10, 128 << 10, 256 << 10, 1 << 20
+};
+
+#define NUM_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+struct run {
+    uint32_t sent;
+    uint32_t done;
+    uint64_t copied;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *sink(void *arg)
+{
+    int sd = (long)arg;
+    static char buffer[1 << 20];
+
+    while (recv(sd, buffer, sizeof(buffer), 0) > 0)
+        ;
+
+    close(sd);
+    return NULL;
+}
+
+// a connected socket, to host:port or to a new sink thread
+static int open_conn(const char *host, const char *port)
+{
+    if (host) {
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+
+        if (getaddrinfo(host, port, &hints, &res) != 0)
+            return -1;
+
+        int sd = socket(res->ai_family, SOCK_STREAM, 0);
+        if (connect(sd, res->ai_addr, res->ai_addrlen) == -1) {
+            close(sd);
+            sd = -1;
+        }
+
+        freeaddrinfo(res);
+        return sd;
+    }
+
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int ld = socket(AF_INET, SOCK_STREAM, 0);
+    if (bind(ld, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(ld, 1) == -1 ||
+        getsockname(ld, (struct sockaddr *)&addr, &addr_len) == -1) {
+        close(ld);
+        return -1;
+    }
+
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(sd, (struct sockaddr *)&addr, addr_len) == -1) {
+        close(sd);
+        close(ld);
+        return -1;
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, sink, (void *)(long)accept(ld, NULL, NULL));
+    pthread_detach(thread);
+
+    close(ld);
+    return sd;
+}
+
+// read completions, waiting for all of them if wait is set
+static void reap(int sd, struct run *run, int wait)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+
+    while (run->done != run->sent) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(sd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            if (!wait)
+                return;
+
+            struct pollfd pfd = { sd, 0, 0 };
+            poll(&pfd, 1, 100);
+            continue;
+        }
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == NULL)
+            continue;
+
+        struct sock_extended_err *err = (void *)CMSG_DATA(cmsg);
+        if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            continue;
+
+        if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            run->copied += err->ee_data - err->ee_info + 1;
+
+        run->done = err->ee_data + 1;
+    }
+}
+
+// bytes per second sending len bytes at a time, including the wait for
+// the last completions with zero copy
+static double measure(const char *host, const char *port, const char *data,
+    size_t len, int zerocopy, struct run *run)
+{
+    int sd = open_conn(host, port);
+    if (sd == -1) {
+        perror("connect");
+        exit(1);
+    }
+
+    int one = 1;
+    if (zerocopy &&
+        setsockopt(sd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1) {
+        perror("SO_ZEROCOPY");
+        exit(1);
+    }
+
+    memset(run, 0, sizeof(*run));
+    uint64_t bytes = 0;
+    double start = now(), elapsed;
+
+    do {
+        for (int i = 0; i < 64; i++) {
+            ssize_t n = send(sd, data, len, zerocopy ? MSG_ZEROCOPY : 0);
+
+            if (n == -1 && errno == ENOBUFS) {
+                // out of memory for notifications, sev copies then too
+                reap(sd, run, 0);
+                n = send(sd, data, len, 0);
+            }
+            else if (n > 0 && zerocopy) {
+                run->sent++;
+            }
+
+            if (n == -1) {
+                perror("send");
+                exit(1);
+            }
+
+            bytes += n;
+        }
+
+        if (zerocopy)
+            reap(sd, run, 0);
+
+        elapsed = now() - start;
+    } while (elapsed < MIN_TIME);
+
+    if (zerocopy) {
+        reap(sd, run, 1);
+        elapsed = now() - start;
+    }
+
+    close(sd);
+    return bytes / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *host = argc > 2 ? argv[1] : NULL;
+    const char *port = argc > 2 ? argv[2] : NULL;
+
+    size_t max = sizes[NUM_SIZES - 1];
+    char *data = malloc(max);
+    memset(data, 'x', max);
+
+    size_t crossover = 0;
+
+    printf("%10s %12s %12s %8s\n", "size", "copy MB/s", "zc MB/s", "copied");
+
+    for (size_t i = 0; i < NUM_SIZES; i++) {
+        struct run run;
+        double copy = measure(host, port, data, sizes[i], 0, &run);
+        double zc = measure(host, port, data, sizes[i], 1, &run);
+
+        printf("%10zu %12.1f %12.1f %7.0f%%\n", sizes[i], copy / 1e6,
+            zc / 1e6, run.sent ? 100.0 * run.copied / run.sent : 0.0);
+
+        if (!crossover && zc > copy)
+            crossover = sizes[i];
+    }
+
+    if (crossover)
+        printf("zero copy wins from %zu bytes\n", crossover);
+    else
+        printf("zero copy never wins on this path\n");
+
+    free(data);
+    return 0;
+}
@@ -23,29 +23,104 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _POSIX_C_SOURCE 200809L
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
-#include <ev.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "sev/sev.h"
+#include "sev/sev_router.h"
+#include "sev/sev_capture.h"
+#include "sev/sev_handoff.h"
+#ifndef SEV_URING
+# include "sev/sev_shm.h"
+#endif
 #include "../ws.h"
+#include "../ws_h2.h"
+#include "../ws_metrics.h"
 
 #define PORT 8888
 
+// with -2, websockets over http/2 (rfc 8441), cleartext only
+#define H2_PORT 8889
+
+// seconds a client has to complete the handshake
+#define HANDSHAKE_TIMEOUT 10
+
+// seconds between pings once connected
+#define PING_INTERVAL 30
+
+// per client, reading pauses when exceeded
+#define MAX_FRAMES 10000 // per second
+#define MAX_BYTES (16 << 20) // per second
+
+// write queue limit, file segments count towards it too
+#define HIGH_WATERMARK (1 << 20)
+
+// clients on the same resource form a channel
+static struct sev_router router;
+
+// with -F, clients on /files/<name> are sent that file as a binary frame
+static const char *files_dir;
+
+static void send_file(struct sev_stream *stream, const char *name)
+{
+    char path[1024];
+
+    if (strchr(name, '/') || name[0] == '.' ||
+        snprintf(path, sizeof(path), "%s/%s", files_dir, name) >=
+        (int)sizeof(path))
+        return;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size <= HIGH_WATERMARK) {
+        // only the header is copied, the kernel sends the payload
+        char header[WS_FRAME_HEADER_SIZE];
+        int header_len = ws_write_frame_header(header, WS_BINARY, st.st_size);
+        sev_send_file(stream, header, header_len, fd, 0, st.st_size);
+    }
+
+    close(fd);
+}
+
 static void send_error(struct sev_stream *stream)
 {
     char buffer[WS_HTTP_RESPONSE_SIZE];
-    ws_write_http_error(buffer);
-    sev_send(stream, buffer, strlen(buffer));
+    int len = ws_write_http_error(buffer);
+    sev_send(stream, buffer, len);
 }
 
 static int header_cb(struct ws_header *header, void *data)
 {
     printf("resource: %s\n", header->resource);
 
+#ifdef SEV_TLS
+    struct sev_stream *stream = data;
+    if (stream->tls)
+        printf("tls: %s\n", stream->ktls_send && stream->ktls_recv ? "kernel" :
+            stream->ktls_send ? "kernel send" : "userspace");
+#endif
+
     char buffer[WS_HTTP_RESPONSE_SIZE];
-    ws_write_http_handshake(buffer, header->websocket_key);
-    sev_send(data, buffer, strlen(buffer));
+    int len = ws_write_http_handshake(buffer, header->websocket_key);
+    sev_send(data, buffer, len);
+
+    if (files_dir && strncmp(header->resource, "/files/", 7) == 0)
+        send_file(data, header->resource + 7);
+
+    sev_router_subscribe(&router, header->resource, data);
+
+    // replace the handshake deadline with the ping schedule
+    sev_set_timeout(data, PING_INTERVAL);
 
     return 0;
 }
@@ -56,60 +131,440 @@ static int frame_cb(struct ws_frame *frame, void *data)
         frame->chunk_len, frame->chunk_offset,
         frame->len, frame->opcode);
 
-    frame->chunk_data[frame->chunk_len] = '\0';
-    printf("%s\n", frame->chunk_data);
+    printf("%.*s\n", (int)frame->chunk_len, frame->chunk_data);
 
-    // send the data back to the client
-    char header[10];
-    int header_len = ws_write_frame_header(header, WS_TEXT, frame->chunk_len);
-    sev_send(data, header, header_len);
-    sev_send(data, frame->chunk_data, frame->chunk_len);
+    // broadcast the data to the channel, framed once for every client
+    struct sev_stream *stream = data;
+    struct ws_parser *parser = stream->data;
+
+    struct sev_shared *shared =
+        sev_shared_new(WS_FRAME_HEADER_SIZE + frame->chunk_len);
+    int header_len = ws_write_frame_header(shared->data, WS_TEXT,
+        frame->chunk_len);
+    memcpy(shared->data + header_len, frame->chunk_data, frame->chunk_len);
+    shared->len = header_len + frame->chunk_len;
+
+    sev_router_publish(&router, parser->header.resource, shared);
+    sev_shared_unref(shared);
 
     return 0;
 }
 
-static void open_cb(struct sev_stream *stream)
+static struct ws_parser *parser_new(struct sev_stream *stream)
 {
-    printf("open %s:%d\n", stream->remote_address, stream->remote_port);
-
     struct ws_parser *parser = malloc(sizeof(struct ws_parser));
     ws_parser_init(parser);
     parser->header_cb = header_cb;
     parser->frame_cb = frame_cb;
+    ws_set_rate_limit(parser, MAX_FRAMES, MAX_FRAMES, MAX_BYTES, MAX_BYTES);
 
     parser->data = stream;
     stream->data = parser;
+    return parser;
+}
+
+static void open_cb(struct sev_stream *stream)
+{
+    char address[SEV_ADDRSTRLEN];
+    sev_remote_address(stream, address, sizeof(address));
+    printf("open %s:%d\n", address, sev_remote_port(stream));
+
+    parser_new(stream);
+    sev_set_timeout(stream, HANDSHAKE_TIMEOUT);
+}
+
+#ifndef SEV_URING
+// with -H, the parser moves to the next process on restart
+static size_t save_cb(struct sev_stream *stream, char *out, size_t size)
+{
+    return ws_parser_save(stream->data, out, size);
+}
+
+static void restore_cb(struct sev_stream *stream, const char *data,
+    size_t len)
+{
+    char address[SEV_ADDRSTRLEN];
+    sev_remote_address(stream, address, sizeof(address));
+    printf("restore %s:%d\n", address, sev_remote_port(stream));
+
+    struct ws_parser *parser = parser_new(stream);
+
+    if (ws_parser_restore(parser, data, len) == -1) {
+        sev_close(stream);
+        return;
+    }
+
+    if (parser->read_fn == ws_read_http_header) {
+        sev_set_timeout(stream, HANDSHAKE_TIMEOUT);
+        return;
+    }
+
+    // rejoin the channel, the handshake happened in the old process
+    sev_router_subscribe(&router, parser->header.resource, stream);
+    sev_set_timeout(stream, PING_INTERVAL);
+}
+#endif
+
+static void timeout_cb(struct sev_stream *stream)
+{
+    struct ws_parser *parser = stream->data;
+
+    if (parser->read_fn == ws_read_http_header) {
+        char address[SEV_ADDRSTRLEN];
+        sev_remote_address(stream, address, sizeof(address));
+        printf("handshake timeout %s\n", address);
+        sev_close(stream);
+        return;
+    }
+
+    char header[WS_FRAME_HEADER_SIZE];
+    int header_len = ws_write_frame_header(header, WS_PING, 0);
+    sev_send(stream, header, header_len);
+
+    sev_set_timeout(stream, PING_INTERVAL);
 }
 
 static void read_cb(struct sev_stream *stream, char *data, size_t len)
 {
-    if (ws_parse_all(stream->data, data, len) == -1)
-        send_error(stream);
+    struct ws_parser *parser = stream->data;
+
+    // with -T, the chunks carry when the kernel received them
+    parser->rx_timestamp = stream->rx_timestamp;
+
+    if (ws_parse_all(parser, data, len) == -1) {
+        if (parser->errno == WS_RATE_LIMITED)
+            sev_close(stream);
+        else
+            send_error(stream);
+        return;
+    }
+
+    sev_pause_read(stream, ws_rate_delay(parser));
 }
 
 static void close_cb(struct sev_stream *stream)
 {
-    printf("close %s\n", stream->remote_address);
+    char address[SEV_ADDRSTRLEN];
+    sev_remote_address(stream, address, sizeof(address));
+    printf("close %s\n", address);
+
+    struct sev_stats stats;
+    sev_get_stats(&stats);
+    printf("streams %zu full %zu paused %zu queued %zu max idle %.1fs\n",
+        stats.streams, stats.full, stats.paused, stats.queued, stats.max_idle);
+
+#ifdef WS_METRICS
+    char metrics[2048];
+    ws_metrics_snapshot(metrics, sizeof(metrics));
+    fputs(metrics, stdout);
+#endif
     ws_parser_free(stream->data);
     free(stream->data);
 }
 
+// http/2 streams share the connection's sev_stream while the router
+// works on whole sev_streams, so they echo instead of joining a channel
+static int h2_frame_cb(struct ws_frame *frame, void *data)
+{
+    struct ws_h2_stream *stream = data;
+
+    printf("h2 stream %u got %zu bytes, opcode %d\n", stream->id,
+        frame->chunk_len, frame->opcode);
+
+    if (frame->opcode == WS_CONNECTION_CLOSE) {
+        ws_h2_close(stream);
+        return 0;
+    }
+
+    char header[WS_FRAME_HEADER_SIZE];
+    int header_len = ws_write_frame_header(header, WS_TEXT, frame->chunk_len);
+    ws_h2_send(stream, header, header_len);
+    ws_h2_send(stream, frame->chunk_data, frame->chunk_len);
+
+    return 0;
+}
+
+static int h2_connect_cb(struct ws_h2_stream *stream,
+    struct ws_header *header, void *data)
+{
+    printf("h2 stream %u resource: %s\n", stream->id, header->resource);
+
+    stream->parser.frame_cb = h2_frame_cb;
+    ws_set_rate_limit(&stream->parser, MAX_FRAMES, MAX_FRAMES, MAX_BYTES,
+        MAX_BYTES);
+
+    return 0;
+}
+
+static void h2_stream_close_cb(struct ws_h2_stream *stream, void *data)
+{
+    printf("h2 stream %u closed\n", stream->id);
+}
+
+static void h2_write_cb(const char *out, size_t len, void *data)
+{
+    sev_send(data, out, len);
+}
+
+static void h2_open_cb(struct sev_stream *stream)
+{
+    char address[SEV_ADDRSTRLEN];
+    sev_remote_address(stream, address, sizeof(address));
+    printf("h2 open %s:%d\n", address, sev_remote_port(stream));
+
+    struct ws_h2 *h2 = malloc(sizeof(struct ws_h2));
+    ws_h2_init(h2);
+    h2->connect_cb = h2_connect_cb;
+    h2->close_cb = h2_stream_close_cb;
+    h2->write_cb = h2_write_cb;
+
+    h2->data = stream;
+    stream->data = h2;
+}
+
+static void h2_read_cb(struct sev_stream *stream, char *data, size_t len)
+{
+    // give the GOAWAY a moment to go out, then close
+    if (ws_h2_parse(stream->data, data, len) == -1)
+        sev_set_timeout(stream, 1);
+}
+
+// the peer's credit follows our output, a client that doesn't read its
+// replies stops getting window updates
+static void h2_full_cb(struct sev_stream *stream)
+{
+    ws_h2_hold(stream->data, 1);
+}
+
+static void h2_drain_cb(struct sev_stream *stream)
+{
+    ws_h2_hold(stream->data, 0);
+}
+
+static void h2_close_cb(struct sev_stream *stream)
+{
+    ws_h2_free(stream->data);
+    free(stream->data);
+}
+
+#ifndef SEV_URING
+// with -S, local consumers send frames over shared memory. they aren't
+// sev_streams either, so they echo like the h2 streams
+static int shm_frame_cb(struct ws_frame *frame, void *data)
+{
+    struct sev_shm *shm = data;
+
+    printf("shm got %zu bytes, opcode %d\n", frame->chunk_len,
+        frame->opcode);
+
+    if (frame->opcode == WS_CONNECTION_CLOSE) {
+        sev_shm_close(shm);
+        return 0;
+    }
+
+    char header[WS_FRAME_HEADER_SIZE];
+    int header_len = ws_write_frame_header(header, WS_TEXT, frame->chunk_len);
+    sev_shm_send(shm, header, header_len);
+    sev_shm_send(shm, frame->chunk_data, frame->chunk_len);
+
+    return 0;
+}
+
+static void shm_open_cb(struct sev_shm *shm)
+{
+    printf("shm open\n");
+
+    // no http handshake, the frames start right away
+    struct ws_parser *parser = malloc(sizeof(struct ws_parser));
+    ws_parser_init(parser);
+    ws_read_next_frame(parser);
+    parser->frame_cb = shm_frame_cb;
+    parser->data = shm;
+
+    shm->data = parser;
+}
+
+static void shm_read_cb(struct sev_shm *shm, char *data, size_t len)
+{
+    if (ws_parse_all(shm->data, data, len) == -1)
+        sev_shm_close(shm);
+}
+
+static void shm_close_cb(struct sev_shm *shm)
+{
+    printf("shm closed\n");
+
+    ws_parser_free(shm->data);
+    free(shm->data);
+}
+#endif
+
+static void server_setup(struct sev_server *server)
+{
+    server->open_cb = open_cb;
+    server->read_cb = read_cb;
+    server->close_cb = close_cb;
+    server->timeout_cb = timeout_cb;
+
+    // pongs count as activity, so this only drops dead connections
+    server->idle_timeout = 3 * PING_INTERVAL;
+
+    // drop clients that can't keep up instead of buffering without bound
+    server->high_watermark = HIGH_WATERMARK;
+    server->low_watermark = 256 << 10;
+    server->overflow_policy = SEV_DISCONNECT;
+
+    // a broadcast's frames leave in full segments, one write per client
+    server->cork = 1;
+}
+
 int main(int argc, char *argv[])
 {
     signal(SIGPIPE, SIG_IGN);
 
+    // example [-C cert.pem -K key.pem [-U]] [-F dir] [-H path] [-2] [-T]
+    //     [-S path] [-6] [-L path] [capture-file]
+    // the tls options need -DSEV_TLS, -U keeps tls in userspace instead
+    // of handing it to the kernel. -H takes over the port and clients
+    // from an instance started with the same path, see sev_handoff.h.
+    // -2 also serves websockets over h2c on H2_PORT. -T turns on kernel
+    // timestamps for the latency histograms, built with -DWS_METRICS.
+    // -S takes local consumers over shared memory, see sev_shm.h.
+    // -6 listens on PORT for both ipv6 and ipv4 clients, -L also serves
+    // plain websockets on a unix socket at path, not handed off by -H
+    const char *cert = NULL, *key = NULL;
+    const char *handoff_path = NULL;
+    const char *shm_path = NULL;
+    const char *unix_path = NULL;
+    int ipv6 = 0;
+    int h2 = 0;
+    int timestamps = 0;
+    int opt;
+#ifdef SEV_TLS
+    int ktls = 1;
+#endif
+
+    while ((opt = getopt(argc, argv, "C:K:UF:H:2TS:6L:")) != -1) {
+        switch (opt) {
+        case 'C': cert = optarg; break;
+        case 'K': key = optarg; break;
+        case 'F': files_dir = optarg; break;
+        case 'H': handoff_path = optarg; break;
+        case '2': h2 = 1; break;
+        case 'T': timestamps = 1; break;
+        case 'S': shm_path = optarg; break;
+        case '6': ipv6 = 1; break;
+        case 'L': unix_path = optarg; break;
+#ifdef SEV_TLS
+        case 'U': ktls = 0; break;
+#endif
+        default: return -1;
+        }
+    }
+
     struct sev_server server;
+    sev_router_init(&router);
 
-    if (sev_listen(&server, PORT)) {
+    int sd = -1;
+#ifndef SEV_URING
+    if (handoff_path)
+        sd = sev_handoff_recv(handoff_path);
+#else
+    if (handoff_path || shm_path) {
+        fprintf(stderr, "-H and -S need the libev backend\n");
+        return -1;
+    }
+#endif
+
+    if (sd != -1 ? sev_listen_fd(&server, sd) :
+        ipv6 ? sev_listen6(&server, PORT) : sev_listen(&server, PORT)) {
         perror("sev_listen");
         return -1;
     }
 
-    server.open_cb = open_cb;
-    server.read_cb = read_cb;
-    server.close_cb = close_cb;
+    if (cert || key) {
+#ifdef SEV_TLS
+        if (sev_tls_init(&server, cert, key, ktls)) {
+            fprintf(stderr, "sev_tls_init failed\n");
+            return -1;
+        }
+#else
+        fprintf(stderr, "built without SEV_TLS\n");
+        return -1;
+#endif
+    }
+
+    server_setup(&server);
+    server.timestamps = timestamps;
+
+    struct sev_server unix_server;
+
+    if (unix_path) {
+        if (sev_listen_unix(&unix_server, unix_path)) {
+            perror("sev_listen_unix");
+            return -1;
+        }
+
+        server_setup(&unix_server);
+    }
+
+    struct sev_server h2_server;
+
+    if (h2) {
+        if (sev_listen(&h2_server, H2_PORT)) {
+            perror("sev_listen");
+            return -1;
+        }
+
+        h2_server.open_cb = h2_open_cb;
+        h2_server.read_cb = h2_read_cb;
+        h2_server.close_cb = h2_close_cb;
+
+        // http/2 flow control bounds what each stream can make us queue
+        h2_server.high_watermark = HIGH_WATERMARK;
+        h2_server.low_watermark = 256 << 10;
+        h2_server.overflow_policy = SEV_PAUSE;
+        h2_server.full_cb = h2_full_cb;
+        h2_server.drain_cb = h2_drain_cb;
+        h2_server.cork = 1;
+    }
+
+    // a capture file records the traffic for bench/replay
+    if (optind < argc && sev_capture_open(argv[optind])) {
+        perror("sev_capture_open");
+        return -1;
+    }
+
+#ifndef SEV_URING
+    if (handoff_path) {
+        sev_handoff_adopt(&server, restore_cb);
+
+        if (sev_handoff_listen(&server, handoff_path, save_cb)) {
+            perror("sev_handoff_listen");
+            return -1;
+        }
+    }
+
+    struct sev_shm_server shm_server;
+    memset(&shm_server, 0, sizeof(shm_server));
+
+    if (shm_path) {
+        if (sev_shm_listen(&shm_server, shm_path)) {
+            perror("sev_shm_listen");
+            return -1;
+        }
+
+        shm_server.open_cb = shm_open_cb;
+        shm_server.read_cb = shm_read_cb;
+        shm_server.close_cb = shm_close_cb;
+    }
+#endif
 
+#ifdef SEV_URING
+    sev_uring_run();
+#else
     ev_loop(EV_DEFAULT_ 0);
+#endif
 
     return 0;
 }
@@ -23,20 +23,79 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifndef SEV_URING
+
+#define _GNU_SOURCE
+#include <errno.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <sys/uio.h>
+#ifdef __linux
+# include <sys/sendfile.h>
+# include <linux/errqueue.h>
+#endif
 #include <ev.h>
 #include "sev.h"
+#include "sev_router.h"
+#include "sev_table.h"
+#include "sev_inbox.h"
+#include "sev_capture.h"
+#include "sev_handoff.h"
+#ifdef SEV_TLS
+# include "sev_tls.h"
+#endif
+#include "../../ws_metrics.h"
+
+// transmit timestamps come back on the error queue, next to the zero
+// copy completions, see sev_server.timestamps
+#if defined(SO_ZEROCOPY) && defined(SO_TIMESTAMPING)
+# define SEV_TIMESTAMPS
+# include <linux/net_tstamp.h>
+#endif
 
 #define BUFSIZE 2048 // fits a 1500-byte MTU packet
 
+// timer wheel, driven by a libev timer while anything is armed
+static struct sev_wheel wheel;
+static struct ev_timer wheel_watcher;
+
+// streams with output queued during this iteration, see sev_server.cork
+static LIST_HEAD(, sev_stream) dirty;
+static struct ev_prepare flush_watcher;
+
+static uint64_t wheel_ticks(ev_tstamp now)
+{
+    return now / SEV_TICK;
+}
+
+static void wheel_cb(EV_P_ struct ev_timer *watcher, int revents)
+{
+    sev_wheel_advance(&wheel, wheel_ticks(ev_now(EV_A)));
+
+    if (wheel.count == 0)
+        ev_timer_stop(EV_A_ watcher);
+}
+
+static void wheel_arm(struct sev_timer *timer, double seconds)
+{
+    if (!ev_is_active(&wheel_watcher)) {
+        // the wheel is idle, bring it up to date first
+        sev_wheel_advance(&wheel, wheel_ticks(ev_now(EV_DEFAULT)));
+        ev_timer_set(&wheel_watcher, SEV_TICK, SEV_TICK);
+        ev_timer_start(EV_DEFAULT_ &wheel_watcher);
+    }
+
+    // round up, timers never run early
+    sev_timer_arm(&wheel, timer, (uint64_t)(seconds / SEV_TICK) + 1);
+}
+
 // sev_stream
 
 static void sev_stream_free(struct sev_stream *stream)
@@ -45,66 +104,575 @@ static void sev_stream_free(struct sev_stream *stream)
     sev_queue_free(stream->queue);
 
     // free everything
-    free(stream->w_read);
-    free(stream->w_write);
-    free(stream->remote_address);
     free(stream);
 }
 
 // callbacks
 
-static void stream_write(struct sev_stream *stream)
+#ifdef SEV_TIMESTAMPS
+static uint64_t timespec_ns(const struct timespec *ts)
 {
-    struct sev_buffer *buffer = sev_queue_head(stream->queue);
+    return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+// the kernel's clock for timestamps
+static uint64_t realtime_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return timespec_ns(&ts);
+}
 
-    char *data = buffer->data + buffer->start;
-    ssize_t len = buffer->len - buffer->start;
+// a send was queued, remember where it ends
+static void stream_stamp_queued(struct sev_stream *stream)
+{
+    uint32_t end = stream->tx_written + stream->queue->bytes;
 
-    int n = send(stream->sd, data, len, 0);
+    // when full, sends go unmeasured until the kernel catches up
+    if (stream->tx_tail - stream->tx_head == SEV_TX_STAMPS)
+        return;
 
-    if (n == -1) {
-        perror("send");
+    if (stream->tx_tail != stream->tx_head &&
+        stream->tx_stamps[(stream->tx_tail - 1) % SEV_TX_STAMPS].end == end)
         return;
+
+    struct sev_tx_stamp *stamp =
+        &stream->tx_stamps[stream->tx_tail++ % SEV_TX_STAMPS];
+    stamp->end = end;
+    stamp->queued = realtime_ns();
+}
+
+// the kernel transmitted up to the byte numbered id at time, which ends
+// every send up to there
+static void stream_stamp_sent(struct sev_stream *stream, uint32_t id,
+    uint64_t time)
+{
+    while (stream->tx_head != stream->tx_tail) {
+        struct sev_tx_stamp *stamp =
+            &stream->tx_stamps[stream->tx_head % SEV_TX_STAMPS];
+
+        if ((int32_t)(id + 1 - stamp->end) < 0)
+            break;
+
+        if (time > stamp->queued)
+            WS_RECORD(SEV_TX_WIRE_NS, time - stamp->queued);
+
+        stream->tx_head++;
     }
+}
+#endif
+
+#ifdef SO_ZEROCOPY
+// read the error queue: MSG_ZEROCOPY completions free the buffers the
+// kernel is done with, transmit timestamps end the sends they cover
+static void stream_reap(struct sev_stream *stream)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) +
+        CMSG_SPACE(sizeof(struct timespec) * 3)];
+
+    while (stream->zc_sent != stream->zc_done || stream->timestamps) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
 
-    buffer->start += n;
+        ssize_t n = recvmsg(stream->sd, &msg, MSG_ERRQUEUE);
+        WS_COUNT(SEV_SYSCALLS, 1);
 
-    if (buffer->start == buffer->len) {
-        sev_queue_free_head(stream->queue);
+        if (n == -1)
+            return;
 
-        if (sev_queue_head(stream->queue) == NULL) {
-            // nothing left to write
-            stream->writing = 0;
-            ev_io_stop(EV_DEFAULT_ stream->w_write);
+        struct sock_extended_err *err = NULL;
+        uint64_t time = 0;
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+            cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+#ifdef SEV_TIMESTAMPS
+            if (cmsg->cmsg_level == SOL_SOCKET &&
+                cmsg->cmsg_type == SCM_TIMESTAMPING) {
+                struct scm_timestamping *ts = (void *)CMSG_DATA(cmsg);
+                time = timespec_ns(&ts->ts[0]);
+                continue;
+            }
+#endif
+            err = (void *)CMSG_DATA(cmsg);
         }
+
+        if (err == NULL)
+            continue;
+
+#ifdef SEV_TIMESTAMPS
+        if (err->ee_origin == SO_EE_ORIGIN_TIMESTAMPING &&
+            err->ee_info == SCM_TSTAMP_SND && time) {
+            stream_stamp_sent(stream, err->ee_data, time);
+            continue;
+        }
+#endif
+
+        if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            continue;
+
+        // completions cover the sends from ee_info to ee_data
+        if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+            // the kernel copied anyway, e.g. on loopback, stop paying
+            // for the notifications
+            WS_COUNT(SEV_ZEROCOPY_COPIED, err->ee_data - err->ee_info + 1);
+            stream->zerocopy = 0;
+        }
+
+        stream->zc_done = err->ee_data + 1;
+        sev_queue_zerocopy_done(stream->queue, err->ee_data);
     }
 }
 
-static void stream_close(struct sev_stream *stream)
+static void stream_linger(struct sev_timer *timer)
 {
-    if (stream->server->close_cb)
-        stream->server->close_cb(stream);
+    struct sev_stream *stream = timer->data;
+
+    stream_reap(stream);
+
+    if (stream->zc_sent != stream->zc_done) {
+        wheel_arm(timer, SEV_TICK);
+        return;
+    }
 
     if (close(stream->sd) == -1) {
         perror("close");
     }
 
+    sev_stream_free(stream);
+}
+#endif
+
+// tear down stream without calling close_cb
+static void stream_release(struct sev_stream *stream)
+{
+    sev_timer_cancel(&wheel, &stream->timer);
+    sev_timer_cancel(&wheel, &stream->idle_timer);
+    sev_timer_cancel(&wheel, &stream->pause_timer);
+    sev_router_drop(stream);
+
+    if (sev_slot_test(stream, SEV_SLOT_DIRTY))
+        LIST_REMOVE(stream, dirty);
+
+    sev_table_remove(stream);
+
+#ifdef SEV_TLS
+    sev_tls_close(stream);
+#endif
+
     // stop libev watchers
-    ev_io_stop(EV_DEFAULT_ stream->w_read);
+    ev_io_stop(EV_DEFAULT_ &stream->w_read);
     if (stream->writing)
-        ev_io_stop(EV_DEFAULT_ stream->w_write);
+        ev_io_stop(EV_DEFAULT_ &stream->w_write);
+
+#ifdef SO_ZEROCOPY
+    if (stream->zc_sent != stream->zc_done) {
+        // the kernel still reads from queued buffers, close once it's done
+        sev_timer_init(&stream->timer, stream_linger, stream);
+        wheel_arm(&stream->timer, SEV_TICK);
+        return;
+    }
+#endif
+
+    if (close(stream->sd) == -1) {
+        perror("close");
+    }
 
     sev_stream_free(stream);
 }
 
+static void stream_close(struct sev_stream *stream)
+{
+    sev_capture(stream, SEV_CAPTURE_CLOSE, NULL, 0);
+
+    if (stream->server->close_cb)
+        stream->server->close_cb(stream);
+
+    stream_release(stream);
+}
+
+static void stream_timeout(struct sev_timer *timer)
+{
+    struct sev_stream *stream = timer->data;
+
+    if (stream->server->timeout_cb)
+        stream->server->timeout_cb(stream);
+    else
+        stream_close(stream);
+}
+
+static void stream_idle(struct sev_timer *timer)
+{
+    struct sev_stream *stream = timer->data;
+    double idle = ev_now(EV_DEFAULT) - sev_table.last_active[stream->sd];
+    double timeout = stream->server->idle_timeout;
+
+    // reads only touch last_active, the timer catches up here
+    if (idle < timeout)
+        wheel_arm(timer, timeout - idle);
+    else
+        stream_close(stream);
+}
+
+static void stream_resume(struct sev_timer *timer)
+{
+    struct sev_stream *stream = timer->data;
+
+    sev_slot_clear(stream, SEV_SLOT_PAUSED);
+
+    // SEV_DISCONNECT stopped reading for good
+    if (sev_slot_test(stream, SEV_SLOT_CLOSE_PENDING))
+        return;
+
+    ev_io_start(EV_DEFAULT_ &stream->w_read);
+
+#ifdef SEV_TLS
+    if (sev_tls_pending(stream))
+        ev_feed_event(EV_DEFAULT_ &stream->w_read, EV_READ);
+#endif
+}
+
+static void stream_drain(struct sev_stream *stream)
+{
+    struct sev_server *server = stream->server;
+
+    sev_table.queued[stream->sd] = stream->queue->bytes;
+
+    if (sev_slot_test(stream, SEV_SLOT_FULL) &&
+        stream->queue->bytes <= server->low_watermark) {
+        sev_slot_clear(stream, SEV_SLOT_FULL);
+
+        if (server->drain_cb)
+            server->drain_cb(stream);
+    }
+}
+
+#ifdef SEV_TLS
+// returns 1 once the handshake is done, 0 while in progress and -1 if
+// it failed and the stream was closed
+static int stream_handshake(struct sev_stream *stream)
+{
+    int want_write;
+    int ret = sev_tls_handshake(stream, &want_write);
+
+    if (ret == -1) {
+        stream_close(stream);
+        return -1;
+    }
+
+    // the write watcher waits for the handshake until data is queued
+    if (want_write && !stream->writing) {
+        ev_io_start(EV_DEFAULT_ &stream->w_write);
+        stream->writing = 1;
+    }
+    else if (!want_write && stream->writing &&
+        sev_queue_head(stream->queue) == NULL) {
+        ev_io_stop(EV_DEFAULT_ &stream->w_write);
+        stream->writing = 0;
+    }
+
+    return ret;
+}
+#endif
+
+static ssize_t stream_send(struct sev_stream *stream, const char *data,
+    size_t len)
+{
+#ifdef SEV_TLS
+    if (stream->tls)
+        return sev_tls_send(stream, data, len);
+#endif
+    return send(stream->sd, data, len, 0);
+}
+
+// writes from the file segment at the head of the queue
+// returns 0 if the file ended before the segment did
+static ssize_t stream_send_file(struct sev_stream *stream,
+    struct sev_buffer *buffer)
+{
+    off_t offset = buffer->offset + buffer->start;
+    size_t len = buffer->len - buffer->start;
+
+#ifdef __linux
+# ifdef SEV_TLS
+    if (!stream->tls || stream->ktls_send)
+# endif
+        return sendfile(stream->sd, buffer->fd, &offset, len);
+#endif
+
+    // no sendfile, or openssl owns the record layer
+    static char chunk[16384];
+    if (len > sizeof(chunk))
+        len = sizeof(chunk);
+
+    ssize_t n = pread(buffer->fd, chunk, len, offset);
+    if (n <= 0)
+        return n;
+
+    return stream_send(stream, chunk, n);
+}
+
+#ifdef SO_ZEROCOPY
+// the kernel sends straight from the buffer, which is kept until the
+// completion arrives, see stream_reap
+static ssize_t stream_send_zerocopy(struct sev_stream *stream,
+    struct sev_buffer *buffer)
+{
+    ssize_t n = send(stream->sd, buffer->data + buffer->start,
+        buffer->len - buffer->start, MSG_ZEROCOPY);
+
+    if (n == -1 && errno == ENOBUFS) {
+        // out of memory for notifications, copy this one
+        return send(stream->sd, buffer->data + buffer->start,
+            buffer->len - buffer->start, 0);
+    }
+
+    if (n > 0) {
+        buffer->zerocopy = 1;
+        buffer->zc_seq = stream->zc_sent++;
+        WS_COUNT(SEV_ZEROCOPY_SENDS, 1);
+    }
+
+    return n;
+}
+#endif
+
+#ifdef SEV_TIMESTAMPS
+// recv that also picks up the kernel's receive timestamp, that of the
+// last segment read when several are
+static ssize_t stream_recv_stamped(struct sev_stream *stream, char *data,
+    size_t len)
+{
+    struct iovec iov = { data, len };
+    char control[CMSG_SPACE(sizeof(struct timespec) * 3)];
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(stream->sd, &msg, 0);
+    stream->rx_timestamp = 0;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg;
+        cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            struct scm_timestamping *ts = (void *)CMSG_DATA(cmsg);
+            stream->rx_timestamp = timespec_ns(&ts->ts[0]);
+        }
+    }
+
+    return n;
+}
+#endif
+
+// the memory buffers at the head of the queue in a single writev, sets
+// len to the bytes it tried to write
+static ssize_t stream_send_iov(struct sev_stream *stream, size_t *len)
+{
+    struct iovec iov[SEV_WRITE_IOV];
+    struct sev_buffer *buffer = sev_queue_head(stream->queue);
+    int n = 0;
+
+    *len = 0;
+
+    for (; buffer && buffer->fd == -1 && n < SEV_WRITE_IOV; n++) {
+#ifdef SO_ZEROCOPY
+        // sent on its own, see stream_send_zerocopy
+        if (n > 0 && stream->zerocopy &&
+            buffer->len - buffer->start >= stream->server->zerocopy_threshold)
+            break;
+#endif
+        iov[n].iov_base = buffer->data + buffer->start;
+        iov[n].iov_len = buffer->len - buffer->start;
+        *len += iov[n].iov_len;
+
+        buffer = STAILQ_NEXT(buffer, entries);
+    }
+
+    return writev(stream->sd, iov, n);
+}
+
+static ssize_t stream_recv(struct sev_stream *stream, char *data, size_t len)
+{
+#ifdef SEV_TLS
+    if (stream->tls)
+        return sev_tls_recv(stream, data, len);
+#endif
+#ifdef SEV_TIMESTAMPS
+    if (stream->timestamps)
+        return stream_recv_stamped(stream, data, len);
+#endif
+    return recv(stream->sd, data, len, 0);
+}
+
+// one write from the head of the queue, returns 1 if it all went out and
+// more is queued, -1 if the stream was closed and 0 otherwise
+static int stream_write(struct sev_stream *stream)
+{
+    if (sev_slot_test(stream, SEV_SLOT_CLOSE_PENDING)) {
+        stream_close(stream);
+        return -1;
+    }
+
+#ifdef SEV_TLS
+    if (stream->tls && !stream->tls_ready && stream_handshake(stream) <= 0)
+        return 0;
+#endif
+
+    struct sev_buffer *buffer = sev_queue_head(stream->queue);
+    if (buffer == NULL)
+        return 0;
+
+    ssize_t n;
+    size_t len = buffer->len - buffer->start;
+
+    if (buffer->fd != -1)
+        n = stream_send_file(stream, buffer);
+#ifdef SO_ZEROCOPY
+    else if (stream->zerocopy &&
+        len >= stream->server->zerocopy_threshold)
+        n = stream_send_zerocopy(stream, buffer);
+#endif
+#ifdef SEV_TLS
+    else if (stream->tls && !stream->ktls_send)
+        n = stream_send(stream, buffer->data + buffer->start, len);
+#endif
+    else
+        n = stream_send_iov(stream, &len);
+    WS_COUNT(SEV_SYSCALLS, 1);
+
+    if (n == -1) {
+        if (errno != EAGAIN)
+            perror("send");
+        return 0;
+    }
+
+    if (n == 0 && buffer->fd != -1) {
+        // the file was truncated, the frame can't be completed
+        fprintf(stderr, "sendfile: unexpected end of file\n");
+        stream_close(stream);
+        return -1;
+    }
+
+    WS_COUNT(SEV_BYTES_WRITTEN, n);
+    stream->tx_written += n;
+
+    sev_queue_consume(stream->queue, n);
+    stream_drain(stream);
+
+    if (sev_queue_head(stream->queue) == NULL) {
+        // nothing left to write
+        stream->writing = 0;
+        ev_io_stop(EV_DEFAULT_ &stream->w_write);
+        return 0;
+    }
+
+    return (size_t)n == len;
+}
+
+#ifdef TCP_CORK
+// whether writing the queue takes more than one syscall, in which case
+// the pieces are corked to leave in full segments
+static int stream_needs_cork(struct sev_stream *stream)
+{
+    struct sev_buffer *buffer;
+    int n = 0, alone = 0;
+
+#ifdef SEV_TLS
+    // openssl writes each buffer as a record of its own
+    alone = stream->tls && !stream->ktls_send;
+#endif
+
+    STAILQ_FOREACH(buffer, &stream->queue->head, entries) {
+        if (buffer->fd != -1)
+            alone = 1;
+#ifdef SO_ZEROCOPY
+        else if (stream->zerocopy &&
+            buffer->len - buffer->start >= stream->server->zerocopy_threshold)
+            alone = 1;
+#endif
+
+        if (++n > SEV_WRITE_IOV || (n > 1 && alone))
+            return 1;
+    }
+
+    return 0;
+}
+#endif
+
+// write everything queued during the loop iteration, what doesn't fit
+// in the socket waits for it to poll writable
+static void stream_flush(struct sev_stream *stream)
+{
+    int cork = 0;
+
+#ifdef TCP_CORK
+    if (stream_needs_cork(stream)) {
+        cork = 1;
+        setsockopt(stream->sd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    }
+#endif
+
+    int ret;
+    while ((ret = stream_write(stream)) == 1)
+        ;
+
+    if (ret == -1)
+        return;
+
+#ifdef TCP_CORK
+    // pushes out the last partial segment
+    if (cork) {
+        cork = 0;
+        setsockopt(stream->sd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    }
+#endif
+
+    if (sev_queue_head(stream->queue) && !stream->writing) {
+        ev_io_start(EV_DEFAULT_ &stream->w_write);
+        stream->writing = 1;
+    }
+}
+
+// runs once the loop iteration's callbacks are done, before it polls
+static void flush_cb(EV_P_ struct ev_prepare *watcher, int revents)
+{
+    struct sev_stream *stream;
+
+    while ((stream = LIST_FIRST(&dirty)) != NULL) {
+        LIST_REMOVE(stream, dirty);
+        sev_slot_clear(stream, SEV_SLOT_DIRTY);
+
+        if (sev_slot_test(stream, SEV_SLOT_CLOSE_PENDING))
+            stream_close(stream);
+        else
+            stream_flush(stream);
+    }
+
+    ev_prepare_stop(EV_A_ watcher);
+}
+
 static void stream_read(struct sev_stream *stream)
 {
     static char buffer[BUFSIZE];
-    ssize_t n = recv(stream->sd, buffer, BUFSIZE - 1, 0);
+
+#ifdef SEV_TLS
+    if (stream->tls && !stream->tls_ready && stream_handshake(stream) <= 0)
+        return;
+#endif
+
+    ssize_t n = stream_recv(stream, buffer, BUFSIZE - 1);
+    WS_COUNT(SEV_SYSCALLS, 1);
 
     if (n < 0) {
-        // error
-        perror("recv");
+        // error, or a partial tls record
+        if (errno != EAGAIN)
+            perror("recv");
         return;
     }
 
@@ -114,8 +682,29 @@ static void stream_read(struct sev_stream *stream)
         return;
     }
 
+    sev_table.last_active[stream->sd] = ev_now(EV_DEFAULT);
+    WS_COUNT(SEV_BYTES_READ, n);
+    sev_capture(stream, SEV_CAPTURE_DATA, buffer, n);
+
+#ifdef SEV_TIMESTAMPS
+    uint64_t now = stream->rx_timestamp ? realtime_ns() : 0;
+    if (now > stream->rx_timestamp)
+        WS_RECORD(SEV_RX_KERNEL_NS, now - stream->rx_timestamp);
+#endif
+
+#ifdef SEV_TLS
+    // read the rest on the next loop iteration, a closed stream's
+    // watcher is stopped and loses the event
+    if (sev_tls_pending(stream))
+        ev_feed_event(EV_DEFAULT_ &stream->w_read, EV_READ);
+#endif
+
+    uint64_t t = WS_CLOCK();
+
     if (stream->server->read_cb)
         stream->server->read_cb(stream, buffer, n);
+
+    WS_RECORD(SEV_READ_NS, WS_CLOCK() - t);
 }
 
 static void stream_cb(EV_P_ struct ev_io *watcher, int revents)
@@ -125,6 +714,13 @@ static void stream_cb(EV_P_ struct ev_io *watcher, int revents)
         return;
     }
 
+#ifdef SO_ZEROCOPY
+    // completions and timestamps wake both watchers until they are read
+    struct sev_stream *stream = watcher->data;
+    if (stream->zc_sent != stream->zc_done || stream->timestamps)
+        stream_reap(stream);
+#endif
+
     if (revents & EV_WRITE)
         stream_write(watcher->data);
 
@@ -132,80 +728,178 @@ static void stream_cb(EV_P_ struct ev_io *watcher, int revents)
         stream_read(watcher->data);
 }
 
-static void accept_cb(EV_P_ struct ev_io *watcher, int revents)
+// set up a stream for sd without calling open_cb, NULL on failure
+static struct sev_stream *stream_new(struct sev_server *server, int sd,
+    struct sockaddr_storage *addr, socklen_t addr_len)
 {
-    // accept client socket
-    struct sockaddr_in addr;
-    socklen_t addr_len = sizeof(addr);
-
-    int sd = accept(watcher->fd, (struct sockaddr*)&addr, &addr_len);
-    if (sd == -1) {
-        perror("accept");
-        return;
-    }
-
+#ifndef __linux
     // set non-blocking
     int flags = fcntl(sd, F_GETFL, 0);
     flags |= O_NONBLOCK;
     fcntl(sd, F_SETFL, flags);
 
-    // disable nagle's algorithm
+    // disable nagle's algorithm, linux inherits it from the listener
     int flag = 1;
     setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(int));
+#endif
 
     // initialize sev_stream structure
-    struct sev_server *server = watcher->data;
     struct sev_stream *stream = malloc(sizeof(struct sev_stream));
 
     stream->sd = sd;
     stream->server = server;
-    stream->remote_port = addr.sin_port;
-    stream->remote_address = malloc(INET_ADDRSTRLEN);
-    inet_ntop(AF_INET, &addr.sin_addr, stream->remote_address,
-        INET_ADDRSTRLEN);
+    memcpy(&stream->remote_addr, addr, addr_len);
+    stream->remote_addr_len = addr_len;
+
+#ifdef SEV_TLS
+    stream->tls = NULL;
+    stream->tls_ready = 0;
+    stream->ktls_send = 0;
+    stream->ktls_recv = 0;
+
+    if (server->tls_ctx && sev_tls_open(stream) == -1) {
+        close(sd);
+        free(stream);
+        return NULL;
+    }
+#endif
+
+#ifdef SO_ZEROCOPY
+    int one = 1;
+    stream->zerocopy = server->zerocopy_threshold > 0 &&
+        setsockopt(sd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    stream->zc_sent = 0;
+    stream->zc_done = 0;
+
+# ifdef SEV_TLS
+    // tls copies into records anyway
+    if (stream->tls)
+        stream->zerocopy = 0;
+# endif
+#endif
+
+    stream->timestamps = 0;
+    stream->tx_written = 0;
+    stream->tx_head = 0;
+    stream->tx_tail = 0;
+    stream->rx_timestamp = 0;
+
+#ifdef SEV_TIMESTAMPS
+    int stamped = server->timestamps;
+
+# ifdef SEV_TLS
+    // records hide which bytes were sent, and openssl does the reads
+    if (stream->tls)
+        stamped = 0;
+# endif
+
+    if (stamped) {
+        int off = 0, on = SOF_TIMESTAMPING_RX_SOFTWARE |
+            SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+            SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+
+        // ids count bytes from when the option is set, an adopted socket
+        // may have it set already
+        setsockopt(sd, SOL_SOCKET, SO_TIMESTAMPING, &off, sizeof(off));
+        stream->timestamps = setsockopt(sd, SOL_SOCKET, SO_TIMESTAMPING,
+            &on, sizeof(on)) == 0;
+    }
+#endif
 
     // register with libev
-    stream->w_read = malloc(sizeof(struct ev_io));
-    ev_io_init(stream->w_read, stream_cb, sd, EV_READ);
-    ev_io_start(EV_DEFAULT_ stream->w_read);
+    ev_io_init(&stream->w_read, stream_cb, sd, EV_READ);
+    ev_io_start(EV_DEFAULT_ &stream->w_read);
 
-    stream->w_write = malloc(sizeof(struct ev_io));
-    ev_io_init(stream->w_write, stream_cb, sd, EV_WRITE);
+    ev_io_init(&stream->w_write, stream_cb, sd, EV_WRITE);
 
-    stream->w_read->data = stream;
-    stream->w_write->data = stream;
+    stream->w_read.data = stream;
+    stream->w_write.data = stream;
     stream->writing = 0;
 
     // initialize write queue
     stream->queue = sev_queue_new();
 
+    LIST_INIT(&stream->subscriptions);
+    sev_table_add(stream);
+    sev_capture(stream, SEV_CAPTURE_OPEN, NULL, 0);
+
+    // initialize timers
+    sev_timer_init(&stream->timer, stream_timeout, stream);
+    sev_timer_init(&stream->idle_timer, stream_idle, stream);
+    sev_timer_init(&stream->pause_timer, stream_resume, stream);
+    sev_table.last_active[stream->sd] = ev_now(EV_DEFAULT);
+
+    if (server->idle_timeout > 0)
+        wheel_arm(&stream->idle_timer, server->idle_timeout);
+
+    return stream;
+}
+
+static void stream_open(struct sev_server *server, int sd,
+    struct sockaddr_storage *addr, socklen_t addr_len)
+{
+    struct sev_stream *stream = stream_new(server, sd, addr, addr_len);
+
     // call open callback
-    if (server->open_cb)
+    if (stream && server->open_cb)
         server->open_cb(stream);
 }
 
-// interface
-
-int sev_listen(struct sev_server *server, int port)
+static void accept_cb(EV_P_ struct ev_io *watcher, int revents)
 {
-    // create server socket
-    int sd = socket(PF_INET, SOCK_STREAM, 0);
-    if (sd == -1)
-        return -1;
+    struct sev_server *server = watcher->data;
+    int budget = server->accept_budget ? server->accept_budget :
+        SEV_ACCEPT_BUDGET;
 
-    // set reuseaddr
-    int flag = 1;
-    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+    // drain the accept queue, up to budget connections per wakeup
+    int n = 0;
+    while (n < budget) {
+        // accept client socket
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
 
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = INADDR_ANY;
+#ifdef __linux
+        int sd = accept4(watcher->fd, (struct sockaddr*)&addr, &addr_len,
+            SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        int sd = accept(watcher->fd, (struct sockaddr*)&addr, &addr_len);
+#endif
+        WS_COUNT(SEV_SYSCALLS, 1);
 
-    // bind/listen
-    if (bind(sd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
-        return -1;
-    if (listen(sd, SOMAXCONN) == -1)
+        if (sd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            break;
+        }
+
+        n++;
+        stream_open(server, sd, &addr, addr_len);
+    }
+
+    WS_COUNT(SEV_ACCEPTS, n);
+
+    // connection rate over windows of at least a second
+    ev_tstamp now = ev_now(EV_A);
+    server->accepted += n;
+    server->rate_count += n;
+
+    if (now - server->rate_start >= 1.0) {
+        server->accept_rate = server->rate_count / (now - server->rate_start);
+        server->rate_start = now;
+        server->rate_count = 0;
+    }
+}
+
+// interface
+
+// serve an already listening socket
+int sev_listen_fd(struct sev_server *server, int sd)
+{
+    // accept_cb drains the queue until EAGAIN
+    int flags = fcntl(sd, F_GETFL, 0);
+    if (fcntl(sd, F_SETFL, flags | O_NONBLOCK) == -1)
         return -1;
 
     // register with libev
@@ -218,6 +912,14 @@ int sev_listen(struct sev_server *server, int port)
     memset(server, 0, sizeof(struct sev_server));
     server->sd = sd;
     server->watcher = watcher;
+    server->rate_start = ev_now(EV_DEFAULT);
+
+    if (!ev_cb(&wheel_watcher)) {
+        sev_wheel_init(&wheel, wheel_ticks(ev_now(EV_DEFAULT)));
+        ev_init(&wheel_watcher, wheel_cb);
+        ev_prepare_init(&flush_watcher, flush_cb);
+        LIST_INIT(&dirty);
+    }
 
     return 0;
 }
@@ -227,12 +929,155 @@ void sev_close(struct sev_stream *stream)
     stream_close(stream);
 }
 
-void sev_send(struct sev_stream *stream, const char *data, size_t len)
+struct sev_stream *sev_stream_adopt(struct sev_server *server, int sd,
+    struct sockaddr_storage *addr, socklen_t addr_len)
 {
-    sev_queue_push_back(stream->queue, data, len);
+    return stream_new(server, sd, addr, addr_len);
+}
+
+void sev_stream_detach(struct sev_stream *stream)
+{
+    stream_release(stream);
+}
+
+static void inbox_cb(EV_P_ struct ev_async *watcher, int revents)
+{
+    sev_inbox_drain(watcher->data);
+}
+
+int sev_inbox_start(struct sev_inbox *inbox)
+{
+    ev_async_init(&inbox->watcher, inbox_cb);
+    inbox->watcher.data = inbox;
+    ev_async_start(EV_DEFAULT_ &inbox->watcher);
+    return 0;
+}
+
+// totals over every stream, a scan of the stream table's dense arrays
+void sev_get_stats(struct sev_stats *stats)
+{
+    sev_table_stats(stats, ev_now(EV_DEFAULT));
+}
+
+// call timeout_cb once, seconds from now, replacing any earlier deadline
+// 0 cancels it
+void sev_set_timeout(struct sev_stream *stream, double seconds)
+{
+    if (seconds > 0)
+        wheel_arm(&stream->timer, seconds);
+    else
+        sev_timer_cancel(&wheel, &stream->timer);
+}
+
+// stop reading from stream for the given time, e.g. to enforce a rate
+// data already received is still delivered
+void sev_pause_read(struct sev_stream *stream, double seconds)
+{
+    if (seconds <= 0)
+        return;
 
-    if (!stream->writing) {
-        ev_io_start(EV_DEFAULT_ stream->w_write);
+    if (!sev_slot_test(stream, SEV_SLOT_PAUSED)) {
+        sev_slot_set(stream, SEV_SLOT_PAUSED);
+        ev_io_stop(EV_DEFAULT_ &stream->w_read);
+    }
+
+    wheel_arm(&stream->pause_timer, seconds);
+}
+
+// backpressure and write scheduling after queueing data
+static int stream_queued(struct sev_stream *stream)
+{
+    WS_RECORD(SEV_QUEUE_BYTES, stream->queue->bytes);
+
+    struct sev_server *server = stream->server;
+    size_t high = server->high_watermark;
+
+    if (high && stream->queue->bytes > high) {
+        if (server->overflow_policy == SEV_DROP_OLDEST) {
+            sev_queue_trim(stream->queue, high, 0);
+
+            // the dropped bytes are never written, forget the ends
+            stream->tx_head = stream->tx_tail;
+        }
+        else if (server->overflow_policy == SEV_DISCONNECT) {
+            // the caller may still hold the stream, close it from the loop
+            sev_slot_set(stream, SEV_SLOT_CLOSE_PENDING);
+            ev_io_stop(EV_DEFAULT_ &stream->w_read);
+        }
+        else if (!sev_slot_test(stream, SEV_SLOT_FULL)) {
+            sev_slot_set(stream, SEV_SLOT_FULL);
+
+            if (server->full_cb)
+                server->full_cb(stream);
+        }
+    }
+
+    sev_table.queued[stream->sd] = stream->queue->bytes;
+
+#ifdef SEV_TIMESTAMPS
+    if (stream->timestamps)
+        stream_stamp_queued(stream);
+#endif
+
+    // with cork, written in one go at the end of the loop iteration. a
+    // pending close goes there too, a client that stopped reading never
+    // lets the socket poll writable
+    if (sev_slot_test(stream, SEV_SLOT_CLOSE_PENDING) ||
+        (!stream->writing && server->cork)) {
+        if (!sev_slot_test(stream, SEV_SLOT_DIRTY)) {
+            sev_slot_set(stream, SEV_SLOT_DIRTY);
+            LIST_INSERT_HEAD(&dirty, stream, dirty);
+        }
+
+        if (!ev_is_active(&flush_watcher))
+            ev_prepare_start(EV_DEFAULT_ &flush_watcher);
+    }
+    else if (!stream->writing) {
+        ev_io_start(EV_DEFAULT_ &stream->w_write);
         stream->writing = 1;
     }
+
+    return sev_slot_test(stream, SEV_SLOT_CLOSE_PENDING) ? -1 : 0;
 }
+
+// returns -1 if the stream is being disconnected
+int sev_send(struct sev_stream *stream, const char *data, size_t len)
+{
+    if (sev_slot_test(stream, SEV_SLOT_CLOSE_PENDING))
+        return -1;
+
+    sev_queue_push_back(stream->queue, data, len);
+    return stream_queued(stream);
+}
+
+// queue a reference to shared instead of a copy
+int sev_send_shared(struct sev_stream *stream, struct sev_shared *shared)
+{
+    if (sev_slot_test(stream, SEV_SLOT_CLOSE_PENDING))
+        return -1;
+
+    sev_queue_push_shared(stream->queue, shared);
+    return stream_queued(stream);
+}
+
+// queue header_len bytes of header, e.g. a frame header, then len bytes
+// of fd from offset, sent with sendfile and never copied to userspace.
+// the two are one message, SEV_DROP_OLDEST never splits them
+// fd is duplicated, the caller may close it right away
+// returns -1 if the stream is being disconnected or fd can't be duplicated
+int sev_send_file(struct sev_stream *stream, const char *header,
+    size_t header_len, int fd, off_t offset, size_t len)
+{
+    if (sev_slot_test(stream, SEV_SLOT_CLOSE_PENDING))
+        return -1;
+
+    if (len == 0 && header_len > 0)
+        sev_queue_push_back(stream->queue, header, header_len);
+    else if (len > 0 && sev_queue_push_file(stream->queue, header,
+        header_len, fd, offset, len))
+        return -1;
+
+    return stream_queued(stream);
+}
+
+#endif
@@ -27,46 +27,197 @@
 #define SEV_H
 
 #include <stdlib.h>
-#include <ev.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#ifdef SEV_URING
+# include <sys/uio.h>
+#else
+# include <ev.h>
+#endif
 #include "sev_queue.h"
+#include "sev_timer.h"
+
+#if defined(SEV_TLS) && defined(SEV_URING)
+# error "SEV_TLS needs the libev backend"
+#endif
+
+// timer wheel resolution, in seconds
+#define SEV_TICK 0.1
+
+// fits any address formatted by sev_remote_address
+#define SEV_ADDRSTRLEN 128
+
+// connections accepted per wakeup when accept_budget is 0
+#define SEV_ACCEPT_BUDGET 64
+
+// io_uring backend: at most this many queued buffers per writev
+#define SEV_URING_IOV 16
+
+// libev backend: at most this many queued buffers per writev
+#define SEV_WRITE_IOV 16
+
+// libev backend: sends awaiting a transmit timestamp, per stream
+#define SEV_TX_STAMPS 16
 
 struct sev_stream;
+struct sev_subscription;
+
+// stable reference to a stream, see sev_stream_get
+typedef uint64_t sev_handle;
 
 typedef void (sev_open_cb)(struct sev_stream *stream);
 typedef void (sev_read_cb)(struct sev_stream *stream, char *data, size_t len);
 typedef void (sev_close_cb)(struct sev_stream *stream);
+typedef void (sev_drain_cb)(struct sev_stream *stream);
+typedef void (sev_timeout_cb)(struct sev_stream *stream);
+
+// what sev_send does once a stream queues more than high_watermark bytes
+#define SEV_PAUSE 0 // call full_cb, the producer waits for drain_cb
+#define SEV_DROP_OLDEST 1 // drop the oldest unsent buffers
+#define SEV_DISCONNECT 2 // close the stream
 
 struct sev_server {
     // socket descriptor
     int sd;
 
+#ifndef SEV_URING
     // libev watcher
     struct ev_io *watcher;
+#endif
+
+#ifdef SEV_TLS
+    // accepted streams speak tls when set, see sev_tls_init
+    struct ssl_ctx_st *tls_ctx;
+#endif
 
     // callbacks
     sev_open_cb *open_cb;
     sev_read_cb *read_cb;
     sev_close_cb *close_cb;
 
+    // write backpressure, disabled when high_watermark is 0
+    size_t high_watermark;
+    size_t low_watermark;
+    int overflow_policy;
+    sev_drain_cb *full_cb;
+    sev_drain_cb *drain_cb;
+
+    // close streams that read nothing for this many seconds, 0 disables
+    double idle_timeout;
+
+    // called when a sev_set_timeout deadline expires, closes if NULL
+    sev_timeout_cb *timeout_cb;
+
+    // max connections accepted per wakeup, SEV_ACCEPT_BUDGET if 0
+    int accept_budget;
+
+    // libev backend: send buffers of at least this many bytes with
+    // MSG_ZEROCOPY, 0 disables
+    size_t zerocopy_threshold;
+
+    // libev backend: sends only queue, and every stream written to
+    // during a loop iteration is flushed once at its end, corked if that
+    // takes more than one syscall. 0 writes once the socket polls
+    // writable, a loop iteration later
+    int cork;
+
+    // libev backend: have the kernel timestamp what streams receive and
+    // send (SO_TIMESTAMPING), see sev_stream.rx_timestamp and the latency
+    // histograms in ws_metrics.h. tls streams aren't timestamped
+    int timestamps;
+
+    // connections accepted in total and per second
+    unsigned long accepted;
+    double accept_rate;
+    double rate_start;
+    unsigned long rate_count;
+
     // user data
     void *data;
 };
 
+// the end of a send, in bytes written to the stream, and when it was
+// queued, see sev_server.timestamps
+struct sev_tx_stamp {
+    uint32_t end;
+    uint64_t queued;
+};
+
 struct sev_stream {
     // socket descriptor
     int sd;
 
+    // generation of its slot in the stream table, part of the handle
+    uint32_t id;
+
+#ifdef SEV_URING
+    // io_uring state
+    int inflight;
+    int closing;
+    int receiving;
+
+    // queued buffers the send in flight points into, 0 if none
+    int sending;
+    struct sev_stream *next_dirty;
+
+    // received after sev_pause_read, before the recv was cancelled
+    struct sev_queue *held;
+    struct iovec iov[SEV_URING_IOV];
+
+    // carries file segments to the socket, created on first use
+    int pipe[2];
+    size_t piped;
+#else
     // libev watchers
-    struct ev_io *w_read;
-    struct ev_io *w_write;
+    struct ev_io w_read;
+    struct ev_io w_write;
     int writing;
 
-    // stream info
-    char *remote_address;
-    int remote_port;
+    // MSG_ZEROCOPY sends made and completed, see zerocopy_threshold
+    int zerocopy;
+    uint32_t zc_sent;
+    uint32_t zc_done;
+
+    // SO_TIMESTAMPING: bytes written so far, which is what the kernel's
+    // transmit timestamps count, and the sends they haven't covered yet
+    int timestamps;
+    uint32_t tx_written;
+    struct sev_tx_stamp tx_stamps[SEV_TX_STAMPS];
+    unsigned tx_head;
+    unsigned tx_tail;
+
+    // streams to flush at the end of the loop iteration, see cork
+    LIST_ENTRY(sev_stream) dirty;
+#endif
+
+#ifdef SEV_TLS
+    // handshake state, then whether the kernel took over each direction
+    struct ssl_st *tls;
+    int tls_ready;
+    int ktls_send;
+    int ktls_recv;
+#endif
+
+    // stream info, see sev_remote_address and sev_remote_port
+    struct sockaddr_storage remote_addr;
+    socklen_t remote_addr_len;
 
     struct sev_server *server;
 
+    // kernel receive time of the data passed to read_cb, in CLOCK_REALTIME
+    // nanoseconds, 0 unless sev_server.timestamps is set
+    uint64_t rx_timestamp;
+
+    // topics this stream is subscribed to, see sev_router
+    LIST_HEAD(sev_subscription_list, sev_subscription) subscriptions;
+
+    // timers
+    struct sev_timer timer;
+    struct sev_timer idle_timer;
+
+    // resumes reading, see sev_pause_read
+    struct sev_timer pause_timer;
+
     // user data
     void *data;
 
@@ -74,10 +225,53 @@ struct sev_stream {
     struct sev_queue *queue;
 };
 
+// totals over all streams, see sev_get_stats
+struct sev_stats {
+    size_t streams;
+
+    // above the high watermark, and with reading paused
+    size_t full;
+    size_t paused;
+
+    // bytes waiting in write queues
+    size_t queued;
+
+    // seconds since the least recent read on any stream
+    double max_idle;
+};
+
 int sev_listen(struct sev_server *server, int port);
+int sev_listen6(struct sev_server *server, int port);
+int sev_listen_unix(struct sev_server *server, const char *path);
+void sev_unlink_socket(const char *path);
+int sev_listen_fd(struct sev_server *server, int sd);
 
-void sev_send(struct sev_stream *stream, const char *data, size_t len);
+int sev_send(struct sev_stream *stream, const char *data, size_t len);
+int sev_send_shared(struct sev_stream *stream, struct sev_shared *shared);
+int sev_send_file(struct sev_stream *stream, const char *header,
+    size_t header_len, int fd, off_t offset, size_t len);
 
 void sev_close(struct sev_stream *stream);
 
+void sev_set_timeout(struct sev_stream *stream, double seconds);
+void sev_pause_read(struct sev_stream *stream, double seconds);
+
+sev_handle sev_stream_handle(struct sev_stream *stream);
+struct sev_stream *sev_stream_get(sev_handle handle);
+
+void sev_get_stats(struct sev_stats *stats);
+
+const char *sev_remote_address(struct sev_stream *stream, char *out,
+    size_t len);
+int sev_remote_port(struct sev_stream *stream);
+
+#ifdef SEV_URING
+int sev_uring_run(void);
+#endif
+
+#ifdef SEV_TLS
+int sev_tls_init(struct sev_server *server, const char *cert_file,
+    const char *key_file, int ktls);
+#endif
+
 #endif
@@ -0,0 +1,97 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "sev.h"
+#include "sev_capture.h"
+
+static int fd = -1;
+
+int sev_capture_open(const char *path)
+{
+    sev_capture_close();
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return -1;
+
+    if (write(fd, SEV_CAPTURE_MAGIC, SEV_CAPTURE_MAGIC_LEN) !=
+        SEV_CAPTURE_MAGIC_LEN) {
+        sev_capture_close();
+        return -1;
+    }
+
+    return 0;
+}
+
+void sev_capture_close(void)
+{
+    if (fd == -1)
+        return;
+
+    close(fd);
+    fd = -1;
+}
+
+// one unbuffered write per event, so a killed server keeps its capture
+void sev_capture(struct sev_stream *stream, int type, const char *data,
+    size_t len)
+{
+    if (fd == -1)
+        return;
+
+    char addr[SEV_ADDRSTRLEN];
+    if (type == SEV_CAPTURE_OPEN) {
+        sev_remote_address(stream, addr, sizeof(addr));
+        data = addr;
+        len = strlen(addr);
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    struct sev_capture_record record = {
+        .time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec,
+        .stream = stream->id,
+        .type = type,
+        .len = len,
+    };
+
+    struct iovec iov[2] = {
+        { &record, sizeof(record) },
+        { (void *)data, len },
+    };
+
+    if (writev(fd, iov, 2) != sizeof(record) + len) {
+        perror("sev_capture");
+        sev_capture_close();
+    }
+}
@@ -0,0 +1,63 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SEV_CAPTURE_H
+#define SEV_CAPTURE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+// capture files start with the magic and then hold one record per
+// event, each followed by len bytes: the remote address for open, the
+// received bytes for data and nothing for close. fields are in host
+// byte order, times are monotonic nanoseconds
+
+#define SEV_CAPTURE_MAGIC "SEVCAP1\n"
+#define SEV_CAPTURE_MAGIC_LEN 8
+
+#define SEV_CAPTURE_OPEN 1
+#define SEV_CAPTURE_DATA 2
+#define SEV_CAPTURE_CLOSE 3
+
+struct sev_capture_record {
+    uint64_t time;
+    uint32_t stream;
+    uint32_t type;
+    uint32_t len;
+    uint32_t reserved;
+};
+
+struct sev_stream;
+
+// start writing every stream's received bytes to path
+// the capture is process wide and must be used from the loop thread
+int sev_capture_open(const char *path);
+void sev_capture_close(void);
+
+// called by the backends, does nothing unless a capture is open
+void sev_capture(struct sev_stream *stream, int type, const char *data,
+    size_t len);
+
+#endif
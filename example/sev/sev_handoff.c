@@ -0,0 +1,498 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SEV_URING
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <ev.h>
+#include "sev.h"
+#include "sev_table.h"
+#include "sev_handoff.h"
+
+// a stream received by sev_handoff_recv, waiting for sev_handoff_adopt
+struct pending {
+    struct pending *next;
+    int sd;
+    struct sev_handoff_record record;
+    char *queued;
+    char *state;
+};
+
+static struct pending *pending;
+
+// seconds the old process waits on a stalled successor before giving up
+// on the handoff and going back to serving
+#define HANDOFF_TIMEOUT 5
+
+// old process, waiting for a successor
+static struct ev_io handoff_watcher;
+static sev_save_cb *handoff_save_cb;
+
+static int write_full(int sd, const void *data, size_t len)
+{
+    const char *p = data;
+
+    while (len > 0) {
+        ssize_t n = write(sd, p, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int read_full(int sd, void *data, size_t len)
+{
+    char *p = data;
+
+    while (len > 0) {
+        ssize_t n = read(sd, p, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int handoff_addr(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+// send record with fd attached, unless it's -1
+static int send_record(int sd, struct sev_handoff_record *record, int fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { record, sizeof(*record) };
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd != -1) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    ssize_t n;
+    do {
+        n = sendmsg(sd, &msg, 0);
+    } while (n == -1 && errno == EINTR);
+
+    if (n == -1)
+        return -1;
+
+    // the descriptor travels with the first byte, the rest is plain data
+    return write_full(sd, (char *)record + n, sizeof(*record) - n);
+}
+
+// receive a record and the descriptor attached to it, -1 if none
+static int recv_record(int sd, struct sev_handoff_record *record, int *fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { record, sizeof(*record) };
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(sd, &msg, 0);
+    } while (n == -1 && errno == EINTR);
+
+    if (n <= 0)
+        return -1;
+
+    *fd = -1;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        fcntl(*fd, F_SETFD, FD_CLOEXEC);
+    }
+
+    if (read_full(sd, (char *)record + n, sizeof(*record) - n) == -1) {
+        if (*fd != -1)
+            close(*fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+// tls sessions can't move to another process, closing streams finish here
+static int handed_off(struct sev_server *server, struct sev_stream *stream)
+{
+    if (stream->server != server ||
+        sev_slot_test(stream, SEV_SLOT_CLOSE_PENDING))
+        return 0;
+
+#ifdef SEV_TLS
+    if (stream->tls)
+        return 0;
+#endif
+
+    return 1;
+}
+
+// the unsent part of the write queue, file segments read back in
+static char *queued_data(struct sev_stream *stream)
+{
+    char *data = malloc(stream->queue->bytes + 1);
+    char *p = data;
+
+    struct sev_buffer *buffer;
+    STAILQ_FOREACH(buffer, &stream->queue->head, entries) {
+        size_t len = buffer->len - buffer->start;
+
+        if (buffer->fd == -1) {
+            memcpy(p, buffer->data + buffer->start, len);
+            p += len;
+            continue;
+        }
+
+        off_t offset = buffer->offset + buffer->start;
+        while (len > 0) {
+            ssize_t n = pread(buffer->fd, p, len, offset);
+            if (n <= 0) {
+                free(data);
+                return NULL;
+            }
+
+            p += n;
+            offset += n;
+            len -= n;
+        }
+    }
+
+    return data;
+}
+
+static int send_stream(int sd, struct sev_stream *stream)
+{
+    static char *state;
+    static size_t state_size;
+
+    struct sev_handoff_record record;
+    memset(&record, 0, sizeof(record));
+    record.type = SEV_HANDOFF_STREAM;
+    record.addr_len = stream->remote_addr_len;
+    record.queued = stream->queue->bytes;
+    memcpy(&record.addr, &stream->remote_addr, stream->remote_addr_len);
+
+    if (handoff_save_cb) {
+        record.state_len = handoff_save_cb(stream, state, state_size);
+
+        if (record.state_len > state_size) {
+            state_size = record.state_len;
+            state = realloc(state, state_size);
+            handoff_save_cb(stream, state, state_size);
+        }
+    }
+
+    char *queued = queued_data(stream);
+    if (queued == NULL)
+        return -1;
+
+    int ret = send_record(sd, &record, stream->sd) == -1 ||
+        write_full(sd, queued, record.queued) == -1 ||
+        write_full(sd, state, record.state_len) == -1 ? -1 : 0;
+
+    free(queued);
+    return ret;
+}
+
+// everything is written before any stream is let go, so a successor
+// that fails halfway leaves the old process serving as before
+static int handoff_send(int sd, struct sev_server *server)
+{
+    struct sev_handoff_record record;
+    memset(&record, 0, sizeof(record));
+    record.type = SEV_HANDOFF_LISTENER;
+
+    if (send_record(sd, &record, server->sd) == -1)
+        return -1;
+
+    size_t i = 0;
+    struct sev_stream *stream;
+
+    while ((stream = sev_table_next(&i)) != NULL)
+        if (handed_off(server, stream) && send_stream(sd, stream) == -1)
+            return -1;
+
+    record.type = SEV_HANDOFF_END;
+    if (send_record(sd, &record, -1) == -1)
+        return -1;
+
+    // the successor owns the sockets once it acknowledges
+    char ack;
+    return read_full(sd, &ack, 1);
+}
+
+static void handoff_cb(EV_P_ struct ev_io *watcher, int revents)
+{
+    struct sev_server *server = watcher->data;
+
+    // the listener doesn't block, a successor that went away before the
+    // accept leaves nothing to wait for
+    int sd = accept(watcher->fd, NULL, NULL);
+    if (sd == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            perror("accept");
+        return;
+    }
+
+    // blocking, the loop waits while the streams are handed over so none
+    // of them changes in between, but not for longer than the timeout
+    struct timeval timeout = { HANDOFF_TIMEOUT, 0 };
+    if (setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+            sizeof(timeout)) == -1 ||
+        setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+            sizeof(timeout)) == -1) {
+        perror("setsockopt");
+        close(sd);
+        return;
+    }
+
+    // on failure the successor gives up too, the streams stay here
+    if (handoff_send(sd, server) == -1) {
+        perror("handoff");
+        close(sd);
+        return;
+    }
+
+    close(sd);
+
+    size_t i = 0;
+    struct sev_stream *stream;
+
+    while ((stream = sev_table_next(&i)) != NULL)
+        if (handed_off(server, stream))
+            sev_stream_detach(stream);
+
+    // stop accepting, the successor listens on the same socket now
+    ev_io_stop(EV_A_ server->watcher);
+    free(server->watcher);
+    server->watcher = NULL;
+    close(server->sd);
+
+    // the path is the successor's to bind
+    ev_io_stop(EV_A_ watcher);
+    close(watcher->fd);
+
+    ev_break(EV_A_ EVBREAK_ALL);
+}
+
+// interface
+
+// streams left behind are closed when the caller exits after ev_run
+int sev_handoff_listen(struct sev_server *server, const char *path,
+    sev_save_cb *save_cb)
+{
+    struct sockaddr_un addr;
+    if (handoff_addr(&addr, path) == -1)
+        return -1;
+
+    int sd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sd == -1)
+        return -1;
+
+    fcntl(sd, F_SETFD, FD_CLOEXEC);
+    fcntl(sd, F_SETFL, O_NONBLOCK);
+    sev_unlink_socket(path);
+
+    if (bind(sd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(sd, 1) == -1) {
+        close(sd);
+        return -1;
+    }
+
+    handoff_save_cb = save_cb;
+
+    ev_io_init(&handoff_watcher, handoff_cb, sd, EV_READ);
+    handoff_watcher.data = server;
+    ev_io_start(EV_DEFAULT_ &handoff_watcher);
+
+    return 0;
+}
+
+static void pending_free(struct pending *p)
+{
+    free(p->queued);
+    free(p->state);
+    free(p);
+}
+
+static struct pending *recv_stream(int sd, struct sev_handoff_record *record,
+    int fd)
+{
+    struct pending *p = calloc(1, sizeof(struct pending));
+    p->sd = fd;
+    p->record = *record;
+    p->queued = malloc(record->queued + 1);
+    p->state = malloc(record->state_len + 1);
+
+    if (p->queued == NULL || p->state == NULL ||
+        record->addr_len > sizeof(record->addr) ||
+        read_full(sd, p->queued, record->queued) == -1 ||
+        read_full(sd, p->state, record->state_len) == -1) {
+        close(fd);
+        pending_free(p);
+        return NULL;
+    }
+
+    return p;
+}
+
+int sev_handoff_recv(const char *path)
+{
+    struct sockaddr_un addr;
+    if (handoff_addr(&addr, path) == -1)
+        return -1;
+
+    int sd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sd == -1)
+        return -1;
+
+    // nobody to take over from
+    if (connect(sd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(sd);
+        return -1;
+    }
+
+    int listener = -1;
+    struct sev_handoff_record record;
+    int fd;
+
+    while (recv_record(sd, &record, &fd) == 0) {
+        if (record.type == SEV_HANDOFF_END) {
+            // the old process lets go of the sockets on the ack
+            char ack = 1;
+            if (listener == -1 || write_full(sd, &ack, 1) == -1)
+                break;
+
+            close(sd);
+            return listener;
+        }
+
+        if (record.type == SEV_HANDOFF_LISTENER && listener == -1 &&
+            fd != -1) {
+            listener = fd;
+            continue;
+        }
+
+        if (record.type != SEV_HANDOFF_STREAM || fd == -1) {
+            if (fd != -1)
+                close(fd);
+            break;
+        }
+
+        struct pending *p = recv_stream(sd, &record, fd);
+        if (p == NULL)
+            break;
+
+        p->next = pending;
+        pending = p;
+    }
+
+    // incomplete, the old process keeps serving
+    while (pending) {
+        struct pending *p = pending;
+        pending = p->next;
+        close(p->sd);
+        pending_free(p);
+    }
+
+    if (listener != -1)
+        close(listener);
+
+    close(sd);
+    errno = EPROTO;
+    return -1;
+}
+
+void sev_handoff_adopt(struct sev_server *server, sev_restore_cb *restore_cb)
+{
+    while (pending) {
+        struct pending *p = pending;
+        pending = p->next;
+
+        struct sev_stream *stream = sev_stream_adopt(server, p->sd,
+            &p->record.addr, p->record.addr_len);
+
+        if (stream) {
+            // output the old process hadn't sent yet goes out first
+            if (p->record.queued)
+                sev_send(stream, p->queued, p->record.queued);
+
+            if (restore_cb)
+                restore_cb(stream, p->state, p->record.state_len);
+        }
+
+        pending_free(p);
+    }
+}
+
+#endif
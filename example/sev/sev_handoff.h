@@ -0,0 +1,85 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SEV_HANDOFF_H
+#define SEV_HANDOFF_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "sev.h"
+
+// zero downtime restarts: the running process hands its listening socket
+// and live streams to a successor over a unix socket, with SCM_RIGHTS
+//
+// the successor connects with sev_handoff_recv, which reads a listener
+// record, one stream record per connection and an end record. each
+// record is followed by queued bytes, the stream's unsent output, and
+// state_len bytes from the application's save callback. the records are
+// in host byte order, both processes must run on the same machine
+//
+// libev backend only, tls streams and streams being closed stay behind
+
+#define SEV_HANDOFF_LISTENER 1
+#define SEV_HANDOFF_STREAM 2
+#define SEV_HANDOFF_END 3
+
+struct sev_handoff_record {
+    uint32_t type;
+    uint32_t addr_len;
+    uint64_t queued;
+    uint64_t state_len;
+    struct sockaddr_storage addr;
+};
+
+// writes the application's state for stream, returns its length
+// nothing is written if it exceeds size, then it's called again
+typedef size_t (sev_save_cb)(struct sev_stream *stream, char *out,
+    size_t size);
+
+// recreates the state of a handed off stream, instead of open_cb
+typedef void (sev_restore_cb)(struct sev_stream *stream, const char *data,
+    size_t len);
+
+// old process: wait for a successor on path, then hand it the listener
+// and server's streams and break out of the loop. their data pointers
+// are not freed, the process is expected to exit
+int sev_handoff_listen(struct sev_server *server, const char *path,
+    sev_save_cb *save_cb);
+
+// new process: take over from the process waiting on path
+// returns the listening socket for sev_listen_fd, -1 if there is none
+int sev_handoff_recv(const char *path);
+
+// new process: open the received streams on server once its callbacks
+// are set, queueing their unsent output and calling restore_cb
+void sev_handoff_adopt(struct sev_server *server, sev_restore_cb *restore_cb);
+
+// backend specific, a stream for an open socket without calling open_cb
+// and a stream's teardown without close_cb, its socket lives on elsewhere
+struct sev_stream *sev_stream_adopt(struct sev_server *server, int sd,
+    struct sockaddr_storage *addr, socklen_t addr_len);
+void sev_stream_detach(struct sev_stream *stream);
+
+#endif
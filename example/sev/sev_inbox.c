@@ -0,0 +1,98 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#ifdef SEV_URING
+# include <sys/eventfd.h>
+#endif
+#include "sev_inbox.h"
+
+int sev_inbox_init(struct sev_inbox *inbox)
+{
+    memset(inbox, 0, sizeof(struct sev_inbox));
+    return sev_inbox_start(inbox);
+}
+
+// queue a copy of data for the stream behind handle, from any thread
+// data for streams that closed in the meantime is dropped
+int sev_post(struct sev_inbox *inbox, sev_handle handle, const char *data,
+    size_t len)
+{
+    struct sev_message *message = malloc(sizeof(struct sev_message));
+    if (!message)
+        return -1;
+
+    message->handle = handle;
+    message->shared = sev_shared_new(len);
+    memcpy(message->shared->data, data, len);
+
+    // push onto the stack of pending messages
+    struct sev_message *head = __atomic_load_n(&inbox->head, __ATOMIC_RELAXED);
+    do {
+        message->next = head;
+    } while (!__atomic_compare_exchange_n(&inbox->head, &head, message, 1,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // only the first message of a batch wakes the loop
+    if (head == NULL) {
+#ifdef SEV_URING
+        uint64_t one = 1;
+        write(inbox->fd, &one, sizeof(one));
+#else
+        ev_async_send(EV_DEFAULT_ &inbox->watcher);
+#endif
+    }
+
+    return 0;
+}
+
+// called by the backend on wakeup, from the loop thread
+void sev_inbox_drain(struct sev_inbox *inbox)
+{
+    struct sev_message *message =
+        __atomic_exchange_n(&inbox->head, NULL, __ATOMIC_ACQUIRE);
+
+    // the stack is newest first, reverse it to keep the posting order
+    struct sev_message *list = NULL;
+    while (message) {
+        struct sev_message *next = message->next;
+        message->next = list;
+        list = message;
+        message = next;
+    }
+
+    while (list) {
+        struct sev_message *next = list->next;
+        struct sev_stream *stream = sev_stream_get(list->handle);
+
+        if (stream)
+            sev_send_shared(stream, list->shared);
+
+        sev_shared_unref(list->shared);
+        free(list);
+        list = next;
+    }
+}
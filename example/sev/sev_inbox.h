@@ -0,0 +1,63 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SEV_INBOX_H
+#define SEV_INBOX_H
+
+#include <stdint.h>
+#include "sev.h"
+
+struct sev_message {
+    struct sev_message *next;
+    sev_handle handle;
+    struct sev_shared *shared;
+};
+
+// lock-free multi-producer, single-consumer queue of outgoing data
+// any thread may post, the loop thread sends
+struct sev_inbox {
+    // last message posted, producers push here
+    struct sev_message *head;
+
+    // wakeup, signaled once per batch
+#ifdef SEV_URING
+    int fd;
+    uint64_t counter;
+#else
+    struct ev_async watcher;
+#endif
+};
+
+int sev_inbox_init(struct sev_inbox *inbox);
+
+int sev_post(struct sev_inbox *inbox, sev_handle handle, const char *data,
+    size_t len);
+
+void sev_inbox_drain(struct sev_inbox *inbox);
+
+// backend specific, registers the wakeup with the loop
+int sev_inbox_start(struct sev_inbox *inbox);
+
+#endif
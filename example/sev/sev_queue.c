@@ -23,8 +23,11 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _POSIX_C_SOURCE 200809L
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "sev_queue.h"
 
 static struct sev_buffer *sev_buffer_new(const char *data, size_t len)
@@ -33,34 +36,72 @@ static struct sev_buffer *sev_buffer_new(const char *data, size_t len)
     buffer->start = 0;
     buffer->len = len;
     buffer->data = malloc(len);
+    buffer->shared = NULL;
+    buffer->fd = -1;
+    buffer->zerocopy = 0;
+    buffer->joined = 0;
     memcpy(buffer->data, data, len);
     return buffer;
 }
 
 static void sev_buffer_free(struct sev_buffer *buffer)
 {
-    free(buffer->data);
+    if (buffer->shared)
+        sev_shared_unref(buffer->shared);
+    else if (buffer->fd != -1)
+        close(buffer->fd);
+    else
+        free(buffer->data);
+
     free(buffer);
 }
 
+// the caller owns the first reference and sets len once data is written
+struct sev_shared *sev_shared_new(size_t len)
+{
+    struct sev_shared *shared = malloc(sizeof(struct sev_shared) + len);
+    shared->refs = 1;
+    shared->len = len;
+    return shared;
+}
+
+struct sev_shared *sev_shared_ref(struct sev_shared *shared)
+{
+    shared->refs++;
+    return shared;
+}
+
+void sev_shared_unref(struct sev_shared *shared)
+{
+    if (--shared->refs == 0)
+        free(shared);
+}
+
 struct sev_queue *sev_queue_new(void)
 {
     struct sev_queue *queue = malloc(sizeof(struct sev_queue));
     STAILQ_INIT(&queue->head);
+    queue->bytes = 0;
+    STAILQ_INIT(&queue->zerocopy);
     return queue;
 }
 
-void sev_queue_free(struct sev_queue *queue)
+static void sev_buffer_list_free(struct sev_buffer_head *head)
 {
-    struct sev_buffer *buffer = STAILQ_FIRST(&queue->head);
+    struct sev_buffer *buffer = STAILQ_FIRST(head);
 
     while (buffer != NULL) {
         struct sev_buffer *next = STAILQ_NEXT(buffer, entries);
         sev_buffer_free(buffer);
         buffer = next;
     }
-    STAILQ_INIT(&queue->head);
+    STAILQ_INIT(head);
+}
 
+void sev_queue_free(struct sev_queue *queue)
+{
+    sev_buffer_list_free(&queue->head);
+    sev_buffer_list_free(&queue->zerocopy);
     free(queue);
 }
 
@@ -73,11 +114,160 @@ void sev_queue_free_head(struct sev_queue *queue)
 {
     struct sev_buffer *buffer = sev_queue_head(queue);
     STAILQ_REMOVE_HEAD(&queue->head, entries);
-    sev_buffer_free(buffer);
+    queue->bytes -= buffer->len - buffer->start;
+
+    if (buffer->zerocopy)
+        STAILQ_INSERT_TAIL(&queue->zerocopy, buffer, entries);
+    else
+        sev_buffer_free(buffer);
 }
 
 void sev_queue_push_back(struct sev_queue *queue, const char *data, size_t len)
 {
     struct sev_buffer *buffer = sev_buffer_new(data, len);
     STAILQ_INSERT_TAIL(&queue->head, buffer, entries);
+    queue->bytes += len;
+}
+
+// queue a reference to shared, its data is not copied
+void sev_queue_push_shared(struct sev_queue *queue, struct sev_shared *shared)
+{
+    struct sev_buffer *buffer = malloc(sizeof(struct sev_buffer));
+    buffer->start = 0;
+    buffer->len = shared->len;
+    buffer->data = shared->data;
+    buffer->shared = sev_shared_ref(shared);
+    buffer->fd = -1;
+    buffer->zerocopy = 0;
+    buffer->joined = 0;
+    STAILQ_INSERT_TAIL(&queue->head, buffer, entries);
+    queue->bytes += shared->len;
+}
+
+// queue len bytes of fd from offset, the backend writes them straight
+// from the page cache. header, unless header_len is 0, is copied in front
+// of them and trimmed together with them
+// fd is duplicated, the caller may close it right away
+// returns -1 if it can't be duplicated
+int sev_queue_push_file(struct sev_queue *queue, const char *header,
+    size_t header_len, int fd, off_t offset, size_t len)
+{
+    int dup = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (dup == -1)
+        return -1;
+
+    if (header_len > 0) {
+        struct sev_buffer *buffer = sev_buffer_new(header, header_len);
+        buffer->joined = 1;
+        STAILQ_INSERT_TAIL(&queue->head, buffer, entries);
+        queue->bytes += header_len;
+    }
+
+    struct sev_buffer *buffer = malloc(sizeof(struct sev_buffer));
+    buffer->start = 0;
+    buffer->len = len;
+    buffer->data = NULL;
+    buffer->shared = NULL;
+    buffer->fd = dup;
+    buffer->offset = offset;
+    buffer->zerocopy = 0;
+    buffer->joined = 0;
+    STAILQ_INSERT_TAIL(&queue->head, buffer, entries);
+    queue->bytes += len;
+    return 0;
+}
+
+// mark len bytes as written, freeing the buffers that are done
+void sev_queue_consume(struct sev_queue *queue, size_t len)
+{
+    while (len > 0) {
+        struct sev_buffer *buffer = sev_queue_head(queue);
+        size_t left = buffer->len - buffer->start;
+
+        if (len < left) {
+            buffer->start += len;
+            queue->bytes -= len;
+            return;
+        }
+
+        len -= left;
+        sev_queue_free_head(queue);
+    }
+}
+
+// the last buffer of the message that starts at buffer
+static struct sev_buffer *message_end(struct sev_buffer *buffer)
+{
+    while (buffer->joined && STAILQ_NEXT(buffer, entries) != NULL)
+        buffer = STAILQ_NEXT(buffer, entries);
+
+    return buffer;
+}
+
+// drop the oldest messages until at most limit bytes are queued
+// a partially written head, the first keep buffers (those a send in
+// flight points into), the rest of their messages and the newest message
+// are always kept
+void sev_queue_trim(struct sev_queue *queue, size_t limit, int keep)
+{
+    struct sev_buffer *prev, *end;
+
+    // from the head while nothing is pinned there
+    while (keep == 0 && queue->bytes > limit &&
+        (prev = sev_queue_head(queue)) != NULL && prev->start == 0) {
+        end = message_end(prev);
+        if (STAILQ_NEXT(end, entries) == NULL)
+            return;
+
+        while (sev_queue_head(queue) != end)
+            sev_queue_free_head(queue);
+
+        sev_queue_free_head(queue);
+    }
+
+    prev = sev_queue_head(queue);
+    if (prev == NULL || queue->bytes <= limit)
+        return;
+
+    // past the pinned messages, prev is the last buffer kept
+    for (; keep > 1 && STAILQ_NEXT(prev, entries) != NULL; keep--)
+        prev = STAILQ_NEXT(prev, entries);
+
+    prev = message_end(prev);
+
+    while (queue->bytes > limit) {
+        struct sev_buffer *buffer = STAILQ_NEXT(prev, entries);
+        if (buffer == NULL)
+            return;
+
+        // never the tail, so the head's last pointer stays valid
+        end = message_end(buffer);
+        if (STAILQ_NEXT(end, entries) == NULL)
+            return;
+
+        STAILQ_NEXT(prev, entries) = STAILQ_NEXT(end, entries);
+
+        int last;
+        do {
+            struct sev_buffer *next = STAILQ_NEXT(buffer, entries);
+            last = buffer == end;
+
+            queue->bytes -= buffer->len;
+            sev_buffer_free(buffer);
+            buffer = next;
+        } while (!last);
+    }
+}
+
+// free the buffers whose last zero copy send is seq or older
+// tcp completes sends in order, so the list is too
+void sev_queue_zerocopy_done(struct sev_queue *queue, uint32_t seq)
+{
+    struct sev_buffer *buffer;
+
+    while ((buffer = STAILQ_FIRST(&queue->zerocopy)) != NULL &&
+        (int32_t)(buffer->zc_seq - seq) <= 0) {
+        STAILQ_REMOVE_HEAD(&queue->zerocopy, entries);
+        sev_buffer_free(buffer);
+    }
 }
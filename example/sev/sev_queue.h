@@ -27,20 +27,56 @@
 #define SEV_QUEUE_H
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <sys/queue.h>
+#include <sys/types.h>
+
+// reference counted data, queued on many streams without copies
+struct sev_shared {
+    int refs;
+    size_t len;
+    char data[];
+};
 
 struct sev_buffer {
     size_t len;
     size_t start;
     char *data;
 
+    // data belongs to this shared buffer if not NULL
+    struct sev_shared *shared;
+
+    // file segment when not -1, len bytes of fd from offset, data is NULL
+    int fd;
+    off_t offset;
+
+    // sent with MSG_ZEROCOPY, zc_seq is the last send that used data
+    int zerocopy;
+    uint32_t zc_seq;
+
+    // the next buffer is the rest of the same message, e.g. a file
+    // segment after its frame header, sev_queue_trim drops both or neither
+    int joined;
+
     STAILQ_ENTRY(sev_buffer) entries;
 };
 
 struct sev_queue {
     STAILQ_HEAD(sev_buffer_head, sev_buffer) head;
+
+    // bytes queued and not yet written
+    size_t bytes;
+
+    // written with MSG_ZEROCOPY, kept until the kernel is done with them
+    struct sev_buffer_head zerocopy;
 };
 
+struct sev_shared *sev_shared_new(size_t len);
+
+struct sev_shared *sev_shared_ref(struct sev_shared *shared);
+
+void sev_shared_unref(struct sev_shared *shared);
+
 struct sev_queue *sev_queue_new(void);
 
 void sev_queue_free(struct sev_queue *queue);
@@ -51,4 +87,15 @@ void sev_queue_free_head(struct sev_queue *queue);
 
 void sev_queue_push_back(struct sev_queue *queue, const char *data, size_t len);
 
+void sev_queue_push_shared(struct sev_queue *queue, struct sev_shared *shared);
+
+int sev_queue_push_file(struct sev_queue *queue, const char *header,
+    size_t header_len, int fd, off_t offset, size_t len);
+
+void sev_queue_consume(struct sev_queue *queue, size_t len);
+
+void sev_queue_trim(struct sev_queue *queue, size_t limit, int keep);
+
+void sev_queue_zerocopy_done(struct sev_queue *queue, uint32_t seq);
+
 #endif
@@ -0,0 +1,218 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "sev_router.h"
+
+#define MIN_BUCKETS 16
+
+// fnv-1a
+static size_t hash_name(const char *name)
+{
+    size_t hash = 2166136261u;
+
+    for (; *name; name++) {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static struct sev_topic **topic_slot(struct sev_router *router,
+    const char *name, size_t hash)
+{
+    struct sev_topic **slot =
+        &router->buckets[hash & (router->num_buckets - 1)];
+
+    for (; *slot; slot = &(*slot)->next)
+        if ((*slot)->hash == hash && !strcmp((*slot)->name, name))
+            break;
+
+    return slot;
+}
+
+static void router_grow(struct sev_router *router)
+{
+    size_t num_buckets = router->num_buckets * 2;
+    struct sev_topic **buckets = calloc(num_buckets, sizeof(*buckets));
+
+    for (size_t i = 0; i < router->num_buckets; i++) {
+        struct sev_topic *topic = router->buckets[i];
+
+        while (topic) {
+            struct sev_topic *next = topic->next;
+            struct sev_topic **slot = &buckets[topic->hash & (num_buckets - 1)];
+            topic->next = *slot;
+            *slot = topic;
+            topic = next;
+        }
+    }
+
+    free(router->buckets);
+    router->buckets = buckets;
+    router->num_buckets = num_buckets;
+}
+
+static struct sev_topic *topic_get(struct sev_router *router, const char *name)
+{
+    size_t hash = hash_name(name);
+    struct sev_topic **slot = topic_slot(router, name, hash);
+
+    if (*slot)
+        return *slot;
+
+    struct sev_topic *topic = calloc(1, sizeof(struct sev_topic));
+    topic->name = malloc(strlen(name) + 1);
+    strcpy(topic->name, name);
+    topic->hash = hash;
+    topic->router = router;
+    *slot = topic;
+
+    if (++router->num_topics > router->num_buckets)
+        router_grow(router);
+
+    return topic;
+}
+
+static void topic_free(struct sev_topic *topic)
+{
+    for (size_t i = 0; i < topic->len; i++) {
+        LIST_REMOVE(topic->subs[i], entries);
+        free(topic->subs[i]);
+    }
+
+    free(topic->streams);
+    free(topic->subs);
+    free(topic->name);
+    free(topic);
+}
+
+// interface
+
+void sev_router_init(struct sev_router *router)
+{
+    router->num_buckets = MIN_BUCKETS;
+    router->num_topics = 0;
+    router->buckets = calloc(router->num_buckets, sizeof(struct sev_topic *));
+}
+
+void sev_router_free(struct sev_router *router)
+{
+    for (size_t i = 0; i < router->num_buckets; i++) {
+        struct sev_topic *topic = router->buckets[i];
+
+        while (topic) {
+            struct sev_topic *next = topic->next;
+            topic_free(topic);
+            topic = next;
+        }
+    }
+
+    free(router->buckets);
+    router->buckets = NULL;
+}
+
+struct sev_subscription *sev_router_subscribe(struct sev_router *router,
+    const char *name, struct sev_stream *stream)
+{
+    struct sev_topic *topic = topic_get(router, name);
+
+    if (topic->len == topic->cap) {
+        topic->cap = topic->cap ? topic->cap * 2 : 4;
+        topic->streams = realloc(topic->streams,
+            topic->cap * sizeof(struct sev_stream *));
+        topic->subs = realloc(topic->subs,
+            topic->cap * sizeof(struct sev_subscription *));
+    }
+
+    struct sev_subscription *sub = malloc(sizeof(struct sev_subscription));
+    sub->topic = topic;
+    sub->stream = stream;
+    sub->index = topic->len++;
+
+    topic->streams[sub->index] = stream;
+    topic->subs[sub->index] = sub;
+
+    LIST_INSERT_HEAD(&stream->subscriptions, sub, entries);
+
+    return sub;
+}
+
+void sev_router_unsubscribe(struct sev_subscription *sub)
+{
+    struct sev_topic *topic = sub->topic;
+
+    // swap-remove, moving the last subscriber into the hole
+    size_t last = --topic->len;
+
+    if (sub->index != last) {
+        topic->streams[sub->index] = topic->streams[last];
+        topic->subs[sub->index] = topic->subs[last];
+        topic->subs[sub->index]->index = sub->index;
+    }
+
+    LIST_REMOVE(sub, entries);
+    free(sub);
+
+    if (topic->len > 0)
+        return;
+
+    // drop empty topics
+    struct sev_router *router = topic->router;
+    *topic_slot(router, topic->name, topic->hash) = topic->next;
+    router->num_topics--;
+    topic_free(topic);
+}
+
+// unsubscribe stream from every topic, sev does this when it closes
+void sev_router_drop(struct sev_stream *stream)
+{
+    struct sev_subscription *sub;
+
+    while ((sub = LIST_FIRST(&stream->subscriptions)) != NULL)
+        sev_router_unsubscribe(sub);
+}
+
+// queue shared on every subscriber of topic
+// returns the number of subscribers
+size_t sev_router_publish(struct sev_router *router, const char *name,
+    struct sev_shared *shared)
+{
+    size_t hash = hash_name(name);
+    struct sev_topic *topic = *topic_slot(router, name, hash);
+
+    if (!topic)
+        return 0;
+
+    size_t len = topic->len;
+    struct sev_stream **streams = topic->streams;
+
+    // backwards, so a subscriber that leaves in full_cb is not skipped
+    for (size_t i = len; i > 0; i--)
+        sev_send_shared(streams[i - 1], shared);
+
+    return len;
+}
@@ -0,0 +1,79 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SEV_ROUTER_H
+#define SEV_ROUTER_H
+
+#include <stdlib.h>
+#include "sev.h"
+
+struct sev_router;
+
+struct sev_topic {
+    char *name;
+    size_t hash;
+    struct sev_router *router;
+
+    // subscribers, dense and in the same order
+    struct sev_stream **streams;
+    struct sev_subscription **subs;
+    size_t len;
+    size_t cap;
+
+    struct sev_topic *next;
+};
+
+struct sev_subscription {
+    struct sev_topic *topic;
+    struct sev_stream *stream;
+
+    // position in the topic arrays
+    size_t index;
+
+    LIST_ENTRY(sev_subscription) entries;
+};
+
+struct sev_router {
+    // topic hash table, buckets is a power of 2
+    struct sev_topic **buckets;
+    size_t num_buckets;
+    size_t num_topics;
+};
+
+void sev_router_init(struct sev_router *router);
+
+void sev_router_free(struct sev_router *router);
+
+struct sev_subscription *sev_router_subscribe(struct sev_router *router,
+    const char *topic, struct sev_stream *stream);
+
+void sev_router_unsubscribe(struct sev_subscription *sub);
+
+void sev_router_drop(struct sev_stream *stream);
+
+size_t sev_router_publish(struct sev_router *router, const char *topic,
+    struct sev_shared *shared);
+
+#endif
@@ -0,0 +1,520 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SEV_URING
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <ev.h>
+#include "sev_shm.h"
+
+// sent by the server with the memfd, the consumer's eventfd and its own
+struct hello {
+    uint32_t magic;
+    uint32_t size;
+};
+
+static void wake(int fd)
+{
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        perror("eventfd");
+}
+
+static int shm_addr(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+// like sev_unlink_socket, sev_shm builds without the sev core sockets
+static void shm_unlink_stale(const char *path)
+{
+    struct stat st;
+
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+}
+
+static void shm_free(struct sev_shm *shm)
+{
+    ev_io_stop(EV_DEFAULT_ &shm->w_sd);
+    ev_io_stop(EV_DEFAULT_ &shm->w_wake);
+
+    munmap(shm->header, shm->map_len);
+    close(shm->sd);
+    close(shm->wake_fd);
+    close(shm->peer_fd);
+
+    sev_queue_free(shm->queue);
+    free(shm);
+}
+
+static void shm_finish(struct sev_shm *shm)
+{
+    if (shm->close_cb)
+        shm->close_cb(shm);
+
+    shm_free(shm);
+}
+
+// room left in our ring, 0 if the peer's head makes no sense
+static size_t ring_room(struct sev_shm *shm)
+{
+    uint64_t used = shm->out_tail -
+        __atomic_load_n(&shm->out->head, __ATOMIC_ACQUIRE);
+
+    if (used > shm->size) {
+        // closed from the loop, the caller may still use shm
+        if (!shm->broken)
+            wake(shm->wake_fd);
+        shm->broken = 1;
+        return 0;
+    }
+
+    return shm->size - used;
+}
+
+// copy as much of data as fits, returns how much
+static size_t ring_write(struct sev_shm *shm, const char *data, size_t len)
+{
+    size_t room = ring_room(shm);
+    if (len > room)
+        len = room;
+
+    if (len == 0)
+        return 0;
+
+    size_t at = shm->out_tail & (shm->size - 1);
+    size_t first = shm->size - at < len ? shm->size - at : len;
+
+    memcpy(shm->out_data + at, data, first);
+    memcpy(shm->out_data, data + first, len - first);
+
+    // publish, then wake the reader if it went to sleep before seeing it
+    shm->out_tail += len;
+    __atomic_store_n(&shm->out->tail, shm->out_tail, __ATOMIC_SEQ_CST);
+
+    if (__atomic_exchange_n(&shm->out->reader_waiting, 0, __ATOMIC_SEQ_CST))
+        wake(shm->peer_fd);
+
+    return len;
+}
+
+// move queued output into the ring, asking for a wakeup once it's full
+static void flush(struct sev_shm *shm)
+{
+    struct sev_buffer *buffer;
+
+    while ((buffer = sev_queue_head(shm->queue)) != NULL) {
+        size_t len = buffer->len - buffer->start;
+        size_t n = ring_write(shm, buffer->data + buffer->start, len);
+        sev_queue_consume(shm->queue, n);
+
+        if (n < len) {
+            __atomic_store_n(&shm->out->writer_waiting, 1, __ATOMIC_SEQ_CST);
+
+            // the reader may have made room before it saw the flag
+            if (ring_room(shm) == 0)
+                return;
+        }
+    }
+}
+
+// deliver what the peer wrote, a wrapped ring in two calls. at most a
+// ring's worth per wakeup, so a busy writer can't starve the loop
+static void drain(struct sev_shm *shm)
+{
+    struct sev_shm_ring *ring = shm->in;
+    size_t delivered = 0;
+
+    while (!shm->closing) {
+        uint64_t head = shm->in_head;
+        uint64_t avail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - head;
+
+        if (avail > shm->size) {
+            shm->broken = 1;
+            return;
+        }
+
+        if (avail == 0) {
+            // about to sleep, unless the writer got in first
+            __atomic_store_n(&ring->reader_waiting, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == head)
+                return;
+
+            __atomic_store_n(&ring->reader_waiting, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (delivered >= shm->size) {
+            wake(shm->wake_fd);
+            return;
+        }
+
+        size_t at = head & (shm->size - 1);
+        size_t len = avail < shm->size - at ? avail : shm->size - at;
+
+        if (shm->read_cb)
+            shm->read_cb(shm, shm->in_data + at, len);
+
+        // the bytes are the writer's again once read_cb returned
+        shm->in_head = head + len;
+        __atomic_store_n(&ring->head, shm->in_head, __ATOMIC_SEQ_CST);
+        delivered += len;
+
+        if (__atomic_exchange_n(&ring->writer_waiting, 0, __ATOMIC_SEQ_CST))
+            wake(shm->peer_fd);
+    }
+}
+
+static void wake_cb(EV_P_ struct ev_io *watcher, int revents)
+{
+    struct sev_shm *shm = watcher->data;
+
+    uint64_t counter;
+    if (read(shm->wake_fd, &counter, sizeof(counter)) == -1 &&
+        errno != EAGAIN)
+        perror("eventfd");
+
+    shm->polling++;
+    flush(shm);
+    drain(shm);
+    shm->polling--;
+
+    if (shm->closing)
+        shm_finish(shm);
+    else if (shm->broken)
+        sev_shm_close(shm);
+}
+
+// the socket only ever carries the setup, anything else is the end
+static void sd_cb(EV_P_ struct ev_io *watcher, int revents)
+{
+    struct sev_shm *shm = watcher->data;
+    char buffer[64];
+
+    ssize_t n = read(shm->sd, buffer, sizeof(buffer));
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+
+    sev_shm_close(shm);
+}
+
+// map a channel's memfd, side 0 is the server and 1 the consumer
+static struct sev_shm *shm_new(int sd, int memfd, uint32_t size, int side)
+{
+    size_t map_len = SEV_SHM_DATA + 2 * (size_t)size;
+    void *p = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd,
+        0);
+
+    if (p == MAP_FAILED)
+        return NULL;
+
+    struct sev_shm *shm = calloc(1, sizeof(struct sev_shm));
+    shm->sd = sd;
+    shm->header = p;
+    shm->map_len = map_len;
+    shm->size = size;
+
+    char *data = (char *)p + SEV_SHM_DATA;
+    shm->out = &shm->header->rings[side];
+    shm->in = &shm->header->rings[!side];
+    shm->out_data = data + side * (size_t)size;
+    shm->in_data = data + !side * (size_t)size;
+
+    shm->queue = sev_queue_new();
+
+    ev_io_init(&shm->w_sd, sd_cb, sd, EV_READ);
+    shm->w_sd.data = shm;
+
+    return shm;
+}
+
+// watch the eventfd once the descriptors are all set
+static void shm_start(struct sev_shm *shm)
+{
+    ev_io_init(&shm->w_wake, wake_cb, shm->wake_fd, EV_READ);
+    shm->w_wake.data = shm;
+
+    ev_io_start(EV_DEFAULT_ &shm->w_sd);
+    ev_io_start(EV_DEFAULT_ &shm->w_wake);
+}
+
+static struct sev_shm *shm_accept(struct sev_shm_server *server, int sd)
+{
+    uint32_t size = server->size ? server->size : SEV_SHM_SIZE;
+    if (size < 4096 || (size & (size - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int memfd = memfd_create("sev_shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    int efd[2] = {
+        eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+        eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+    };
+
+    struct sev_shm *shm = NULL;
+
+    // sealed, so a consumer can't shrink it under our mapping (SIGBUS)
+    if (memfd != -1 && efd[0] != -1 && efd[1] != -1 &&
+        ftruncate(memfd, SEV_SHM_DATA + 2 * (size_t)size) == 0 &&
+        fcntl(memfd, F_ADD_SEALS,
+        F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0)
+        shm = shm_new(sd, memfd, size, 0);
+
+    if (shm == NULL)
+        goto fail;
+
+    // both sides start out asleep, the first write wakes them
+    shm->header->magic = SEV_SHM_MAGIC;
+    shm->header->size = size;
+    shm->header->rings[0].reader_waiting = 1;
+    shm->header->rings[1].reader_waiting = 1;
+
+    struct hello hello = { SEV_SHM_MAGIC, size };
+    struct iovec iov = { &hello, sizeof(hello) };
+    int fds[3] = { memfd, efd[1], efd[0] };
+    char control[CMSG_SPACE(sizeof(fds))];
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    // a fresh socket's buffer takes the whole message at once
+    if (sendmsg(sd, &msg, 0) != sizeof(hello)) {
+        munmap(shm->header, shm->map_len);
+        sev_queue_free(shm->queue);
+        free(shm);
+        goto fail;
+    }
+
+    close(memfd);
+    shm->wake_fd = efd[0];
+    shm->peer_fd = efd[1];
+    shm->server = server;
+    shm->read_cb = server->read_cb;
+    shm->close_cb = server->close_cb;
+    shm->data = server->data;
+
+    shm_start(shm);
+    return shm;
+
+fail:
+    if (memfd != -1)
+        close(memfd);
+    if (efd[0] != -1)
+        close(efd[0]);
+    if (efd[1] != -1)
+        close(efd[1]);
+    return NULL;
+}
+
+static void accept_cb(EV_P_ struct ev_io *watcher, int revents)
+{
+    struct sev_shm_server *server = watcher->data;
+
+    for (;;) {
+        int sd = accept4(server->sd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("accept");
+            return;
+        }
+
+        struct sev_shm *shm = shm_accept(server, sd);
+        if (shm == NULL) {
+            perror("sev_shm");
+            close(sd);
+            continue;
+        }
+
+        if (server->open_cb)
+            server->open_cb(shm);
+    }
+}
+
+// interface
+
+// accept consumers on a unix socket at path, replacing a stale one
+// only sd and the watcher are set, the rest is up to the caller
+int sev_shm_listen(struct sev_shm_server *server, const char *path)
+{
+    struct sockaddr_un addr;
+    if (shm_addr(&addr, path) == -1)
+        return -1;
+
+    int sd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sd == -1)
+        return -1;
+
+    shm_unlink_stale(path);
+
+    if (bind(sd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(sd, SOMAXCONN) == -1) {
+        close(sd);
+        return -1;
+    }
+
+    server->sd = sd;
+    ev_io_init(&server->watcher, accept_cb, sd, EV_READ);
+    server->watcher.data = server;
+    ev_io_start(EV_DEFAULT_ &server->watcher);
+
+    return 0;
+}
+
+struct sev_shm *sev_shm_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    if (shm_addr(&addr, path) == -1)
+        return NULL;
+
+    int sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sd == -1)
+        return NULL;
+
+    if (connect(sd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(sd);
+        return NULL;
+    }
+
+    struct hello hello;
+    struct iovec iov = { &hello, sizeof(hello) };
+    int fds[3] = { -1, -1, -1 };
+    char control[CMSG_SPACE(sizeof(fds))];
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(sd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    // the size is checked against the memfd, not taken on trust, and
+    // the memfd must be sealed against shrinking
+    struct stat st;
+    struct sev_shm *shm = NULL;
+
+    if (n == sizeof(hello) && hello.magic == SEV_SHM_MAGIC &&
+        hello.size >= 4096 && (hello.size & (hello.size - 1)) == 0 &&
+        fds[0] != -1 && fstat(fds[0], &st) == 0 &&
+        (size_t)st.st_size >= SEV_SHM_DATA + 2 * (size_t)hello.size &&
+        (fcntl(fds[0], F_GET_SEALS) & F_SEAL_SHRINK))
+        shm = shm_new(sd, fds[0], hello.size, 1);
+
+    if (fds[0] != -1)
+        close(fds[0]);
+
+    if (shm == NULL) {
+        if (fds[1] != -1)
+            close(fds[1]);
+        if (fds[2] != -1)
+            close(fds[2]);
+        close(sd);
+        return NULL;
+    }
+
+    // only read from the loop from now on, for the peer's end of file
+    fcntl(sd, F_SETFL, fcntl(sd, F_GETFL, 0) | O_NONBLOCK);
+
+    shm->wake_fd = fds[1];
+    shm->peer_fd = fds[2];
+    shm_start(shm);
+
+    return shm;
+}
+
+// queued in the ring, or behind it until the peer makes room
+// returns -1 once the channel is broken or closing
+int sev_shm_send(struct sev_shm *shm, const char *data, size_t len)
+{
+    if (shm->closing || shm->broken)
+        return -1;
+
+    size_t n = 0;
+    if (sev_queue_head(shm->queue) == NULL)
+        n = ring_write(shm, data, len);
+
+    if (n < len) {
+        sev_queue_push_back(shm->queue, data + n, len - n);
+        flush(shm);
+    }
+
+    return shm->broken ? -1 : 0;
+}
+
+// from read_cb, close_cb runs and the channel is freed once it returns
+void sev_shm_close(struct sev_shm *shm)
+{
+    if (shm->closing)
+        return;
+
+    shm->closing = 1;
+
+    if (!shm->polling)
+        shm_finish(shm);
+}
+
+#endif
@@ -0,0 +1,158 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SEV_SHM_H
+#define SEV_SHM_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "sev.h"
+
+// shared memory channels between processes on one host: websocket
+// frames (ws_write_frame_header and the payload, parsed with
+// ws_read_next_frame and ws_parse_all) without the network stack
+//
+// a consumer connects to the unix socket from sev_shm_listen and gets
+// a memfd with one ring per direction and two eventfds, with
+// SCM_RIGHTS. each side copies into its ring and only signals the
+// other's eventfd when the other is waiting for data or for room. the
+// socket stays open so either side notices when the other goes away
+//
+// libev backend only. both processes must run on the same machine
+
+// bytes per direction when sev_shm_server.size is 0
+#define SEV_SHM_SIZE (1 << 20)
+
+#define SEV_SHM_MAGIC 0x4d485357
+
+// each index has a cache line to itself, the producer writes tail and
+// the consumer head. the waiting flags are set by the side that's about
+// to sleep and cleared by the one that wakes it
+struct sev_shm_ring {
+    uint64_t tail;
+    char pad0[56];
+    uint64_t head;
+    char pad1[56];
+    uint32_t reader_waiting;
+    uint32_t writer_waiting;
+    char pad2[56];
+};
+
+// the start of the memfd, the ring data follows at SEV_SHM_DATA
+// rings[0] carries the server's output, rings[1] the consumer's
+struct sev_shm_header {
+    uint32_t magic;
+    uint32_t size;
+    char pad[56];
+    struct sev_shm_ring rings[2];
+};
+
+#define SEV_SHM_DATA 4096
+
+struct sev_shm;
+
+typedef void (sev_shm_open_cb)(struct sev_shm *shm);
+typedef void (sev_shm_read_cb)(struct sev_shm *shm, char *data, size_t len);
+typedef void (sev_shm_close_cb)(struct sev_shm *shm);
+
+struct sev_shm_server {
+    // unix socket consumers connect to
+    int sd;
+#ifndef SEV_URING
+    struct ev_io watcher;
+#endif
+
+    // ring size per direction, a power of two, SEV_SHM_SIZE if 0
+    size_t size;
+
+    // callbacks, like sev_server's
+    sev_shm_open_cb *open_cb;
+    sev_shm_read_cb *read_cb;
+    sev_shm_close_cb *close_cb;
+
+    // user data
+    void *data;
+};
+
+struct sev_shm {
+    // kept open to notice when the peer goes away
+    int sd;
+
+    // ours is signaled when there's data or room, the peer's to wake it
+    int wake_fd;
+    int peer_fd;
+
+#ifndef SEV_URING
+    struct ev_io w_sd;
+    struct ev_io w_wake;
+#endif
+
+    // the mapped memfd
+    struct sev_shm_header *header;
+    size_t map_len;
+    uint32_t size;
+
+    struct sev_shm_ring *in;
+    struct sev_shm_ring *out;
+    char *in_data;
+    char *out_data;
+
+    // our own index in each ring, the shared copies are only published
+    uint64_t in_head;
+    uint64_t out_tail;
+
+    // output waiting for room in the ring
+    struct sev_queue *queue;
+
+    // NULL on the consumer side
+    struct sev_shm_server *server;
+
+    // read_cb is running, sev_shm_close waits for it to return
+    int polling;
+    int closing;
+
+    // the peer's index made no sense, closed from the loop
+    int broken;
+
+    // called with data in shared memory, which the peer may still write
+    // to, so anything that must not change has to be copied first
+    sev_shm_read_cb *read_cb;
+    sev_shm_close_cb *close_cb;
+
+    // user data
+    void *data;
+};
+
+int sev_shm_listen(struct sev_shm_server *server, const char *path);
+
+// consumer side, blocks until the server answers, NULL on failure
+// set the callbacks before returning to the loop
+struct sev_shm *sev_shm_connect(const char *path);
+
+int sev_shm_send(struct sev_shm *shm, const char *data, size_t len);
+
+void sev_shm_close(struct sev_shm *shm);
+
+#endif
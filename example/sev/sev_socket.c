@@ -0,0 +1,192 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "sev.h"
+
+// create a non-blocking listening socket bound to addr
+static int socket_listen(const struct sockaddr *addr, socklen_t addr_len)
+{
+    // create server socket
+    int sd = socket(addr->sa_family, SOCK_STREAM, 0);
+    if (sd == -1)
+        return -1;
+
+    int flag = 1;
+
+    if (addr->sa_family != AF_UNIX) {
+        // set reuseaddr
+        setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+
+#ifdef __linux
+        // disable nagle's algorithm, inherited by accepted sockets
+        setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+#endif
+    }
+
+    if (addr->sa_family == AF_INET6) {
+        // accept ipv4 clients too, as v4-mapped addresses
+        int off = 0;
+        setsockopt(sd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    }
+
+    fcntl(sd, F_SETFD, FD_CLOEXEC);
+
+    // bind/listen
+    if (bind(sd, addr, addr_len) == -1 || listen(sd, SOMAXCONN) == -1) {
+        close(sd);
+        return -1;
+    }
+
+    return sd;
+}
+
+static int server_listen(struct sev_server *server,
+    const struct sockaddr *addr, socklen_t addr_len)
+{
+    int sd = socket_listen(addr, addr_len);
+    if (sd == -1)
+        return -1;
+
+    if (sev_listen_fd(server, sd) == -1) {
+        close(sd);
+        return -1;
+    }
+
+    return 0;
+}
+
+// interface
+
+int sev_listen(struct sev_server *server, int port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    return server_listen(server, (struct sockaddr*)&addr, sizeof(addr));
+}
+
+// dual-stack, serves both ipv6 and ipv4 clients
+int sev_listen6(struct sev_server *server, int port)
+{
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_port = htons(port);
+    addr.sin6_addr = in6addr_any;
+
+    return server_listen(server, (struct sockaddr*)&addr, sizeof(addr));
+}
+
+// replaces a stale socket file left at path
+int sev_listen_unix(struct sev_server *server, const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    strcpy(addr.sun_path, path);
+    sev_unlink_socket(path);
+
+    return server_listen(server, (struct sockaddr*)&addr, sizeof(addr));
+}
+
+// removes a stale socket file before a bind to path, anything else there
+// is left alone and the bind fails with EADDRINUSE
+void sev_unlink_socket(const char *path)
+{
+    struct stat st;
+
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+}
+
+// returns the remote port, 0 for unix domain sockets
+int sev_remote_port(struct sev_stream *stream)
+{
+    struct sockaddr_storage *addr = &stream->remote_addr;
+
+    if (addr->ss_family == AF_INET)
+        return ntohs(((struct sockaddr_in *)addr)->sin_port);
+
+    if (addr->ss_family == AF_INET6)
+        return ntohs(((struct sockaddr_in6 *)addr)->sin6_port);
+
+    return 0;
+}
+
+// formats the remote address into out, which should hold SEV_ADDRSTRLEN
+const char *sev_remote_address(struct sev_stream *stream, char *out,
+    size_t len)
+{
+    struct sockaddr_storage *addr = &stream->remote_addr;
+
+    if (addr->ss_family == AF_INET) {
+        struct sockaddr_in *in = (struct sockaddr_in *)addr;
+        return inet_ntop(AF_INET, &in->sin_addr, out, len);
+    }
+
+    if (addr->ss_family == AF_INET6) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+
+        // ipv4 clients of a dual-stack listener
+        if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr))
+            return inet_ntop(AF_INET, &in6->sin6_addr.s6_addr[12], out, len);
+
+        return inet_ntop(AF_INET6, &in6->sin6_addr, out, len);
+    }
+
+    if (addr->ss_family == AF_UNIX) {
+        // clients are usually unnamed
+        struct sockaddr_un *un = (struct sockaddr_un *)addr;
+        size_t path_len = stream->remote_addr_len > sizeof(sa_family_t) ?
+            strnlen(un->sun_path, sizeof(un->sun_path)) : 0;
+
+        snprintf(out, len, "unix:%.*s", (int)path_len, un->sun_path);
+        return out;
+    }
+
+    snprintf(out, len, "unknown");
+    return out;
+}
@@ -0,0 +1,128 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "sev_table.h"
+
+struct sev_table sev_table;
+
+// grow an array of size elements to num, zeroing the new ones
+static void *grow(void *array, size_t size, size_t num, size_t element)
+{
+    char *p = realloc(array, num * element);
+    memset(p + size * element, 0, (num - size) * element);
+    return p;
+}
+
+void sev_table_add(struct sev_stream *stream)
+{
+    struct sev_table *t = &sev_table;
+    size_t sd = stream->sd;
+
+    if (sd >= t->size) {
+        size_t num = t->size ? t->size : 1024;
+        while (num <= sd)
+            num *= 2;
+
+        t->streams = grow(t->streams, t->size, num, sizeof(*t->streams));
+        t->generation = grow(t->generation, t->size, num,
+            sizeof(*t->generation));
+        t->flags = grow(t->flags, t->size, num, sizeof(*t->flags));
+        t->queued = grow(t->queued, t->size, num, sizeof(*t->queued));
+        t->last_active = grow(t->last_active, t->size, num,
+            sizeof(*t->last_active));
+        t->size = num;
+    }
+
+    // the generation tells apart streams that reuse a descriptor
+    stream->id = ++t->generation[sd];
+    t->streams[sd] = stream;
+    t->flags[sd] = 0;
+    t->queued[sd] = 0;
+    t->last_active[sd] = 0;
+}
+
+void sev_table_remove(struct sev_stream *stream)
+{
+    struct sev_table *t = &sev_table;
+    size_t sd = stream->sd;
+
+    if (sd < t->size && t->streams[sd] == stream) {
+        t->streams[sd] = NULL;
+        t->flags[sd] = 0;
+        t->queued[sd] = 0;
+    }
+}
+
+// the first stream at or after *sd, which is moved past it
+// returns NULL after the last one
+struct sev_stream *sev_table_next(size_t *sd)
+{
+    for (; *sd < sev_table.size; (*sd)++)
+        if (sev_table.streams[*sd])
+            return sev_table.streams[(*sd)++];
+
+    return NULL;
+}
+
+// sums over all streams, reading only the parallel arrays
+void sev_table_stats(struct sev_stats *stats, double now)
+{
+    struct sev_table *t = &sev_table;
+    memset(stats, 0, sizeof(struct sev_stats));
+
+    for (size_t sd = 0; sd < t->size; sd++) {
+        if (!t->streams[sd])
+            continue;
+
+        stats->streams++;
+        stats->queued += t->queued[sd];
+        stats->full += (t->flags[sd] & SEV_SLOT_FULL) != 0;
+        stats->paused += (t->flags[sd] & SEV_SLOT_PAUSED) != 0;
+
+        if (now - t->last_active[sd] > stats->max_idle)
+            stats->max_idle = now - t->last_active[sd];
+    }
+}
+
+// interface
+
+sev_handle sev_stream_handle(struct sev_stream *stream)
+{
+    return (uint64_t)stream->id << 32 | (uint32_t)stream->sd;
+}
+
+// returns NULL if the stream was closed, call from the loop thread
+// the stream itself is only read once the handle checks out
+struct sev_stream *sev_stream_get(sev_handle handle)
+{
+    size_t sd = (uint32_t)handle;
+    uint32_t id = handle >> 32;
+
+    if (sd >= sev_table.size || sev_table.generation[sd] != id)
+        return NULL;
+
+    return sev_table.streams[sd];
+}
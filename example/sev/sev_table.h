@@ -0,0 +1,95 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SEV_TABLE_H
+#define SEV_TABLE_H
+
+#include "sev.h"
+
+// streams indexed by socket descriptor, used by the backends
+//
+// the state every sweep over all streams needs is kept here in parallel
+// arrays rather than in struct sev_stream, so scanning it touches a few
+// dense arrays instead of one cold struct per stream
+struct sev_table {
+    size_t size;
+
+    struct sev_stream **streams;
+
+    // bumped whenever a slot gets a new stream, part of the handle
+    uint32_t *generation;
+
+    // SEV_SLOT_* flags, cleared when a slot gets a new stream
+    uint8_t *flags;
+
+    // bytes in the write queue, as of the last send or write
+    size_t *queued;
+
+    // time of the last read
+    double *last_active;
+};
+
+// above the high watermark, waiting to drain
+#define SEV_SLOT_FULL 0x1
+
+// reading stopped until pause_timer fires, see sev_pause_read
+#define SEV_SLOT_PAUSED 0x2
+
+// disconnect requested, closed from the event loop
+#define SEV_SLOT_CLOSE_PENDING 0x4
+
+// on the libev backend's dirty list, flushed or closed at the end of
+// the loop iteration, see sev_server.cork
+#define SEV_SLOT_DIRTY 0x8
+
+extern struct sev_table sev_table;
+
+void sev_table_add(struct sev_stream *stream);
+
+void sev_table_remove(struct sev_stream *stream);
+
+struct sev_stream *sev_table_next(size_t *sd);
+
+void sev_table_stats(struct sev_stats *stats, double now);
+
+// a removed stream keeps its slot until the descriptor is closed, so
+// these stay valid (and read as cleared) while it's torn down
+static inline int sev_slot_test(const struct sev_stream *stream, int flag)
+{
+    return sev_table.flags[stream->sd] & flag;
+}
+
+static inline void sev_slot_set(struct sev_stream *stream, int flag)
+{
+    if (sev_table.streams[stream->sd] == stream)
+        sev_table.flags[stream->sd] |= flag;
+}
+
+static inline void sev_slot_clear(struct sev_stream *stream, int flag)
+{
+    sev_table.flags[stream->sd] &= ~flag;
+}
+
+#endif
@@ -0,0 +1,137 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "sev_timer.h"
+
+#define SLOT_MASK (SEV_WHEEL_SLOTS - 1)
+
+static void wheel_insert(struct sev_wheel *wheel, struct sev_timer *timer)
+{
+    uint64_t delta = timer->expires - wheel->now;
+
+    // the first level whose range covers the delta
+    int level = 0;
+    while (level < SEV_WHEEL_LEVELS - 1 &&
+        delta >= 1ULL << (SEV_WHEEL_BITS * (level + 1)))
+        level++;
+
+    int slot = (timer->expires >> (SEV_WHEEL_BITS * level)) & SLOT_MASK;
+    LIST_INSERT_HEAD(&wheel->slots[level][slot], timer, entries);
+}
+
+// move the timers of a higher level slot down to the lower levels
+static void wheel_cascade(struct sev_wheel *wheel, int level)
+{
+    int slot = (wheel->now >> (SEV_WHEEL_BITS * level)) & SLOT_MASK;
+    struct sev_timer_list list = wheel->slots[level][slot];
+    LIST_INIT(&wheel->slots[level][slot]);
+
+    struct sev_timer *timer = LIST_FIRST(&list);
+    while (timer != NULL) {
+        struct sev_timer *next = LIST_NEXT(timer, entries);
+        wheel_insert(wheel, timer);
+        timer = next;
+    }
+}
+
+void sev_wheel_init(struct sev_wheel *wheel, uint64_t now)
+{
+    wheel->now = now;
+    wheel->count = 0;
+
+    for (int i = 0; i < SEV_WHEEL_LEVELS; i++)
+        for (int j = 0; j < SEV_WHEEL_SLOTS; j++)
+            LIST_INIT(&wheel->slots[i][j]);
+}
+
+// run every timer that expires up to and including tick now
+void sev_wheel_advance(struct sev_wheel *wheel, uint64_t now)
+{
+    while (wheel->now < now) {
+        if (wheel->count == 0) {
+            // nothing to cascade or run
+            wheel->now = now;
+            return;
+        }
+
+        wheel->now++;
+
+        // cascade from the highest level whose period just wrapped
+        int level = 0;
+        while (level < SEV_WHEEL_LEVELS - 1 &&
+            !(wheel->now & ((1ULL << (SEV_WHEEL_BITS * (level + 1))) - 1)))
+            level++;
+
+        for (; level > 0; level--)
+            wheel_cascade(wheel, level);
+
+        // callbacks may arm or cancel timers, so pop them one at a time
+        struct sev_timer_list *list = &wheel->slots[0][wheel->now & SLOT_MASK];
+        struct sev_timer *timer;
+
+        while ((timer = LIST_FIRST(list)) != NULL) {
+            LIST_REMOVE(timer, entries);
+            timer->active = 0;
+            wheel->count--;
+            timer->cb(timer);
+        }
+    }
+}
+
+void sev_timer_init(struct sev_timer *timer, sev_timer_cb *cb, void *data)
+{
+    timer->active = 0;
+    timer->cb = cb;
+    timer->data = data;
+}
+
+// run the timer in ticks from now, rearming it if already active
+void sev_timer_arm(struct sev_wheel *wheel, struct sev_timer *timer,
+    uint64_t ticks)
+{
+    if (timer->active)
+        LIST_REMOVE(timer, entries);
+    else
+        wheel->count++;
+
+    if (ticks == 0)
+        ticks = 1;
+    if (ticks > SEV_WHEEL_MAX)
+        ticks = SEV_WHEEL_MAX;
+
+    timer->active = 1;
+    timer->expires = wheel->now + ticks;
+    wheel_insert(wheel, timer);
+}
+
+void sev_timer_cancel(struct sev_wheel *wheel, struct sev_timer *timer)
+{
+    if (!timer->active)
+        return;
+
+    LIST_REMOVE(timer, entries);
+    timer->active = 0;
+    wheel->count--;
+}
@@ -0,0 +1,77 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SEV_TIMER_H
+#define SEV_TIMER_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+// hierarchical timer wheel: 4 levels of 64 slots cover 2^24 ticks
+#define SEV_WHEEL_BITS 6
+#define SEV_WHEEL_SLOTS (1 << SEV_WHEEL_BITS)
+#define SEV_WHEEL_LEVELS 4
+#define SEV_WHEEL_MAX ((1ULL << (SEV_WHEEL_BITS * SEV_WHEEL_LEVELS)) - 1)
+
+struct sev_timer;
+typedef void (sev_timer_cb)(struct sev_timer *timer);
+
+struct sev_timer {
+    // absolute expiry, in ticks
+    uint64_t expires;
+    int active;
+
+    sev_timer_cb *cb;
+
+    // user data
+    void *data;
+
+    LIST_ENTRY(sev_timer) entries;
+};
+
+struct sev_wheel {
+    // current time, in ticks
+    uint64_t now;
+
+    // number of armed timers
+    size_t count;
+
+    LIST_HEAD(sev_timer_list, sev_timer)
+        slots[SEV_WHEEL_LEVELS][SEV_WHEEL_SLOTS];
+};
+
+void sev_wheel_init(struct sev_wheel *wheel, uint64_t now);
+
+void sev_wheel_advance(struct sev_wheel *wheel, uint64_t now);
+
+void sev_timer_init(struct sev_timer *timer, sev_timer_cb *cb, void *data);
+
+void sev_timer_arm(struct sev_wheel *wheel, struct sev_timer *timer,
+    uint64_t ticks);
+
+void sev_timer_cancel(struct sev_wheel *wheel, struct sev_timer *timer);
+
+#endif
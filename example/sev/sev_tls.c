@@ -0,0 +1,160 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef SEV_TLS
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "sev_tls.h"
+
+// accept tls on server, cert_file holds the certificate chain in pem
+// with ktls set, openssl hands the record layer to the kernel after the
+// handshake when it can, so sends and receives skip userspace crypto
+int sev_tls_init(struct sev_server *server, const char *cert_file,
+    const char *key_file, int ktls)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx)
+        return -1;
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return -1;
+    }
+
+    // the write queue retries from a buffer that may have moved
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+        SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    if (ktls) {
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+
+        // kernels implement the gcm suites, prefer them
+        SSL_CTX_set_ciphersuites(ctx, "TLS_AES_128_GCM_SHA256:"
+            "TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256");
+    }
+
+    server->tls_ctx = ctx;
+    return 0;
+}
+
+int sev_tls_open(struct sev_stream *stream)
+{
+    stream->tls = SSL_new(stream->server->tls_ctx);
+    if (!stream->tls)
+        return -1;
+
+    SSL_set_fd(stream->tls, stream->sd);
+    SSL_set_accept_state(stream->tls);
+    return 0;
+}
+
+void sev_tls_close(struct sev_stream *stream)
+{
+    if (!stream->tls)
+        return;
+
+    // best effort, the socket is about to be closed
+    if (stream->tls_ready && !stream->ktls_send)
+        SSL_shutdown(stream->tls);
+
+    SSL_free(stream->tls);
+    stream->tls = NULL;
+}
+
+int sev_tls_handshake(struct sev_stream *stream, int *want_write)
+{
+    int ret = SSL_do_handshake(stream->tls);
+    *want_write = 0;
+
+    if (ret != 1) {
+        int err = SSL_get_error(stream->tls, ret);
+
+        if (err == SSL_ERROR_WANT_READ)
+            return 0;
+
+        if (err == SSL_ERROR_WANT_WRITE) {
+            *want_write = 1;
+            return 0;
+        }
+
+        return -1;
+    }
+
+    stream->tls_ready = 1;
+    stream->ktls_send = BIO_get_ktls_send(SSL_get_wbio(stream->tls)) == 1;
+    stream->ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(stream->tls)) == 1;
+    return 1;
+}
+
+static ssize_t tls_error(struct sev_stream *stream, int ret)
+{
+    switch (SSL_get_error(stream->tls, ret)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    default:
+        // after a fatal error the connection can't be used again, report
+        // it as closed so the stream goes away
+        return 0;
+    }
+}
+
+ssize_t sev_tls_recv(struct sev_stream *stream, char *data, size_t len)
+{
+    if (stream->ktls_recv) {
+        // control records such as alerts fail with EIO, treat it as eof
+        ssize_t n = recv(stream->sd, data, len, 0);
+        return n == -1 && errno == EIO ? 0 : n;
+    }
+
+    int ret = SSL_read(stream->tls, data, len);
+    return ret > 0 ? ret : tls_error(stream, ret);
+}
+
+ssize_t sev_tls_send(struct sev_stream *stream, const char *data,
+    size_t len)
+{
+    if (stream->ktls_send)
+        return send(stream->sd, data, len, 0);
+
+    int ret = SSL_write(stream->tls, data, len);
+    return ret > 0 ? ret : tls_error(stream, ret);
+}
+
+int sev_tls_pending(struct sev_stream *stream)
+{
+    return stream->tls && !stream->ktls_recv && SSL_pending(stream->tls) > 0;
+}
+
+#endif
@@ -0,0 +1,50 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SEV_TLS_H
+#define SEV_TLS_H
+
+#include <sys/types.h>
+#include "sev.h"
+
+// tls for the libev backend, used by sev.c
+// the calls below behave like send and recv: -1 with errno set to
+// EAGAIN when the socket would block
+
+int sev_tls_open(struct sev_stream *stream);
+void sev_tls_close(struct sev_stream *stream);
+
+// 1 once done, 0 while in progress, -1 on failure
+// *want_write is set when the handshake waits for the socket to drain
+int sev_tls_handshake(struct sev_stream *stream, int *want_write);
+
+ssize_t sev_tls_recv(struct sev_stream *stream, char *data, size_t len);
+ssize_t sev_tls_send(struct sev_stream *stream, const char *data,
+    size_t len);
+
+// decrypted bytes held by openssl, which the socket won't signal
+int sev_tls_pending(struct sev_stream *stream);
+
+#endif
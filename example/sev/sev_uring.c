@@ -0,0 +1,892 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef SEV_URING
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <linux/io_uring.h>
+#include "sev.h"
+#include "sev_router.h"
+#include "sev_table.h"
+#include "sev_inbox.h"
+#include "sev_capture.h"
+#include "../../ws_metrics.h"
+
+#define BUFSIZE 2048 // fits a 1500-byte MTU packet
+
+#define RING_ENTRIES 4096
+#define NUM_BUFFERS 4096 // power of 2, shared by all streams
+#define BUFFER_GROUP 0
+
+// file segments move through the stream's pipe at most this much at a time
+#define SPLICE_SIZE 65536 // the default pipe capacity
+
+// operation encoded in the low bits of the user_data pointer
+#define OP_ACCEPT 1
+#define OP_RECV 2
+#define OP_SEND 3
+#define OP_INBOX 4
+#define OP_CANCEL 5
+#define OP_SPLICE 6
+#define OP_MASK 7
+
+struct ring {
+    int fd;
+
+    // submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_pending;
+
+    // completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // provided buffers for multishot recv
+    struct io_uring_buf_ring *br;
+    char *buffers;
+};
+
+static struct ring ring;
+static struct sev_stream *dirty;
+
+// timer wheel, advanced once per loop iteration
+static struct sev_wheel wheel;
+
+static double clock_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t wheel_ticks(double now)
+{
+    return now / SEV_TICK;
+}
+
+static void wheel_arm(struct sev_timer *timer, double seconds)
+{
+    if (wheel.count == 0)
+        // the wheel is idle, bring it up to date first
+        sev_wheel_advance(&wheel, wheel_ticks(clock_now()));
+
+    // round up, timers never run early
+    sev_timer_arm(&wheel, timer, (uint64_t)(seconds / SEV_TICK) + 1);
+}
+
+// ring setup
+
+static int ring_enter(unsigned submit, unsigned wait)
+{
+    WS_COUNT(SEV_SYSCALLS, 1);
+
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+
+    if (!wait || wheel.count == 0)
+        return syscall(__NR_io_uring_enter, ring.fd, submit, wait, flags,
+            NULL, 0);
+
+    // wake up for the next tick while timers are armed
+    struct __kernel_timespec ts = { 0, SEV_TICK * 1e9 };
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (unsigned long)&ts;
+
+    return syscall(__NR_io_uring_enter, ring.fd, submit, wait,
+        flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+static int ring_init(void)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SUBMIT_ALL;
+
+    ring.fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (ring.fd == -1)
+        return -1;
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+        return -1;
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t len = sq_len > cq_len ? sq_len : cq_len;
+
+    char *sq = mmap(NULL, len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        return -1;
+
+    ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned *)(sq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(sq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(sq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+        IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED)
+        return -1;
+
+    // one array slot per sqe, in order
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        ring.sq_array[i] = i;
+
+    // register the provided buffer ring
+    ring.br = mmap(NULL, NUM_BUFFERS * sizeof(struct io_uring_buf),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring.br == MAP_FAILED)
+        return -1;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)ring.br;
+    reg.ring_entries = NUM_BUFFERS;
+    reg.bgid = BUFFER_GROUP;
+
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING,
+            &reg, 1) == -1)
+        return -1;
+
+    ring.buffers = malloc((size_t)NUM_BUFFERS * BUFSIZE);
+    if (!ring.buffers)
+        return -1;
+
+    for (int i = 0; i < NUM_BUFFERS; i++) {
+        struct io_uring_buf *buf = &ring.br->bufs[i];
+        buf->addr = (unsigned long)(ring.buffers + (size_t)i * BUFSIZE);
+        buf->len = BUFSIZE - 1; // room for a terminator, as in the libev path
+        buf->bid = i;
+    }
+    __atomic_store_n(&ring.br->tail, NUM_BUFFERS, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static void buffer_recycle(unsigned bid)
+{
+    unsigned short tail = ring.br->tail;
+    struct io_uring_buf *buf = &ring.br->bufs[tail & (NUM_BUFFERS - 1)];
+    buf->addr = (unsigned long)(ring.buffers + (size_t)bid * BUFSIZE);
+    buf->len = BUFSIZE - 1;
+    buf->bid = bid;
+    __atomic_store_n(&ring.br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe *ring_sqe(void *ptr, int op)
+{
+    unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring.sq_tail;
+
+    if (tail - head > *ring.sq_mask) {
+        // submission queue full, flush it without waiting
+        ring_enter(ring.sq_pending, 0);
+        ring.sq_pending = 0;
+        head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head > *ring.sq_mask)
+            return NULL;
+    }
+
+    struct io_uring_sqe *sqe = &ring.sqes[tail & *ring.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (unsigned long)ptr | op;
+
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.sq_pending++;
+
+    return sqe;
+}
+
+// sev_stream
+
+static void sev_stream_free(struct sev_stream *stream)
+{
+    // free write queue
+    sev_queue_free(stream->queue);
+
+    if (stream->held)
+        sev_queue_free(stream->held);
+
+    if (stream->pipe[0] != -1) {
+        close(stream->pipe[0]);
+        close(stream->pipe[1]);
+    }
+
+    // free everything
+    free(stream);
+}
+
+static void stream_release(struct sev_stream *stream)
+{
+    stream->inflight--;
+
+    if (stream->closing && stream->inflight == 0) {
+        if (close(stream->sd) == -1)
+            perror("close");
+        sev_stream_free(stream);
+    }
+}
+
+static void stream_close(struct sev_stream *stream)
+{
+    if (stream->closing)
+        return;
+
+    stream->closing = 1;
+    sev_capture(stream, SEV_CAPTURE_CLOSE, NULL, 0);
+
+    if (stream->server->close_cb)
+        stream->server->close_cb(stream);
+
+    sev_timer_cancel(&wheel, &stream->timer);
+    sev_timer_cancel(&wheel, &stream->idle_timer);
+    sev_timer_cancel(&wheel, &stream->pause_timer);
+    sev_router_drop(stream);
+    sev_table_remove(stream);
+
+    // completes the outstanding recv/send, the fd is closed after that
+    shutdown(stream->sd, SHUT_RDWR);
+
+    stream->inflight++;
+    stream_release(stream);
+}
+
+static void stream_timeout(struct sev_timer *timer)
+{
+    struct sev_stream *stream = timer->data;
+
+    if (stream->server->timeout_cb)
+        stream->server->timeout_cb(stream);
+    else
+        stream_close(stream);
+}
+
+static void stream_idle(struct sev_timer *timer)
+{
+    struct sev_stream *stream = timer->data;
+    double idle = clock_now() - sev_table.last_active[stream->sd];
+    double timeout = stream->server->idle_timeout;
+
+    // reads only touch last_active, the timer catches up here
+    if (idle < timeout)
+        wheel_arm(timer, timeout - idle);
+    else
+        stream_close(stream);
+}
+
+static void stream_drain(struct sev_stream *stream)
+{
+    struct sev_server *server = stream->server;
+
+    sev_table.queued[stream->sd] = stream->queue->bytes;
+
+    if (sev_slot_test(stream, SEV_SLOT_FULL) &&
+        stream->queue->bytes <= server->low_watermark) {
+        sev_slot_clear(stream, SEV_SLOT_FULL);
+
+        if (server->drain_cb)
+            server->drain_cb(stream);
+    }
+}
+
+static void stream_recv(struct sev_stream *stream)
+{
+    struct io_uring_sqe *sqe = ring_sqe(stream, OP_RECV);
+    if (!sqe) {
+        stream_close(stream);
+        return;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = stream->sd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+
+    stream->inflight++;
+    stream->receiving = 1;
+}
+
+static void stream_read(struct sev_stream *stream, char *data, size_t len)
+{
+    if (stream->closing || sev_slot_test(stream, SEV_SLOT_CLOSE_PENDING) ||
+        !stream->server->read_cb)
+        return;
+
+    if (sev_slot_test(stream, SEV_SLOT_PAUSED)) {
+        if (!stream->held)
+            stream->held = sev_queue_new();
+
+        sev_queue_push_back(stream->held, data, len);
+        return;
+    }
+
+    uint64_t t = WS_CLOCK();
+    stream->server->read_cb(stream, data, len);
+    WS_RECORD(SEV_READ_NS, WS_CLOCK() - t);
+}
+
+static void stream_resume(struct sev_timer *timer)
+{
+    struct sev_stream *stream = timer->data;
+    struct sev_buffer *buffer;
+
+    sev_slot_clear(stream, SEV_SLOT_PAUSED);
+
+    // read_cb may close the stream, keep it until the loop is done
+    stream->inflight++;
+
+    // deliver what was held, one buffer at a time in case it pauses again
+    while (stream->held && !stream->closing &&
+        !sev_slot_test(stream, SEV_SLOT_PAUSED) &&
+        (buffer = sev_queue_head(stream->held))) {
+        size_t len = buffer->len - buffer->start;
+        stream_read(stream, buffer->data + buffer->start, len);
+        sev_queue_consume(stream->held, len);
+    }
+
+    // the cancelled recv may not have completed yet, it re-arms then
+    if (!stream->closing && !sev_slot_test(stream, SEV_SLOT_PAUSED) &&
+        !stream->receiving)
+        stream_recv(stream);
+
+    stream_release(stream);
+}
+
+// file segments are spliced into the stream's pipe and from there to
+// the socket, the payload never reaches userspace
+static void stream_splice(struct sev_stream *stream,
+    struct sev_buffer *buffer)
+{
+    if (stream->pipe[0] == -1 && pipe2(stream->pipe, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        stream_close(stream);
+        return;
+    }
+
+    struct io_uring_sqe *sqe = ring_sqe(stream, OP_SPLICE);
+    if (!sqe) {
+        stream_close(stream);
+        return;
+    }
+
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->off = -1;
+
+    if (stream->piped) {
+        // drain what the pipe holds
+        sqe->splice_fd_in = stream->pipe[0];
+        sqe->splice_off_in = -1;
+        sqe->fd = stream->sd;
+        sqe->len = stream->piped;
+    }
+    else {
+        size_t len = buffer->len - buffer->start;
+        sqe->splice_fd_in = buffer->fd;
+        sqe->splice_off_in = buffer->offset + buffer->start;
+        sqe->fd = stream->pipe[1];
+        sqe->len = len < SPLICE_SIZE ? len : SPLICE_SIZE;
+    }
+
+    stream->sending = 1;
+    stream->inflight++;
+}
+
+static void stream_send(struct sev_stream *stream)
+{
+    int n = 0;
+    struct sev_buffer *buffer = sev_queue_head(stream->queue);
+
+    if (stream->piped || (buffer && buffer->fd != -1)) {
+        stream_splice(stream, buffer);
+        return;
+    }
+
+    for (; buffer && buffer->fd == -1 && n < SEV_URING_IOV; n++) {
+        stream->iov[n].iov_base = buffer->data + buffer->start;
+        stream->iov[n].iov_len = buffer->len - buffer->start;
+        buffer = STAILQ_NEXT(buffer, entries);
+    }
+
+    if (n == 0)
+        return;
+
+    struct io_uring_sqe *sqe = ring_sqe(stream, OP_SEND);
+    if (!sqe) {
+        stream_close(stream);
+        return;
+    }
+
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = stream->sd;
+    sqe->addr = (unsigned long)stream->iov;
+    sqe->len = n;
+
+    stream->sending = n;
+    stream->inflight++;
+}
+
+// completions
+
+static void accept_complete(struct sev_server *server, struct io_uring_cqe *cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        // multishot accept was terminated, re-arm it
+        struct io_uring_sqe *sqe = ring_sqe(server, OP_ACCEPT);
+        if (sqe) {
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = server->sd;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_CLOEXEC;
+        }
+    }
+
+    if (cqe->res < 0) {
+        fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+        return;
+    }
+
+    int sd = cqe->res;
+
+    // connection rate over windows of at least a second
+    double now = clock_now();
+
+    WS_COUNT(SEV_ACCEPTS, 1);
+    server->accepted++;
+    server->rate_count++;
+
+    if (now - server->rate_start >= 1.0) {
+        server->accept_rate = server->rate_count / (now - server->rate_start);
+        server->rate_start = now;
+        server->rate_count = 0;
+    }
+
+    // initialize sev_stream structure
+    struct sev_stream *stream = calloc(1, sizeof(struct sev_stream));
+
+    stream->sd = sd;
+    stream->server = server;
+
+    // multishot accept shares one address buffer, ask for it instead
+    stream->remote_addr_len = sizeof(stream->remote_addr);
+    getpeername(sd, (struct sockaddr*)&stream->remote_addr,
+        &stream->remote_addr_len);
+
+    // initialize write queue
+    stream->queue = sev_queue_new();
+    stream->pipe[0] = -1;
+    stream->pipe[1] = -1;
+
+    LIST_INIT(&stream->subscriptions);
+    sev_table_add(stream);
+    sev_capture(stream, SEV_CAPTURE_OPEN, NULL, 0);
+
+    // initialize timers
+    sev_timer_init(&stream->timer, stream_timeout, stream);
+    sev_timer_init(&stream->idle_timer, stream_idle, stream);
+    sev_timer_init(&stream->pause_timer, stream_resume, stream);
+    sev_table.last_active[stream->sd] = now;
+
+    if (server->idle_timeout > 0)
+        wheel_arm(&stream->idle_timer, server->idle_timeout);
+
+    stream_recv(stream);
+
+    // call open callback
+    if (server->open_cb)
+        server->open_cb(stream);
+}
+
+static void recv_complete(struct sev_stream *stream, struct io_uring_cqe *cqe)
+{
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+    if (cqe->res > 0) {
+        sev_table.last_active[stream->sd] = clock_now();
+        WS_COUNT(SEV_BYTES_READ, cqe->res);
+        sev_capture(stream, SEV_CAPTURE_DATA,
+            ring.buffers + (size_t)bid * BUFSIZE, cqe->res);
+    }
+
+    if (cqe->res > 0)
+        stream_read(stream, ring.buffers + (size_t)bid * BUFSIZE, cqe->res);
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+        buffer_recycle(bid);
+
+    if (more)
+        return;
+
+    stream->receiving = 0;
+
+    if (cqe->res == 0 ||
+        (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED))
+        // client disconnected or error
+        stream_close(stream);
+    else if (!stream->closing && !sev_slot_test(stream, SEV_SLOT_PAUSED))
+        // out of provided buffers, cancelled or the kernel ended the
+        // multishot
+        stream_recv(stream);
+
+    stream_release(stream);
+}
+
+static void send_complete(struct sev_stream *stream, struct io_uring_cqe *cqe)
+{
+    stream->sending = 0;
+
+    if (cqe->res < 0) {
+        if (!stream->closing)
+            fprintf(stderr, "send: %s\n", strerror(-cqe->res));
+        stream_close(stream);
+        stream_release(stream);
+        return;
+    }
+
+    WS_COUNT(SEV_BYTES_WRITTEN, cqe->res);
+    sev_queue_consume(stream->queue, cqe->res);
+
+    if (!stream->closing) {
+        stream_drain(stream);
+        stream_send(stream);
+    }
+
+    stream_release(stream);
+}
+
+static void splice_complete(struct sev_stream *stream,
+    struct io_uring_cqe *cqe)
+{
+    stream->sending = 0;
+
+    if (cqe->res <= 0) {
+        // a file shorter than its segment can't complete the frame
+        if (!stream->closing)
+            fprintf(stderr, "splice: %s\n", cqe->res ?
+                strerror(-cqe->res) : "unexpected end of file");
+        stream_close(stream);
+        stream_release(stream);
+        return;
+    }
+
+    if (stream->piped) {
+        stream->piped -= cqe->res;
+        WS_COUNT(SEV_BYTES_WRITTEN, cqe->res);
+    }
+    else {
+        // the pipe owns these bytes now, like the socket buffer would
+        stream->piped = cqe->res;
+        sev_queue_consume(stream->queue, cqe->res);
+    }
+
+    if (!stream->closing) {
+        stream_drain(stream);
+        stream_send(stream);
+    }
+
+    stream_release(stream);
+}
+
+static void inbox_read(struct sev_inbox *inbox)
+{
+    struct io_uring_sqe *sqe = ring_sqe(inbox, OP_INBOX);
+    if (!sqe)
+        return;
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = inbox->fd;
+    sqe->addr = (unsigned long)&inbox->counter;
+    sqe->len = sizeof(inbox->counter);
+}
+
+static void inbox_complete(struct sev_inbox *inbox, struct io_uring_cqe *cqe)
+{
+    sev_inbox_drain(inbox);
+    inbox_read(inbox);
+}
+
+static void ring_complete(struct io_uring_cqe *cqe)
+{
+    void *ptr = (void *)(unsigned long)(cqe->user_data & ~(__u64)OP_MASK);
+
+    switch (cqe->user_data & OP_MASK) {
+    case OP_ACCEPT:
+        accept_complete(ptr, cqe);
+        break;
+    case OP_RECV:
+        recv_complete(ptr, cqe);
+        break;
+    case OP_SEND:
+        send_complete(ptr, cqe);
+        break;
+    case OP_SPLICE:
+        splice_complete(ptr, cqe);
+        break;
+    case OP_INBOX:
+        inbox_complete(ptr, cqe);
+        break;
+    case OP_CANCEL:
+        // the cancelled recv reports on its own
+        break;
+    }
+}
+
+static int loop_init(void)
+{
+    if (ring.fd != 0)
+        return 0;
+
+    if (ring_init() == -1)
+        return -1;
+
+    sev_wheel_init(&wheel, wheel_ticks(clock_now()));
+    return 0;
+}
+
+// interface
+
+// serve an already listening socket
+int sev_listen_fd(struct sev_server *server, int sd)
+{
+    if (loop_init() == -1)
+        return -1;
+
+    // initialize sev_server structure
+    memset(server, 0, sizeof(struct sev_server));
+    server->sd = sd;
+
+    server->rate_start = clock_now();
+
+    // one multishot accept serves every incoming connection
+    struct io_uring_sqe *sqe = ring_sqe(server, OP_ACCEPT);
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+
+    return 0;
+}
+
+void sev_close(struct sev_stream *stream)
+{
+    stream_close(stream);
+}
+
+int sev_inbox_start(struct sev_inbox *inbox)
+{
+    if (loop_init() == -1)
+        return -1;
+
+    inbox->fd = eventfd(0, EFD_CLOEXEC);
+    if (inbox->fd == -1)
+        return -1;
+
+    inbox_read(inbox);
+    return 0;
+}
+
+// totals over every stream, a scan of the stream table's dense arrays
+void sev_get_stats(struct sev_stats *stats)
+{
+    sev_table_stats(stats, clock_now());
+}
+
+// call timeout_cb once, seconds from now, replacing any earlier deadline
+// 0 cancels it
+void sev_set_timeout(struct sev_stream *stream, double seconds)
+{
+    if (seconds > 0)
+        wheel_arm(&stream->timer, seconds);
+    else
+        sev_timer_cancel(&wheel, &stream->timer);
+}
+
+// stop reading from stream for the given time, e.g. to enforce a rate
+// data already received is still delivered
+void sev_pause_read(struct sev_stream *stream, double seconds)
+{
+    if (seconds <= 0 || stream->closing)
+        return;
+
+    if (!sev_slot_test(stream, SEV_SLOT_PAUSED) && stream->receiving) {
+        // the multishot recv ends with -ECANCELED and isn't re-armed
+        struct io_uring_sqe *sqe = ring_sqe(NULL, OP_CANCEL);
+        if (sqe) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = (unsigned long)stream | OP_RECV;
+        }
+    }
+
+    sev_slot_set(stream, SEV_SLOT_PAUSED);
+    wheel_arm(&stream->pause_timer, seconds);
+}
+
+// backpressure and write scheduling after queueing data
+static int stream_queued(struct sev_stream *stream)
+{
+    WS_RECORD(SEV_QUEUE_BYTES, stream->queue->bytes);
+
+    struct sev_server *server = stream->server;
+    size_t high = server->high_watermark;
+
+    if (high && stream->queue->bytes > high) {
+        if (server->overflow_policy == SEV_DROP_OLDEST) {
+            // the kernel may still be reading from the buffers in flight
+            sev_queue_trim(stream->queue, high, stream->sending);
+        }
+        else if (server->overflow_policy == SEV_DISCONNECT) {
+            // the caller may still hold the stream, close it from the loop
+            sev_slot_set(stream, SEV_SLOT_CLOSE_PENDING);
+        }
+        else if (!sev_slot_test(stream, SEV_SLOT_FULL)) {
+            sev_slot_set(stream, SEV_SLOT_FULL);
+
+            if (server->full_cb)
+                server->full_cb(stream);
+        }
+    }
+
+    sev_table.queued[stream->sd] = stream->queue->bytes;
+
+    // sent in one batch at the end of the loop iteration, the dirty list
+    // holds a reference so the stream outlives a close in the meantime
+    if ((!stream->sending || sev_slot_test(stream, SEV_SLOT_CLOSE_PENDING)) &&
+        !stream->next_dirty) {
+        stream->next_dirty = dirty ? dirty : stream;
+        dirty = stream;
+        stream->inflight++;
+    }
+
+    return sev_slot_test(stream, SEV_SLOT_CLOSE_PENDING) ? -1 : 0;
+}
+
+// returns -1 if the stream is being disconnected
+int sev_send(struct sev_stream *stream, const char *data, size_t len)
+{
+    if (stream->closing || sev_slot_test(stream, SEV_SLOT_CLOSE_PENDING))
+        return -1;
+
+    sev_queue_push_back(stream->queue, data, len);
+    return stream_queued(stream);
+}
+
+// queue a reference to shared instead of a copy
+int sev_send_shared(struct sev_stream *stream, struct sev_shared *shared)
+{
+    if (stream->closing || sev_slot_test(stream, SEV_SLOT_CLOSE_PENDING))
+        return -1;
+
+    sev_queue_push_shared(stream->queue, shared);
+    return stream_queued(stream);
+}
+
+// queue header_len bytes of header, e.g. a frame header, then len bytes
+// of fd from offset, spliced to the socket and never copied to userspace.
+// the two are one message, SEV_DROP_OLDEST never splits them
+// fd is duplicated, the caller may close it right away
+// returns -1 if the stream is being disconnected or fd can't be duplicated
+int sev_send_file(struct sev_stream *stream, const char *header,
+    size_t header_len, int fd, off_t offset, size_t len)
+{
+    if (stream->closing || sev_slot_test(stream, SEV_SLOT_CLOSE_PENDING))
+        return -1;
+
+    if (len == 0 && header_len > 0)
+        sev_queue_push_back(stream->queue, header, header_len);
+    else if (len > 0 && sev_queue_push_file(stream->queue, header,
+        header_len, fd, offset, len))
+        return -1;
+
+    return stream_queued(stream);
+}
+
+int sev_uring_run(void)
+{
+    for (;;) {
+        // flush the streams written to during this iteration
+        while (dirty) {
+            struct sev_stream *stream = dirty;
+            dirty = stream->next_dirty == stream ? NULL : stream->next_dirty;
+            stream->next_dirty = NULL;
+
+            if (sev_slot_test(stream, SEV_SLOT_CLOSE_PENDING))
+                stream_close(stream);
+            else if (!stream->sending && !stream->closing)
+                stream_send(stream);
+
+            stream_release(stream);
+        }
+
+        // submit everything and wait in a single syscall
+        if (ring_enter(ring.sq_pending, 1) == -1 &&
+            errno != EINTR && errno != ETIME) {
+            perror("io_uring_enter");
+            return -1;
+        }
+        ring.sq_pending = 0;
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            ring_complete(cqe);
+        }
+
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        sev_wheel_advance(&wheel, wheel_ticks(clock_now()));
+    }
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,96 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// standalone driver for the harnesses, for builds without libFuzzer
+//
+// usage: fuzz_xxx [-n iterations] [-s seed] [file...]
+//
+// files are run once each: a libFuzzer corpus, a crash, or @@ under
+// afl-fuzz. without files, inputs come from the harness' seeded
+// generator so every run with the same seed checks the same cases
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "fuzz.h"
+
+#define MAX_INPUT 8192
+
+static int run_file(const char *path)
+{
+    static uint8_t buf[1 << 20];
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+
+    size_t len = fread(buf, 1, sizeof(buf), fp);
+    fclose(fp);
+
+    LLVMFuzzerTestOneInput(buf, len);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = 2000;
+    uint64_t seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+        case 'n': iterations = atol(optarg); break;
+        case 's': seed = strtoull(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "usage: %s [-n iterations] [-s seed] [file...]\n",
+                argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind < argc) {
+        for (int i = optind; i < argc; i++)
+            if (run_file(argv[i]) == -1)
+                return 1;
+
+        printf("%d files ok\n", argc - optind);
+        return 0;
+    }
+
+    static uint8_t buf[MAX_INPUT];
+    uint64_t state = seed ? seed : 1;
+
+    for (long i = 0; i < iterations; i++) {
+        size_t len = fuzz_generate(buf, sizeof(buf), &state);
+        LLVMFuzzerTestOneInput(buf, len);
+    }
+
+    printf("%ld inputs ok (seed %llu)\n", iterations,
+        (unsigned long long)seed);
+    return 0;
+}
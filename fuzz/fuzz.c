@@ -0,0 +1,372 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "fuzz.h"
+#include "../ws.h"
+
+void fuzz_log_append(struct fuzz_log *log, const void *data, size_t len)
+{
+    if (log->len + len > log->size) {
+        log->size = (log->len + len) * 2;
+        log->data = realloc(log->data, log->size);
+    }
+
+    memcpy(log->data + log->len, data, len);
+    log->len += len;
+}
+
+void fuzz_log_frame(struct fuzz_log *log, int fin, int opcode, int masked,
+    uint64_t len)
+{
+    char rec[4] = { 'F', fin, opcode, masked };
+
+    fuzz_log_append(log, rec, sizeof(rec));
+    fuzz_log_append(log, &len, sizeof(len));
+    log->offset = 0;
+}
+
+void fuzz_log_free(struct fuzz_log *log)
+{
+    free(log->data);
+    memset(log, 0, sizeof(*log));
+}
+
+static void log_string(struct fuzz_log *log, const char *str)
+{
+    fuzz_log_append(log, str ? str : "(null)", str ? strlen(str) + 1 : 7);
+}
+
+static int header_cb(struct ws_header *header, void *data)
+{
+    struct fuzz_log *log = data;
+
+    fuzz_log_append(log, "H", 1);
+    log_string(log, header->resource);
+    log_string(log, header->websocket_key);
+
+    for (int i = 0; header->headers[i]; i++) {
+        log_string(log, header->headers[i]);
+        log_string(log, header->values[i]);
+    }
+
+    return 0;
+}
+
+static int frame_cb(struct ws_frame *frame, void *data)
+{
+    struct fuzz_log *log = data;
+
+    if (frame->chunk_offset == 0)
+        fuzz_log_frame(log, frame->fin, frame->opcode, frame->masked,
+            frame->len);
+
+    // chunks must arrive in order and stay inside the frame
+    if (frame->chunk_offset != log->offset ||
+        frame->chunk_offset + frame->chunk_len > frame->len ||
+        frame->timestamp != log->timestamp)
+        abort();
+
+    fuzz_log_append(log, frame->chunk_data, frame->chunk_len);
+    log->offset += frame->chunk_len;
+
+    return 0;
+}
+
+// when set, payloads are unmasked into a scratch buffer via dest_cb
+static int use_dest;
+static char *scratch;
+static size_t scratch_size;
+
+static char *dest_cb(struct ws_frame *frame, void *data)
+{
+    if (frame->chunk_len > scratch_size) {
+        scratch_size = frame->chunk_len;
+        scratch = realloc(scratch, scratch_size);
+    }
+
+    return scratch;
+}
+
+// when set, the parser is saved and restored into a fresh one at the split
+static int use_restore;
+
+static void restore(struct ws_parser *parser)
+{
+    static char state[sizeof(struct ws_parser) * 2];
+    size_t len = ws_parser_save(parser, state, sizeof(state));
+    if (len > sizeof(state))
+        abort();
+
+    // scribble over the old state so nothing carries over by accident
+    void *data = parser->data;
+    ws_parser_free(parser);
+    memset(parser, 0xAA, sizeof(*parser));
+
+    ws_parser_init(parser);
+    parser->header_cb = header_cb;
+    parser->frame_cb = frame_cb;
+    parser->dest_cb = use_dest ? dest_cb : NULL;
+    parser->data = data;
+
+    if (ws_parser_restore(parser, state, len) == -1)
+        abort();
+}
+
+void fuzz_feed(const uint8_t *input, size_t len, size_t split, size_t piece,
+    int http, struct fuzz_log *log)
+{
+    struct ws_parser parser;
+    ws_parser_init(&parser);
+    parser.header_cb = header_cb;
+    parser.frame_cb = frame_cb;
+    parser.dest_cb = use_dest ? dest_cb : NULL;
+    parser.data = log;
+
+    if (!http)
+        ws_read_next_frame(&parser);
+
+    // the parser unmasks in place
+    char *copy = malloc(len + 1);
+    memcpy(copy, input, len);
+
+    size_t pos = 0;
+    while (pos < len) {
+        size_t n = pos < split ? split - pos : piece;
+        if (n > len - pos)
+            n = len - pos;
+
+        log->timestamp = pos + 1;
+        parser.rx_timestamp = log->timestamp;
+
+        if (ws_parse_all(&parser, copy + pos, n) == -1) {
+            char rec[2] = { 'E', parser.errno };
+            fuzz_log_append(log, rec, sizeof(rec));
+            break;
+        }
+
+        pos += n;
+
+        if (use_restore && pos == split)
+            restore(&parser);
+    }
+
+    // with a destination the input must be left alone
+    if (use_dest && memcmp(copy, input, len))
+        abort();
+
+    free(copy);
+    ws_parser_free(&parser);
+}
+
+// same as fuzz_feed with split 0, but in one ws_parse_iov call
+void fuzz_feed_iov(const uint8_t *input, size_t len, size_t piece, int http,
+    struct fuzz_log *log)
+{
+    struct ws_parser parser;
+    ws_parser_init(&parser);
+    parser.header_cb = header_cb;
+    parser.frame_cb = frame_cb;
+    parser.data = log;
+
+    if (!http)
+        ws_read_next_frame(&parser);
+
+    char *copy = malloc(len + 1);
+    memcpy(copy, input, len);
+
+    int cnt = (len + piece - 1) / piece;
+    struct iovec *iov = malloc((cnt + 1) * sizeof(struct iovec));
+    for (int i = 0; i < cnt; i++) {
+        iov[i].iov_base = copy + i * piece;
+        iov[i].iov_len = len - i * piece < piece ? len - i * piece : piece;
+    }
+
+    log->timestamp = 1;
+    parser.rx_timestamp = log->timestamp;
+
+    if (ws_parse_iov(&parser, iov, cnt) == -1) {
+        char rec[2] = { 'E', parser.errno };
+        fuzz_log_append(log, rec, sizeof(rec));
+    }
+
+    free(iov);
+    free(copy);
+    ws_parser_free(&parser);
+}
+
+static void compare(const struct fuzz_log *a, const struct fuzz_log *b,
+    size_t split, size_t piece)
+{
+    if (a->len == b->len && (!a->len || !memcmp(a->data, b->data, a->len)))
+        return;
+
+    fprintf(stderr, "mismatch with split %zu piece %zu (%zu vs %zu bytes)\n",
+        split, piece, a->len, b->len);
+    abort();
+}
+
+void fuzz_check(const uint8_t *input, size_t len, int http,
+    const struct fuzz_log *expected)
+{
+    struct fuzz_log log = { 0 };
+
+    fuzz_feed(input, len, 0, 1, http, &log);
+    compare(expected, &log, 0, 1);
+
+    use_dest = 1;
+    for (size_t piece = 1; piece <= len; piece = piece * 4 + 3) {
+        log.len = 0;
+        fuzz_feed(input, len, 0, piece, http, &log);
+        compare(expected, &log, 0, piece);
+    }
+    use_dest = 0;
+
+    for (size_t piece = 1; piece < len && piece <= 8; piece++) {
+        log.len = 0;
+        fuzz_feed_iov(input, len, piece, http, &log);
+        compare(expected, &log, 0, piece);
+    }
+
+    for (size_t split = 1; split < len; split++) {
+        log.len = 0;
+        fuzz_feed(input, len, split, len, http, &log);
+        compare(expected, &log, split, len);
+    }
+
+    use_restore = 1;
+    for (size_t split = 1; split < len; split++) {
+        log.len = 0;
+        fuzz_feed(input, len, split, len, http, &log);
+        compare(expected, &log, split, len);
+    }
+    use_restore = 0;
+
+    fuzz_log_free(&log);
+}
+
+// frames are decoded straight from the input, payloads truncated to
+// what is available
+void fuzz_reference_frames(const uint8_t *input, size_t len,
+    struct fuzz_log *log)
+{
+    size_t pos = 0;
+
+    while (len - pos >= 2) {
+        int fin = input[pos] >> 7;
+        int opcode = input[pos] & 0x0F;
+        int masked = input[pos + 1] >> 7;
+        uint64_t frame_len = input[pos + 1] & 0x7F;
+        size_t ext = frame_len == 126 ? 2 : frame_len == 127 ? 8 : 0;
+        size_t need = 2 + ext + (masked ? 4 : 0);
+
+        if (len - pos < need)
+            return;
+
+        if (ext) {
+            frame_len = 0;
+            for (size_t i = 0; i < ext; i++)
+                frame_len = frame_len << 8 | input[pos + 2 + i];
+        }
+
+        const uint8_t *mask = input + pos + 2 + ext;
+        pos += need;
+
+        size_t avail = len - pos;
+        if (avail > frame_len)
+            avail = frame_len;
+
+        // a frame shows up once its first payload byte does
+        if (frame_len > 0 && avail == 0)
+            return;
+
+        fuzz_log_frame(log, fin, opcode, masked, frame_len);
+        for (size_t i = 0; i < avail; i++) {
+            char c = input[pos + i] ^ (masked ? mask[i % 4] : 0);
+            fuzz_log_append(log, &c, 1);
+        }
+
+        pos += avail;
+        if (avail < frame_len)
+            return;
+    }
+}
+
+uint64_t fuzz_random(uint64_t *state)
+{
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// a run of well formed frames with short, 16 and 64 bit lengths and
+// random masks, occasionally truncated
+size_t fuzz_generate_frames(uint8_t *buf, size_t size, uint64_t *state)
+{
+    size_t pos = 0;
+    int count = fuzz_random(state) % 8 + 1;
+
+    for (int i = 0; i < count && pos + 14 < size; i++) {
+        uint64_t r = fuzz_random(state);
+        size_t len = r % 4 == 0 ? 0 : fuzz_random(state) % 300;
+        int masked = (r >> 8) & 1;
+        int wide = (r >> 9) % 4;
+
+        buf[pos++] = (r >> 16) & 0x8F;
+
+        if (wide == 1 || (len >= 126 && wide != 2)) {
+            buf[pos++] = masked << 7 | 126;
+            buf[pos++] = len >> 8;
+            buf[pos++] = len;
+        }
+        else if (wide == 2) {
+            buf[pos++] = masked << 7 | 127;
+            for (int j = 7; j >= 0; j--)
+                buf[pos++] = (uint64_t)len >> (j * 8);
+        }
+        else {
+            buf[pos++] = masked << 7 | len;
+        }
+
+        if (masked) {
+            uint64_t mask = fuzz_random(state);
+            memcpy(buf + pos, &mask, 4);
+            pos += 4;
+        }
+
+        for (size_t j = 0; j < len && pos < size; j++)
+            buf[pos++] = fuzz_random(state);
+    }
+
+    if (pos && fuzz_random(state) % 4 == 0)
+        pos -= fuzz_random(state) % pos;
+
+    return pos;
+}
@@ -0,0 +1,82 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// shared pieces of the parser fuzz harnesses
+//
+// each harness feeds its input to the parser whole, byte by byte, as
+// small iovec segments, unmasked into a separate destination and split
+// in two at every offset, with and without saving and restoring the
+// parser at the split, records the callbacks into a log and aborts
+// if any two logs differ or disagree with a reference decoder
+
+#ifndef FUZZ_H
+#define FUZZ_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+struct fuzz_log {
+    char *data;
+    size_t len;
+    size_t size;
+
+    // payload bytes seen so far in the current frame
+    uint64_t offset;
+
+    // rx_timestamp of the bytes being parsed, every chunk must carry it
+    uint64_t timestamp;
+};
+
+void fuzz_log_append(struct fuzz_log *log, const void *data, size_t len);
+void fuzz_log_frame(struct fuzz_log *log, int fin, int opcode, int masked,
+    uint64_t len);
+void fuzz_log_free(struct fuzz_log *log);
+
+// feed input to a fresh parser: first split bytes, then the rest in
+// pieces of at most piece bytes. http selects whether the input starts
+// with a handshake or directly with frames
+void fuzz_feed(const uint8_t *input, size_t len, size_t split, size_t piece,
+    int http, struct fuzz_log *log);
+
+// feed input as a list of piece sized buffers in one ws_parse_iov call
+void fuzz_feed_iov(const uint8_t *input, size_t len, size_t piece, int http,
+    struct fuzz_log *log);
+
+// run every split of input and compare the logs against expected
+void fuzz_check(const uint8_t *input, size_t len, int http,
+    const struct fuzz_log *expected);
+
+// decode frames the simple way, for comparison
+void fuzz_reference_frames(const uint8_t *input, size_t len,
+    struct fuzz_log *log);
+
+// deterministic input generation for the standalone driver
+uint64_t fuzz_random(uint64_t *state);
+size_t fuzz_generate_frames(uint8_t *buf, size_t size, uint64_t *state);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t len);
+size_t fuzz_generate(uint8_t *buf, size_t size, uint64_t *state);
+
+#endif
@@ -0,0 +1,367 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// http/2 harness: input is what a client sends after the preface
+
+#include <stdio.h>
+#include <string.h>
+#include "fuzz.h"
+#include "../ws_h2.h"
+
+// frame flags, for the generator
+#define END_STREAM_FLAG 0x1
+#define END_HEADERS_FLAG 0x4
+#define PADDED_FLAG 0x8
+
+static int frame_cb(struct ws_frame *frame, void *data)
+{
+    struct ws_h2_stream *stream = data;
+    struct fuzz_log *log = stream->h2->data;
+
+    // a reply per frame, the output must not depend on the input split
+    if (frame->chunk_offset == 0) {
+        char rec[6] = { 'F', stream->id, stream->id >> 8, frame->opcode,
+            frame->fin, frame->masked };
+        fuzz_log_append(log, rec, sizeof(rec));
+        ws_h2_send(stream, "reply", 5);
+    }
+
+    fuzz_log_append(log, frame->chunk_data, frame->chunk_len);
+
+    // once the whole close frame is in
+    if (frame->opcode == WS_CONNECTION_CLOSE &&
+        frame->chunk_offset + frame->chunk_len == frame->len)
+        ws_h2_close(stream);
+
+    return 0;
+}
+
+static int connect_cb(struct ws_h2_stream *stream, struct ws_header *header,
+    void *data)
+{
+    char rec[3] = { 'C', stream->id, stream->id >> 8 };
+    fuzz_log_append(data, rec, sizeof(rec));
+    fuzz_log_append(data, header->resource, strlen(header->resource) + 1);
+
+    for (int i = 0; header->headers[i]; i++) {
+        fuzz_log_append(data, header->headers[i],
+            strlen(header->headers[i]) + 1);
+        fuzz_log_append(data, header->values[i],
+            strlen(header->values[i]) + 1);
+    }
+
+    if (strcmp(header->resource, "/deny") == 0)
+        return 403;
+
+    // queued until the 200 is out
+    ws_h2_send(stream, "hello", 5);
+    stream->parser.frame_cb = frame_cb;
+    return 0;
+}
+
+static void close_cb(struct ws_h2_stream *stream, void *data)
+{
+    char rec[3] = { 'X', stream->id, stream->id >> 8 };
+    fuzz_log_append(data, rec, sizeof(rec));
+}
+
+static void write_cb(const char *out, size_t len, void *data)
+{
+    fuzz_log_append(data, out, len);
+}
+
+// first split bytes, then the rest in pieces of at most piece bytes
+static void feed(const uint8_t *input, size_t len, size_t split, size_t piece,
+    struct fuzz_log *log)
+{
+    struct ws_h2 *h2 = malloc(sizeof(struct ws_h2));
+    ws_h2_init(h2);
+    h2->connect_cb = connect_cb;
+    h2->close_cb = close_cb;
+    h2->write_cb = write_cb;
+    h2->data = log;
+
+    // the parser unmasks in place
+    size_t total = WS_H2_PREFACE_LEN + len;
+    char *copy = malloc(total);
+    memcpy(copy, WS_H2_PREFACE, WS_H2_PREFACE_LEN);
+    memcpy(copy + WS_H2_PREFACE_LEN, input, len);
+
+    size_t pos = 0;
+    while (pos < total) {
+        size_t n = pos < split ? split - pos : piece;
+        if (n > total - pos)
+            n = total - pos;
+
+        if (ws_h2_parse(h2, copy + pos, n) == -1) {
+            fuzz_log_append(log, "E", 1);
+            break;
+        }
+
+        pos += n;
+    }
+
+    // the send and close paths, then whatever is left
+    for (struct ws_h2_stream *stream = h2->streams; stream;
+        stream = stream->next) {
+        ws_h2_send(stream, "bye", 3);
+
+        if (stream->id % 4 == 1)
+            ws_h2_close(stream);
+    }
+
+    ws_h2_hold(h2, 1);
+    ws_h2_hold(h2, 0);
+    ws_h2_free(h2);
+
+    free(h2);
+    free(copy);
+}
+
+static void compare(const struct fuzz_log *a, const struct fuzz_log *b,
+    size_t split, size_t piece)
+{
+    if (a->len == b->len && memcmp(a->data, b->data, a->len) == 0)
+        return;
+
+    size_t at = 0;
+    while (at < a->len && at < b->len && a->data[at] == b->data[at])
+        at++;
+
+    fprintf(stderr, "mismatch with split %zu piece %zu at byte %zu "
+        "(%zu vs %zu bytes)\n", split, piece, at, a->len, b->len);
+    FILE *f = fopen("/tmp/a.bin", "w"); fwrite(a->data, 1, a->len, f); fclose(f);
+    f = fopen("/tmp/b.bin", "w"); fwrite(b->data, 1, b->len, f); fclose(f);
+    abort();
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t len)
+{
+    struct fuzz_log expected = { 0 }, log = { 0 };
+    size_t total = WS_H2_PREFACE_LEN + len;
+
+    feed(data, len, 0, total, &expected);
+
+    for (size_t piece = 1; piece < total; piece = piece * 4 + 3) {
+        log.len = 0;
+        feed(data, len, 0, piece, &log);
+        compare(&expected, &log, 0, piece);
+    }
+
+    for (size_t split = 1; split < total; split++) {
+        log.len = 0;
+        feed(data, len, split, total, &log);
+        compare(&expected, &log, split, total);
+    }
+
+    fuzz_log_free(&expected);
+    fuzz_log_free(&log);
+    return 0;
+}
+
+// generated input
+
+struct out {
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+};
+
+static void put(struct out *out, const void *data, size_t len)
+{
+    if (out->len + len > out->size)
+        len = out->size - out->len;
+
+    if (len)
+        memcpy(out->buf + out->len, data, len);
+    out->len += len;
+}
+
+static void put_frame(struct out *out, int type, int flags, uint32_t stream,
+    const uint8_t *payload, size_t len)
+{
+    uint8_t header[9] = {
+        len >> 16, len >> 8, len, type, flags,
+        stream >> 24, stream >> 16, stream >> 8, stream,
+    };
+
+    put(out, header, sizeof(header));
+    put(out, payload, len);
+}
+
+static void put_u32(uint8_t *p, uint32_t n)
+{
+    p[0] = n >> 24;
+    p[1] = n >> 16;
+    p[2] = n >> 8;
+    p[3] = n;
+}
+
+// CONNECT requests with huffman and indexed literals, then the same from
+// the dynamic table, plain literals, and a GET
+static const uint8_t block_huffman[] = {
+    0x42, 0x87, 0xbd, 0xab, 0x4e, 0x9c, 0x17, 0xb7, 0xff,
+    0x40, 0x87, 0xb9, 0x5d, 0x87, 0x49, 0xc8, 0x7a, 0x3f,
+    0x87, 0xf0, 0x58, 0xd0, 0x72, 0x75, 0x2a, 0x7f,
+    0x86,
+    0x44, 0x84, 0x60, 0x93, 0x8d, 0x3f,
+};
+
+static const uint8_t block_indexed[] = { 0xc0, 0xbf, 0x86, 0xbe };
+
+static const uint8_t block_plain[] = {
+    0x00, 0x07, ':', 'm', 'e', 't', 'h', 'o', 'd',
+    0x07, 'C', 'O', 'N', 'N', 'E', 'C', 'T',
+    0x00, 0x09, ':', 'p', 'r', 'o', 't', 'o', 'c', 'o', 'l',
+    0x09, 'w', 'e', 'b', 's', 'o', 'c', 'k', 'e', 't',
+    0x86,
+    0x04, 0x05, '/', 'd', 'e', 'n', 'y',
+    0x10, 0x03, 'x', '-', 'a', 0x01, 'b',
+};
+
+static const uint8_t block_get[] = { 0x82, 0x86, 0x84 };
+
+static void put_headers(struct out *out, uint32_t stream, uint64_t r)
+{
+    static const struct { const uint8_t *data; size_t len; } blocks[] = {
+        { block_huffman, sizeof(block_huffman) },
+        { block_indexed, sizeof(block_indexed) },
+        { block_plain, sizeof(block_plain) },
+        { block_get, sizeof(block_get) },
+    };
+
+    const uint8_t *block = blocks[r % 4].data;
+    size_t len = blocks[r % 4].len;
+
+    uint8_t payload[128];
+    size_t start = 0;
+    int flags = END_HEADERS_FLAG;
+
+    if (r >> 2 & 1) {
+        flags |= PADDED_FLAG;
+        payload[start++] = 3;
+    }
+
+    if (r >> 3 & 1) {
+        // an empty table first
+        payload[start++] = 0x20;
+    }
+
+    // split over a CONTINUATION
+    size_t first = r >> 4 & 1 ? len / 2 : len;
+    memcpy(payload + start, block, first);
+
+    size_t pad = flags & PADDED_FLAG ? 3 : 0;
+    memset(payload + start + first, 0, pad);
+
+    if (first < len) {
+        put_frame(out, 0x1, flags & ~END_HEADERS_FLAG, stream, payload,
+            start + first + pad);
+        put_frame(out, 0x9, END_HEADERS_FLAG, stream, block + first,
+            len - first);
+    }
+    else {
+        put_frame(out, 0x1, flags, stream, payload, start + first + pad);
+    }
+}
+
+size_t fuzz_generate(uint8_t *buf, size_t size, uint64_t *state)
+{
+    struct out out = { buf, size, 0 };
+    uint8_t payload[1024];
+    uint32_t next = 1;
+
+    // the client preface ends with SETTINGS, sometimes with small windows
+    uint64_t r = fuzz_random(state);
+    if (r % 2) {
+        uint8_t settings[6] = { 0, 4 };
+        put_u32(settings + 2, r >> 8 & 0xFF);
+        put_frame(&out, 0x4, 0, 0, settings, sizeof(settings));
+    }
+    else {
+        put_frame(&out, 0x4, 0, 0, NULL, 0);
+    }
+
+    int count = fuzz_random(state) % 12 + 1;
+    for (int i = 0; i < count && out.len + 64 < size; i++) {
+        r = fuzz_random(state);
+        uint32_t stream = next > 1 ? 1 + 2 * (r >> 8 & 0xFF) % (next - 1) : 1;
+
+        switch (r % 8) {
+        case 0:
+        case 1:
+            put_headers(&out, next, r >> 8);
+            next += 2;
+            break;
+
+        case 2:
+        case 3:
+        case 4: {
+            // websocket frames, sometimes padded or ending the stream
+            size_t len = fuzz_generate_frames(payload + 1,
+                sizeof(payload) - 3, state);
+            int flags = r >> 16 & 1 ? END_STREAM_FLAG : 0;
+
+            if (r >> 17 & 1) {
+                payload[0] = 2;
+                memset(payload + 1 + len, 0, 2);
+                put_frame(&out, 0x0, flags | PADDED_FLAG, stream, payload,
+                    len + 3);
+            }
+            else {
+                put_frame(&out, 0x0, flags, stream, payload + 1, len);
+            }
+            break;
+        }
+
+        case 5: {
+            uint8_t increment[4];
+            put_u32(increment, fuzz_random(state) % 100000);
+            put_frame(&out, 0x8, 0, r >> 16 & 1 ? stream : 0, increment, 4);
+            break;
+        }
+
+        case 6: {
+            uint8_t ping[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+            put_frame(&out, 0x6, 0, 0, ping, sizeof(ping));
+            break;
+        }
+
+        default: {
+            uint8_t error[4];
+            put_u32(error, WS_H2_CANCEL);
+            put_frame(&out, 0x3, 0, stream, error, sizeof(error));
+            break;
+        }
+        }
+    }
+
+    // occasionally flip a few bits to reach the error paths
+    if (out.len && fuzz_random(state) % 2 == 0)
+        for (int i = fuzz_random(state) % 4; i >= 0; i--)
+            buf[fuzz_random(state) % out.len] ^= 1 << fuzz_random(state) % 8;
+
+    return out.len;
+}
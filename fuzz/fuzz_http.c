@@ -0,0 +1,103 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// handshake harness: input is an http request followed by frames
+
+#include <stdio.h>
+#include <string.h>
+#include "fuzz.h"
+#include "../ws.h"
+
+// where the request ends, or 0 if it has no terminator
+static size_t header_end(const uint8_t *data, size_t len)
+{
+    for (size_t i = 3; i < len; i++)
+        if (!memcmp(data + i - 3, "\r\n\r\n", 4))
+            return i + 1;
+
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t len)
+{
+    struct fuzz_log expected = { 0 };
+    size_t end = header_end(data, len);
+
+    if (end && end < WS_BUFFER_SIZE) {
+        // the request alone, then whatever follows as plain frames
+        fuzz_feed(data, end, 0, end, 1, &expected);
+        if (expected.len && expected.data[0] == 'H')
+            fuzz_reference_frames(data + end, len - end, &expected);
+    }
+    else if (len >= WS_BUFFER_SIZE) {
+        char rec[2] = { 'E', WS_BUFFER_OVERFLOW };
+        fuzz_log_append(&expected, rec, sizeof(rec));
+    }
+
+    fuzz_check(data, len, 1, &expected);
+
+    fuzz_log_free(&expected);
+    return 0;
+}
+
+static const char *lines[] = {
+    "Host: server.example.com\r\n",
+    "Upgrade: websocket\r\n",
+    "Connection: Upgrade\r\n",
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n",
+    "Sec-WebSocket-Version: 13\r\n",
+    "upgrade:WebSocket\r\n",
+    "Origin: http://example.com\r\n",
+    "Sec-WebSocket-Version: 8\r\n",
+    "X-Empty:\r\n",
+    "broken line\r\n",
+};
+
+size_t fuzz_generate(uint8_t *buf, size_t size, uint64_t *state)
+{
+    char head[1024];
+    int n = snprintf(head, sizeof(head), "GET /%x HTTP/1.1\r\n",
+        (unsigned)fuzz_random(state));
+
+    // mostly the required headers in order, sometimes a random mix
+    int count = 5 + fuzz_random(state) % 4;
+    for (int i = 0; i < count; i++) {
+        int j = fuzz_random(state) % 3 ? i % 5 : fuzz_random(state) % 10;
+        n += snprintf(head + n, sizeof(head) - n, "%s", lines[j]);
+    }
+    n += snprintf(head + n, sizeof(head) - n, "\r\n");
+
+    size_t len = (size_t)n < size ? (size_t)n : size;
+    memcpy(buf, head, len);
+    len += fuzz_generate_frames(buf + len, size - len, state);
+
+    if (fuzz_random(state) % 4 == 0)
+        buf[fuzz_random(state) % len] = fuzz_random(state);
+
+    if (fuzz_random(state) % 4 == 0)
+        len = fuzz_random(state) % len;
+
+    return len;
+}
@@ -0,0 +1,208 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// write queue harness: input is a list of operations on a sev_queue,
+// pushes, partial writes and trims, checked against a simple model
+// after each one
+//
+// trims must drop whole messages, oldest first, and keep a partially
+// written head, the messages a send in flight points into and the
+// newest message
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include "fuzz.h"
+#include "../example/sev/sev_queue.h"
+
+#define MAX_OPS 512
+
+// a message is a run of buffers with the same id
+struct model_buffer {
+    int id;
+    size_t len;
+    size_t start;
+    int joined;
+};
+
+static struct model_buffer model[MAX_OPS * 2];
+static int count;
+static size_t bytes;
+
+static void model_push(int id, size_t len, int joined)
+{
+    struct model_buffer buffer = { id, len, 0, joined };
+    model[count++] = buffer;
+    bytes += len;
+}
+
+static void model_remove(int first, int last)
+{
+    for (int i = first; i <= last; i++)
+        bytes -= model[i].len - model[i].start;
+
+    memmove(model + first, model + last + 1,
+        (count - last - 1) * sizeof(model[0]));
+    count -= last - first + 1;
+}
+
+static int model_end(int i)
+{
+    while (model[i].joined && i + 1 < count)
+        i++;
+
+    return i;
+}
+
+static void model_consume(size_t len)
+{
+    while (len > 0) {
+        size_t left = model[0].len - model[0].start;
+        if (len < left) {
+            model[0].start += len;
+            bytes -= len;
+            return;
+        }
+
+        len -= left;
+        model_remove(0, 0);
+    }
+}
+
+static void model_trim(size_t limit, int keep)
+{
+    if (count == 0)
+        return;
+
+    // the messages up to first are pinned
+    int first = 0;
+    if (keep > 0 || model[0].start > 0) {
+        int last = keep > count ? count - 1 : keep > 0 ? keep - 1 : 0;
+        first = model_end(last) + 1;
+    }
+
+    while (bytes > limit && first < count) {
+        int end = model_end(first);
+        if (end == count - 1)
+            return;
+
+        model_remove(first, end);
+    }
+}
+
+static void compare(struct sev_queue *queue, int op)
+{
+    struct sev_buffer *buffer;
+    int i = 0;
+
+    STAILQ_FOREACH(buffer, &queue->head, entries) {
+        if (i == count)
+            break;
+
+        // file segments carry the id in their offset, the rest in data
+        int id = buffer->fd != -1 ? (int)buffer->offset :
+            (uint8_t)buffer->data[0];
+        int want = buffer->fd != -1 ? model[i].id : model[i].id % 256;
+
+        if (id != want || buffer->len != model[i].len ||
+            buffer->start != model[i].start ||
+            buffer->joined != model[i].joined)
+            break;
+
+        i++;
+    }
+
+    if (buffer != NULL || i != count || queue->bytes != bytes) {
+        fprintf(stderr, "queue differs from the model after op %d "
+            "(buffer %d, %zu vs %zu bytes)\n", op, i, queue->bytes, bytes);
+        abort();
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t len)
+{
+    static int fd = -1;
+    if (fd == -1)
+        fd = open("/dev/null", O_RDONLY);
+
+    struct sev_queue *queue = sev_queue_new();
+    count = 0;
+    bytes = 0;
+
+    char payload[64];
+    size_t pos = 0;
+
+    for (int op = 0; op < MAX_OPS && len - pos >= 3; op++) {
+        uint8_t a = data[pos++], b = data[pos++], c = data[pos++];
+
+        switch (a % 5) {
+        case 0:
+            // a message
+            memset(payload, op, sizeof(payload));
+            sev_queue_push_back(queue, payload, b % 32 + 1);
+            model_push(op, b % 32 + 1, 0);
+            break;
+        case 1:
+            // a file segment, with or without a frame header
+            memset(payload, op, sizeof(payload));
+            if (sev_queue_push_file(queue, payload, b % 4, fd, op,
+                    c % 64 + 1) == -1)
+                abort();
+            if (b % 4)
+                model_push(op, b % 4, 1);
+            model_push(op, c % 64 + 1, 0);
+            break;
+        case 2:
+            // a partial write
+            if (b % 40 <= bytes) {
+                sev_queue_consume(queue, b % 40);
+                model_consume(b % 40);
+            }
+            break;
+        default:
+            // keep is how many buffers a send in flight points into
+            sev_queue_trim(queue, b * 2, a % 5 == 3 ? 0 : c % 4);
+            model_trim(b * 2, a % 5 == 3 ? 0 : c % 4);
+            break;
+        }
+
+        compare(queue, op);
+    }
+
+    sev_queue_free(queue);
+    return 0;
+}
+
+size_t fuzz_generate(uint8_t *buf, size_t size, uint64_t *state)
+{
+    size_t len = (fuzz_random(state) % 100 + 4) * 3;
+    if (len > size)
+        len = size;
+
+    for (size_t i = 0; i < len; i++)
+        buf[i] = fuzz_random(state);
+
+    return len;
+}
@@ -0,0 +1,211 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// restore harness: input is a parser state as written by ws_parser_save,
+// possibly tampered with, followed by frames to parse from it. the first
+// two bytes are the state's length, little endian
+//
+// a state that ws_parser_restore accepts must parse any input without
+// leaving the parser's buffers, one it should reject aborts the run
+
+#include <stdio.h>
+#include <string.h>
+#include "fuzz.h"
+#include "../ws.h"
+
+// mirrors struct state in ws_frame.c, function pointers are indices
+// into its read_fns and parse_fns
+struct saved_state {
+    uint32_t magic;
+    int32_t read_fn;
+    int32_t parse_fn;
+    uint32_t buffer_len;
+    uint64_t remaining;
+    uint8_t bytes[8];
+    uint32_t bytes_len;
+
+    int32_t fin;
+    int32_t opcode;
+    int32_t masked;
+    uint8_t mask[4];
+    uint64_t len;
+    uint64_t chunk_offset;
+
+    struct ws_bucket frame_limit;
+    struct ws_bucket byte_limit;
+
+    int32_t resource;
+    int32_t websocket_key;
+    int32_t num_headers;
+};
+
+#define READ_STREAM 1
+#define READ_BYTES 2
+#define PARSE_NONE 0
+
+// states the frame readers can't continue from
+static int invalid(const struct saved_state *s)
+{
+    if (s->read_fn == READ_BYTES)
+        return s->parse_fn == PARSE_NONE || s->bytes_len > 8 ||
+            s->remaining > 8 - s->bytes_len;
+
+    if (s->read_fn == READ_STREAM)
+        return s->remaining > s->len;
+
+    return 0;
+}
+
+static int header_cb(struct ws_header *header, void *data)
+{
+    return 0;
+}
+
+static int frame_cb(struct ws_frame *frame, void *data)
+{
+    if (frame->chunk_offset > frame->len ||
+        frame->chunk_len > frame->len - frame->chunk_offset) {
+        fprintf(stderr, "chunk at %llu+%zu outside a %llu byte frame\n",
+            (unsigned long long)frame->chunk_offset, frame->chunk_len,
+            (unsigned long long)frame->len);
+        abort();
+    }
+
+    return 0;
+}
+
+static void parser_setup(struct ws_parser *parser)
+{
+    ws_parser_init(parser);
+    parser->header_cb = header_cb;
+    parser->frame_cb = frame_cb;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t len)
+{
+    if (len < 2)
+        return 0;
+
+    size_t state_len = data[0] | data[1] << 8;
+    if (state_len > len - 2)
+        return 0;
+
+    const char *state = (const char *)data + 2;
+    struct ws_parser parser;
+    parser_setup(&parser);
+
+    if (ws_parser_restore(&parser, state, state_len) == 0) {
+        struct saved_state saved;
+        if (state_len < sizeof(saved))
+            abort();
+
+        memcpy(&saved, state, sizeof(saved));
+        if (invalid(&saved)) {
+            fprintf(stderr, "restored an invalid state\n");
+            abort();
+        }
+
+        // the parser unmasks in place
+        size_t rest = len - 2 - state_len;
+        char *copy = malloc(rest + 1);
+        memcpy(copy, state + state_len, rest);
+
+        ws_parse_all(&parser, copy, rest);
+        if (parser.bytes_len > 8)
+            abort();
+
+        free(copy);
+    }
+
+    ws_parser_free(&parser);
+    return 0;
+}
+
+// a parser saved somewhere in a run of frames, then one of: a read_bytes
+// state overflowing u.bytes, read_bytes without a parse_fn, a read_stream
+// state past the start of its frame, a flipped bit, or no change
+size_t fuzz_generate(uint8_t *buf, size_t size, uint64_t *state)
+{
+    static uint8_t frames[4096];
+    size_t len = fuzz_generate_frames(frames, sizeof(frames), state);
+    size_t cut = fuzz_random(state) % (len + 1);
+
+    struct ws_parser parser;
+    parser_setup(&parser);
+    ws_read_next_frame(&parser);
+
+    char *copy = malloc(len + 1);
+    memcpy(copy, frames, len);
+    ws_parse_all(&parser, copy, cut);
+    free(copy);
+
+    size_t state_len = ws_parser_save(&parser, (char *)buf + 2, size - 2);
+    if (state_len > size - 2 || state_len > 0xFFFF) {
+        ws_parser_free(&parser);
+        return 0;
+    }
+
+    struct saved_state saved;
+    memcpy(&saved, buf + 2, sizeof(saved));
+
+    if (saved.remaining != parser.remaining ||
+        saved.bytes_len != parser.bytes_len || saved.len != parser.frame.len) {
+        fprintf(stderr, "struct saved_state is out of date\n");
+        abort();
+    }
+
+    ws_parser_free(&parser);
+
+    uint64_t r = fuzz_random(state);
+    switch (r % 5) {
+    case 0:
+        saved.read_fn = READ_BYTES;
+        saved.bytes_len = r >> 8 & 7;
+        saved.remaining = 8 - saved.bytes_len + 1 + (r >> 16) % 100;
+        break;
+    case 1:
+        saved.read_fn = READ_BYTES;
+        saved.parse_fn = PARSE_NONE;
+        break;
+    case 2:
+        saved.read_fn = READ_STREAM;
+        saved.remaining = saved.len + 1 + (r >> 8) % 100;
+        break;
+    case 3:
+        ((uint8_t *)&saved)[(r >> 8) % sizeof(saved)] ^= 1 << (r >> 16) % 8;
+        break;
+    }
+
+    memcpy(buf + 2, &saved, sizeof(saved));
+    buf[0] = state_len;
+    buf[1] = state_len >> 8;
+
+    size_t rest = len - cut;
+    if (rest > size - 2 - state_len)
+        rest = size - 2 - state_len;
+
+    memcpy(buf + 2 + state_len, frames + cut, rest);
+    return 2 + state_len + rest;
+}
@@ -38,6 +38,11 @@
 
 #include <sys/types.h>
 
+/* static in the single header build, see amalgamate.sh */
+#ifndef WS_API
+# define WS_API
+#endif
+
 struct sha1_ctxt {
 	union {
 		u_int8_t	b8[20];
@@ -54,10 +59,10 @@ struct sha1_ctxt {
 	u_int8_t	count;
 };
 
-extern void sha1_init(struct sha1_ctxt *);
-extern void sha1_pad(struct sha1_ctxt *);
-extern void sha1_loop(struct sha1_ctxt *, const u_int8_t *, size_t);
-extern void sha1_result(struct sha1_ctxt *, u_int8_t *);
+WS_API void sha1_init(struct sha1_ctxt *);
+WS_API void sha1_pad(struct sha1_ctxt *);
+WS_API void sha1_loop(struct sha1_ctxt *, const u_int8_t *, size_t);
+WS_API void sha1_result(struct sha1_ctxt *, u_int8_t *);
 
 /* compatibilty with other SHA1 source codes */
 typedef struct sha1_ctxt SHA1_CTX;
@@ -23,8 +23,11 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _POSIX_C_SOURCE 199309L
 #include <string.h>
+#include <time.h>
 #include "ws.h"
+#include "ws_metrics.h"
 
 // read and parse a byte stream
 // return the number of bytes read
@@ -34,25 +37,133 @@ int ws_parse(struct ws_parser *parser, char *data, size_t len)
     return parser->read_fn(parser, data, len);
 }
 
+// WS_HEADER_CB and WS_FRAME_CB bind the callbacks at compile time instead
+// of through the parser, so they can inline into the parse loop. define
+// them to function names before including the single header build
+static int dispatch(struct ws_parser *parser)
+{
+#ifdef WS_HEADER_CB
+    if (parser->result == WS_HTTP_HEADER)
+        return WS_HEADER_CB(&parser->header, parser->data);
+#else
+    if (parser->result == WS_HTTP_HEADER && parser->header_cb)
+        return parser->header_cb(&parser->header, parser->data);
+#endif
+
+#ifdef WS_FRAME_CB
+    if (parser->result == WS_FRAME_CHUNK)
+        return WS_FRAME_CB(&parser->frame, parser->data);
+#else
+    if (parser->result == WS_FRAME_CHUNK && parser->frame_cb)
+        return parser->frame_cb(&parser->frame, parser->data);
+#endif
+
+    return 0;
+}
+
+// a coarse clock is plenty for rate limits and much cheaper
+static double clock_now(void)
+{
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bucket_refill(struct ws_bucket *bucket, double now)
+{
+    bucket->tokens += bucket->rate * (now - bucket->last);
+    if (bucket->tokens > bucket->burst)
+        bucket->tokens = bucket->burst;
+
+    bucket->last = now;
+}
+
+// tokens may go into debt, the caller pauses reading to pay it off
+// a client that runs up more than a burst of debt is cut off
+static int bucket_take(struct ws_bucket *bucket, double n)
+{
+    if (bucket->rate <= 0)
+        return 0;
+
+    bucket->tokens -= n;
+    return bucket->tokens < -bucket->burst ? -1 : 0;
+}
+
+static int rate_limit(struct ws_parser *parser)
+{
+    struct ws_frame *frame = &parser->frame;
+
+    if (frame->chunk_offset == 0 && bucket_take(&parser->frame_limit, 1))
+        return -1;
+
+    return bucket_take(&parser->byte_limit, frame->chunk_len);
+}
+
 int ws_parse_all(struct ws_parser *parser, char *data, size_t len)
 {
+    uint64_t start = WS_CLOCK();
+    uint64_t callbacks = 0;
+
+    // one clock sample per read
+    int limited = parser->frame_limit.rate > 0 || parser->byte_limit.rate > 0;
+    if (limited) {
+        double now = clock_now();
+        bucket_refill(&parser->frame_limit, now);
+        bucket_refill(&parser->byte_limit, now);
+    }
+
     while (len > 0) {
         int ret = ws_parse(parser, data, len);
         if (ret == -1)
             return -1;
 
-        if (parser->result == WS_HTTP_HEADER && parser->header_cb)
-            if (parser->header_cb(&parser->header, parser->data) == -1)
-                return -1;
+        // frames are charged before their callback runs
+        if (limited && parser->result == WS_FRAME_CHUNK &&
+            rate_limit(parser) == -1) {
+            parser->errno = WS_RATE_LIMITED;
+            WS_COUNT(WS_RATE_LIMIT_ERRORS, 1);
+            return -1;
+        }
+
+        if (parser->result != WS_NONE) {
+            uint64_t t = WS_CLOCK();
+
+            // how long the chunk waited behind the chunks before it
+            if (parser->result == WS_FRAME_CHUNK)
+                WS_RECORD(WS_RX_CALLBACK_NS, t - start);
 
-        if (parser->result == WS_FRAME_CHUNK && parser->frame_cb)
-            if (parser->frame_cb(&parser->frame, parser->data) == -1)
+            int cb = dispatch(parser);
+
+            t = WS_CLOCK() - t;
+            callbacks += t;
+            WS_RECORD(WS_CALLBACK_NS, t);
+
+            if (cb == -1)
                 return -1;
+        }
 
         data += ret;
         len -= ret;
     }
 
+    WS_RECORD(WS_PARSE_NS, WS_CLOCK() - start - callbacks);
+
+    return 0;
+}
+
+// parse a list of buffers as one stream, e.g. a wrapped ring buffer
+// payload chunks point into each buffer, only frame headers that
+// straddle two buffers are copied
+int ws_parse_iov(struct ws_parser *parser, const struct iovec *iov, int cnt)
+{
+    for (int i = 0; i < cnt; i++)
+        if (ws_parse_all(parser, iov[i].iov_base, iov[i].iov_len) == -1)
+            return -1;
+
     return 0;
 }
 
@@ -62,6 +173,38 @@ void ws_parser_init(struct ws_parser *parser)
     parser->read_fn = ws_read_http_header;
 }
 
+// limit frames and payload bytes per second, with bursts of up to
+// frame_burst frames and byte_burst bytes. zero disables a limit
+void ws_set_rate_limit(struct ws_parser *parser, double frames, double
+    frame_burst, double bytes, double byte_burst)
+{
+    double now = clock_now();
+
+    struct ws_bucket frame_limit = { frames, frame_burst, frame_burst, now };
+    struct ws_bucket byte_limit = { bytes, byte_burst, byte_burst, now };
+
+    parser->frame_limit = frame_limit;
+    parser->byte_limit = byte_limit;
+}
+
+// seconds until the buckets are out of debt, 0 if they are not in debt
+// callers can stop reading for this long to hold a client to its limits
+double ws_rate_delay(struct ws_parser *parser)
+{
+    double delay = 0;
+    struct ws_bucket *buckets[] = { &parser->frame_limit, &parser->byte_limit };
+
+    for (int i = 0; i < 2; i++) {
+        struct ws_bucket *bucket = buckets[i];
+
+        if (bucket->rate > 0 && bucket->tokens < 0 &&
+            -bucket->tokens / bucket->rate > delay)
+            delay = -bucket->tokens / bucket->rate;
+    }
+
+    return delay;
+}
+
 void ws_parser_free(struct ws_parser *parser)
 {
     free(parser->header.headers);
@@ -28,6 +28,12 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/uio.h>
+
+// static in the single header build, see amalgamate.sh
+#ifndef WS_API
+# define WS_API
+#endif
 
 #define WS_NONE 0
 #define WS_HTTP_HEADER 1
@@ -45,12 +51,14 @@
 #define WS_ERROR -1
 #define WS_BUFFER_OVERFLOW 1
 #define WS_BAD_REQUEST 2
+#define WS_RATE_LIMITED 3
 
 // http header lines must fit in this buffer
 #define WS_BUFFER_SIZE 4096
 
 #define WS_FRAME_HEADER_SIZE 10
 #define WS_HTTP_RESPONSE_SIZE 130
+#define WS_ACCEPT_KEY_LEN 28
 
 struct ws_parser;
 typedef int (ws_callback)(struct ws_parser*);
@@ -65,6 +73,9 @@ struct ws_frame {
     char *chunk_data;
     size_t chunk_len;
     uint64_t chunk_offset;
+
+    // when the chunk's bytes were received, see ws_parser.rx_timestamp
+    uint64_t timestamp;
 };
 
 struct ws_header {
@@ -74,6 +85,32 @@ struct ws_header {
     char **values;
 };
 
+// a 101 response for one subprotocol and extension set, built once and
+// shared by every connection that negotiates them
+struct ws_handshake {
+    int refs;
+    char *protocol;
+    char *extensions;
+    struct ws_handshake *next;
+
+    size_t len;
+    char data[];
+};
+
+// token bucket, refilled at rate per second up to burst
+// a zero rate disables it
+struct ws_bucket {
+    double rate;
+    double burst;
+    double tokens;
+    double last;
+};
+
+// one per server, zero initialized
+struct ws_handshake_cache {
+    struct ws_handshake *list;
+};
+
 struct ws_parser {
     int result;
     int errno;
@@ -99,6 +136,19 @@ struct ws_parser {
     int (*header_cb)(struct ws_header *header, void *data);
     int (*frame_cb)(struct ws_frame *frame, void *data);
 
+    // optional, returns where to write the unmasked chunk (chunk_len
+    // bytes at chunk_offset) or NULL to unmask in place
+    // when it never returns NULL the input is not written to
+    char *(*dest_cb)(struct ws_frame *frame, void *data);
+
+    // per connection limits, see ws_set_rate_limit
+    struct ws_bucket frame_limit;
+    struct ws_bucket byte_limit;
+
+    // optional, when the bytes passed to the next ws_parse_all were
+    // received, e.g. sev_stream.rx_timestamp, handed to their chunks
+    uint64_t rx_timestamp;
+
     // private data for the callbacks
     void *data;
 
@@ -106,17 +156,38 @@ struct ws_parser {
     struct ws_frame frame;
 };
 
-int ws_write_frame_header(char *out, int type, uint64_t len);
-void ws_write_http_handshake(char *out, char *key);
-void ws_write_http_error(char *out);
-
-int ws_parse_all(struct ws_parser *parser, char *data, size_t len);
-int ws_parse(struct ws_parser *parser, char *data, size_t len);
-
-void ws_parser_init(struct ws_parser *);
-void ws_parser_free(struct ws_parser *);
-
-int ws_read_http_header(struct ws_parser *parser, char *data, size_t len);
-void ws_read_next_frame(struct ws_parser *);
+WS_API int ws_write_frame_header(char *out, int type, uint64_t len);
+WS_API int ws_write_http_handshake(char *out, char *key);
+WS_API int ws_write_http_error(char *out);
+
+WS_API struct ws_handshake *ws_handshake_get(
+    struct ws_handshake_cache *cache, const char *protocol,
+    const char *extensions);
+WS_API void ws_handshake_unref(struct ws_handshake_cache *cache,
+    struct ws_handshake *handshake);
+WS_API void ws_handshake_cache_free(struct ws_handshake_cache *cache);
+WS_API int ws_handshake_write(const struct ws_handshake *handshake,
+    char *out, size_t size, const char *key);
+
+WS_API int ws_parse_all(struct ws_parser *parser, char *data, size_t len);
+WS_API int ws_parse_iov(struct ws_parser *parser, const struct iovec *iov,
+    int cnt);
+WS_API int ws_parse(struct ws_parser *parser, char *data, size_t len);
+
+WS_API void ws_parser_init(struct ws_parser *);
+WS_API void ws_parser_free(struct ws_parser *);
+
+WS_API size_t ws_parser_save(const struct ws_parser *parser, char *out,
+    size_t size);
+WS_API int ws_parser_restore(struct ws_parser *parser, const char *in,
+    size_t len);
+
+WS_API void ws_set_rate_limit(struct ws_parser *parser, double frames, double
+    frame_burst, double bytes, double byte_burst);
+WS_API double ws_rate_delay(struct ws_parser *parser);
+
+WS_API int ws_read_http_header(struct ws_parser *parser, char *data,
+    size_t len);
+WS_API void ws_read_next_frame(struct ws_parser *);
 
 #endif
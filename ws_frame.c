@@ -35,6 +35,7 @@
 #endif
 
 #include "ws.h"
+#include "ws_metrics.h"
 
 static uint64_t ntohll(uint64_t n)
 {
@@ -48,6 +49,36 @@ static uint64_t ntohll(uint64_t n)
     return n;
 }
 
+// xor len bytes of src with the frame mask into dst, a word at a time
+// dst may be src
+static void unmask(char *dst, const char *src, size_t len,
+    const struct ws_frame *frame)
+{
+    if (!frame->masked) {
+        memcpy(dst, src, len);
+        return;
+    }
+
+    // the mask is aligned to the start of the frame, not the chunk
+    uint8_t mask[8];
+    for (int i = 0; i < 8; i++)
+        mask[i] = frame->mask[(frame->chunk_offset + i) % 4];
+
+    uint64_t mask64;
+    memcpy(&mask64, mask, 8);
+
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, src + i, 8);
+        word ^= mask64;
+        memcpy(dst + i, &word, 8);
+    }
+
+    for (; i < len; i++)
+        dst[i] = src[i] ^ mask[i % 8];
+}
+
 // read n bytes, process them in chucks as they become available
 static int read_stream(struct ws_parser *parser, char *data, size_t len)
 {
@@ -61,9 +92,21 @@ static int read_stream(struct ws_parser *parser, char *data, size_t len)
     parser->frame.chunk_data = data;
     parser->frame.chunk_offset = parser->frame.len - parser->remaining;
     parser->frame.chunk_len = len;
+    parser->frame.timestamp = parser->rx_timestamp;
 
-    for (int i = 0; i < len; i++)
-        data[i] ^= parser->frame.mask[i % 4];
+    char *dest = parser->dest_cb ?
+        parser->dest_cb(&parser->frame, parser->data) : NULL;
+
+    if (dest) {
+        unmask(dest, data, len, &parser->frame);
+        parser->frame.chunk_data = dest;
+    }
+    else if (parser->frame.masked) {
+        unmask(data, data, len, &parser->frame);
+    }
+
+    if (parser->frame.masked)
+        WS_COUNT(WS_BYTES_UNMASKED, len);
 
     parser->remaining -= len;
     if (parser->remaining == 0)
@@ -96,12 +139,16 @@ static int read_bytes(struct ws_parser *parser, char *data, size_t len)
         parser->read_fn = read_stream; \
     } while (0)
 
+// when nothing needs to be read, fn runs right away instead of
+// waiting for the next call with data
 #define read_bytes_cb(parser,len,fn) \
     do { \
         parser->remaining = len; \
         parser->bytes_len = 0; \
         parser->read_fn = read_bytes; \
         parser->parse_fn = fn; \
+        if (parser->remaining == 0) \
+            fn(parser); \
     } while (0)
 
 static void parse_frame_mask(struct ws_parser *parser)
@@ -109,6 +156,17 @@ static void parse_frame_mask(struct ws_parser *parser)
     for (int i = 0; i < 4; i++)
         parser->frame.mask[i] = parser->frame.masked ? parser->u.bytes[i] : 0;
 
+    // empty frames are reported as a single empty chunk
+    if (parser->frame.len == 0) {
+        parser->result = WS_FRAME_CHUNK;
+        parser->frame.chunk_data = (char *)parser->u.bytes;
+        parser->frame.chunk_offset = 0;
+        parser->frame.chunk_len = 0;
+        parser->frame.timestamp = parser->rx_timestamp;
+        ws_read_next_frame(parser);
+        return;
+    }
+
     read_stream_cb(parser, parser->frame.len, ws_read_next_frame);
 }
 
@@ -129,6 +187,8 @@ static void parse_frame_header(struct ws_parser *parser)
     parser->frame.len = parser->u.bytes[1] & 0x7F;
     parser->frame.masked = parser->u.bytes[1] >> 7;
 
+    WS_COUNT(WS_FRAMES_PARSED, 1);
+
     int num = 0;
     if (parser->frame.len == 126)
         num = 2;
@@ -175,3 +235,221 @@ int ws_write_frame_header(char *out, int type, uint64_t len)
 
     return -1;
 }
+
+// parser state as saved by ws_parser_save, fixed size fields followed by
+// the http buffer and the header offsets
+// functions are stored as indices and pointers as buffer offsets, so the
+// state can be restored by another process on the same architecture
+#define STATE_MAGIC 0x31505357 // "WSP1"
+
+static int (*const read_fns[])(struct ws_parser *, char *, size_t) = {
+    ws_read_http_header, read_stream, read_bytes,
+};
+
+static void (*const parse_fns[])(struct ws_parser *) = {
+    NULL, parse_frame_header, parse_frame_length, parse_frame_mask,
+};
+
+#define NUM_READ_FNS (int)(sizeof(read_fns) / sizeof(read_fns[0]))
+#define NUM_PARSE_FNS (int)(sizeof(parse_fns) / sizeof(parse_fns[0]))
+
+struct state {
+    uint32_t magic;
+    int32_t read_fn;
+    int32_t parse_fn;
+    uint32_t buffer_len;
+    uint64_t remaining;
+    uint8_t bytes[8];
+    uint32_t bytes_len;
+
+    // frame being parsed
+    int32_t fin;
+    int32_t opcode;
+    int32_t masked;
+    uint8_t mask[4];
+    uint64_t len;
+    uint64_t chunk_offset;
+
+    struct ws_bucket frame_limit;
+    struct ws_bucket byte_limit;
+
+    // offsets into the buffer, -1 for NULL
+    int32_t resource;
+    int32_t websocket_key;
+    int32_t num_headers;
+};
+
+static int32_t state_offset(const struct ws_parser *parser, const char *p)
+{
+    return p ? p - parser->buffer : -1;
+}
+
+static char *state_pointer(struct ws_parser *parser, int32_t offset)
+{
+    return offset == -1 ? NULL : parser->buffer + offset;
+}
+
+// serializes the parser, e.g. to hand its connection to another process
+// callbacks and data are left out, the restoring side sets its own
+// returns the length, out is only written if it fits in size
+size_t ws_parser_save(const struct ws_parser *parser, char *out, size_t size)
+{
+    struct state state;
+    memset(&state, 0, sizeof(state));
+
+    state.magic = STATE_MAGIC;
+    state.read_fn = -1;
+    state.parse_fn = -1;
+
+    for (int i = 0; i < NUM_READ_FNS; i++)
+        if (parser->read_fn == read_fns[i])
+            state.read_fn = i;
+
+    for (int i = 0; i < NUM_PARSE_FNS; i++)
+        if (parser->parse_fn == parse_fns[i])
+            state.parse_fn = i;
+
+    state.buffer_len = parser->buffer_len;
+    state.remaining = parser->remaining;
+    memcpy(state.bytes, parser->u.bytes, 8);
+    state.bytes_len = parser->bytes_len;
+
+    state.fin = parser->frame.fin;
+    state.opcode = parser->frame.opcode;
+    state.masked = parser->frame.masked;
+    memcpy(state.mask, parser->frame.mask, 4);
+    state.len = parser->frame.len;
+    state.chunk_offset = parser->frame.chunk_offset;
+
+    state.frame_limit = parser->frame_limit;
+    state.byte_limit = parser->byte_limit;
+
+    state.resource = state_offset(parser, parser->header.resource);
+    state.websocket_key = state_offset(parser, parser->header.websocket_key);
+    state.num_headers = -1;
+
+    if (parser->header.headers)
+        for (state.num_headers = 0;
+            parser->header.headers[state.num_headers];
+            state.num_headers++)
+            ;
+
+    size_t headers_len = state.num_headers > 0 ?
+        state.num_headers * 2 * sizeof(int32_t) : 0;
+    size_t len = sizeof(state) + state.buffer_len + headers_len;
+
+    if (len > size)
+        return len;
+
+    char *p = out;
+    memcpy(p, &state, sizeof(state));
+    p += sizeof(state);
+    memcpy(p, parser->buffer, state.buffer_len);
+    p += state.buffer_len;
+
+    for (int i = 0; i < state.num_headers; i++) {
+        int32_t offsets[2] = {
+            state_offset(parser, parser->header.headers[i]),
+            state_offset(parser, parser->header.values[i]),
+        };
+
+        memcpy(p, offsets, sizeof(offsets));
+        p += sizeof(offsets);
+    }
+
+    return len;
+}
+
+static int state_valid_offset(const struct state *state, int32_t offset)
+{
+    return offset >= -1 && offset < (int32_t)state->buffer_len;
+}
+
+// restores a state from ws_parser_save into an initialized parser, which
+// keeps its callbacks and data
+// returns -1 if the state is invalid
+int ws_parser_restore(struct ws_parser *parser, const char *in, size_t len)
+{
+    struct state state;
+
+    if (len < sizeof(state))
+        return -1;
+
+    memcpy(&state, in, sizeof(state));
+
+    if (state.magic != STATE_MAGIC ||
+        state.read_fn < 0 || state.read_fn >= NUM_READ_FNS ||
+        state.parse_fn < 0 || state.parse_fn >= NUM_PARSE_FNS ||
+        state.buffer_len >= WS_BUFFER_SIZE || state.bytes_len > 8 ||
+        state.num_headers < -1 ||
+        !state_valid_offset(&state, state.resource) ||
+        !state_valid_offset(&state, state.websocket_key))
+        return -1;
+
+    // read_bytes copies remaining bytes into u.bytes before calling
+    // parse_fn, read_stream reports chunks at len - remaining
+    if (read_fns[state.read_fn] == read_bytes &&
+        (parse_fns[state.parse_fn] == NULL ||
+        state.remaining > 8 - state.bytes_len))
+        return -1;
+
+    if (read_fns[state.read_fn] == read_stream && state.remaining > state.len)
+        return -1;
+
+    size_t headers_len = state.num_headers > 0 ?
+        (size_t)state.num_headers * 2 * sizeof(int32_t) : 0;
+
+    if (len != sizeof(state) + state.buffer_len + headers_len)
+        return -1;
+
+    const char *p = in + sizeof(state);
+    const char *offsets = p + state.buffer_len;
+
+    for (int i = 0; i < state.num_headers * 2; i++) {
+        int32_t offset;
+        memcpy(&offset, offsets + i * sizeof(int32_t), sizeof(offset));
+
+        if (offset == -1 || !state_valid_offset(&state, offset))
+            return -1;
+    }
+
+    ws_parser_free(parser);
+
+    parser->read_fn = read_fns[state.read_fn];
+    parser->parse_fn = parse_fns[state.parse_fn];
+    parser->buffer_len = state.buffer_len;
+    memcpy(parser->buffer, p, state.buffer_len);
+    parser->buffer[state.buffer_len] = '\0';
+    parser->remaining = state.remaining;
+    memcpy(parser->u.bytes, state.bytes, 8);
+    parser->bytes_len = state.bytes_len;
+
+    parser->frame.fin = state.fin;
+    parser->frame.opcode = state.opcode;
+    parser->frame.masked = state.masked;
+    memcpy(parser->frame.mask, state.mask, 4);
+    parser->frame.len = state.len;
+    parser->frame.chunk_data = NULL;
+    parser->frame.chunk_len = 0;
+    parser->frame.chunk_offset = state.chunk_offset;
+
+    parser->frame_limit = state.frame_limit;
+    parser->byte_limit = state.byte_limit;
+
+    parser->header.resource = state_pointer(parser, state.resource);
+    parser->header.websocket_key = state_pointer(parser, state.websocket_key);
+
+    if (state.num_headers >= 0) {
+        parser->header.headers = calloc(state.num_headers + 1, sizeof(char *));
+        parser->header.values = calloc(state.num_headers + 1, sizeof(char *));
+
+        for (int i = 0; i < state.num_headers; i++) {
+            int32_t pair[2];
+            memcpy(pair, offsets + i * sizeof(pair), sizeof(pair));
+            parser->header.headers[i] = state_pointer(parser, pair[0]);
+            parser->header.values[i] = state_pointer(parser, pair[1]);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,930 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "ws_h2.h"
+
+// frame types
+#define DATA 0x0
+#define HEADERS 0x1
+#define PRIORITY 0x2
+#define RST_STREAM 0x3
+#define SETTINGS 0x4
+#define PUSH_PROMISE 0x5
+#define PING 0x6
+#define GOAWAY 0x7
+#define WINDOW_UPDATE 0x8
+#define CONTINUATION 0x9
+
+// flags
+#define END_STREAM 0x1
+#define ACK 0x1
+#define END_HEADERS 0x4
+#define PADDED 0x8
+#define PRIORITY_FLAG 0x20
+
+// settings
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define SETTINGS_MAX_FRAME_SIZE 0x5
+#define SETTINGS_ENABLE_CONNECT_PROTOCOL 0x8
+
+#define MAX_WINDOW 0x7FFFFFFF
+
+static uint32_t read32(const char *p)
+{
+    const uint8_t *u = (const uint8_t *)p;
+    return (uint32_t)u[0] << 24 | u[1] << 16 | u[2] << 8 | u[3];
+}
+
+static void write32(char *p, uint32_t n)
+{
+    p[0] = n >> 24;
+    p[1] = n >> 16;
+    p[2] = n >> 8;
+    p[3] = n;
+}
+
+static void write_frame(struct ws_h2 *h2, int type, int flags,
+    uint32_t stream, const char *payload, size_t len)
+{
+    char header[WS_H2_FRAME_HEADER_SIZE];
+    header[0] = len >> 16;
+    header[1] = len >> 8;
+    header[2] = len;
+    header[3] = type;
+    header[4] = flags;
+    write32(header + 5, stream);
+
+    h2->write_cb(header, sizeof(header), h2->data);
+    if (len > 0)
+        h2->write_cb(payload, len, h2->data);
+}
+
+static void write_window_update(struct ws_h2 *h2, uint32_t stream,
+    uint32_t increment)
+{
+    char payload[4];
+    write32(payload, increment);
+    write_frame(h2, WINDOW_UPDATE, 0, stream, payload, sizeof(payload));
+}
+
+static void write_rst_stream(struct ws_h2 *h2, uint32_t stream,
+    uint32_t error)
+{
+    char payload[4];
+    write32(payload, error);
+    write_frame(h2, RST_STREAM, 0, stream, payload, sizeof(payload));
+}
+
+// a response with just a status, 200 keeps the stream open
+static void write_status(struct ws_h2 *h2, uint32_t stream, int status)
+{
+    char payload[5];
+    size_t len;
+
+    if (status == 200) {
+        // indexed, from the static table
+        payload[0] = 0x88;
+        len = 1;
+    }
+    else {
+        // literal without indexing, name from the static table
+        if (status < 100 || status > 999)
+            status = 500;
+
+        payload[0] = 0x08;
+        payload[1] = 3;
+        payload[2] = '0' + status / 100;
+        payload[3] = '0' + status / 10 % 10;
+        payload[4] = '0' + status % 10;
+        len = 5;
+    }
+
+    write_frame(h2, HEADERS, END_HEADERS | (status == 200 ? 0 : END_STREAM),
+        stream, payload, len);
+}
+
+// connection error, nothing is parsed after the GOAWAY
+static int fail(struct ws_h2 *h2, uint32_t error)
+{
+    char payload[8];
+    write32(payload, h2->last_stream);
+    write32(payload + 4, error);
+    write_frame(h2, GOAWAY, 0, 0, payload, sizeof(payload));
+
+    h2->failed = 1;
+    return -1;
+}
+
+static struct ws_h2_stream *stream_find(struct ws_h2 *h2, uint32_t id)
+{
+    for (struct ws_h2_stream *stream = h2->streams; stream;
+        stream = stream->next)
+        if (stream->id == id)
+            return stream;
+
+    return NULL;
+}
+
+static struct ws_h2_stream *stream_new(struct ws_h2 *h2, uint32_t id)
+{
+    struct ws_h2_stream *stream = calloc(1, sizeof(struct ws_h2_stream));
+    stream->id = id;
+    stream->h2 = h2;
+    stream->send_window = h2->initial_window;
+    stream->recv_window = WS_H2_WINDOW;
+
+    // no http handshake, the frames start right away
+    ws_parser_init(&stream->parser);
+    ws_read_next_frame(&stream->parser);
+    stream->parser.data = stream;
+
+    return stream;
+}
+
+static void stream_free(struct ws_h2_stream *stream)
+{
+    ws_parser_free(&stream->parser);
+    free(stream->pending);
+    free(stream);
+}
+
+static int stream_done(struct ws_h2_stream *stream)
+{
+    return stream->reset || (stream->local_closed && !stream->end_pending &&
+        stream->remote_closed);
+}
+
+// free the streams that are done, except the one a DATA frame is being
+// read into. the parser calls it between frames, so when close_cb runs
+// doesn't depend on how the input was split
+static void sweep(struct ws_h2 *h2)
+{
+    struct ws_h2_stream **p = &h2->streams;
+
+    while (*p) {
+        struct ws_h2_stream *stream = *p;
+
+        if (!stream_done(stream) || stream == h2->target) {
+            p = &stream->next;
+            continue;
+        }
+
+        *p = stream->next;
+        h2->num_streams--;
+
+        // streams closed from close_cb wait for the next frame
+        h2->parsing++;
+        if (h2->close_cb)
+            h2->close_cb(stream, h2->data);
+        h2->parsing--;
+
+        stream_free(stream);
+    }
+}
+
+// outside of ws_h2_parse, streams are freed right away
+static void release(struct ws_h2 *h2)
+{
+    if (h2->parsing == 0)
+        sweep(h2);
+}
+
+// return credit to the peer once half a window is used, unless held back
+// a stream whose output is stuck gets none, so it can't make us buffer
+// more than a window of replies
+static void grant(struct ws_h2 *h2, struct ws_h2_stream *stream)
+{
+    if (h2->hold)
+        return;
+
+    if (h2->recv_window <= WS_H2_WINDOW / 2) {
+        write_window_update(h2, 0, WS_H2_WINDOW - h2->recv_window);
+        h2->recv_window = WS_H2_WINDOW;
+    }
+
+    if (stream && !stream->reset && !stream->remote_closed &&
+        stream->pending_len < WS_H2_WINDOW &&
+        stream->recv_window <= WS_H2_WINDOW / 2) {
+        write_window_update(h2, stream->id,
+            WS_H2_WINDOW - stream->recv_window);
+        stream->recv_window = WS_H2_WINDOW;
+    }
+}
+
+// send as much of data as the windows allow, returns the bytes sent
+static size_t stream_write(struct ws_h2_stream *stream, const char *data,
+    size_t len, int end)
+{
+    struct ws_h2 *h2 = stream->h2;
+    size_t sent = 0;
+
+    while (sent < len) {
+        int64_t n = len - sent;
+        if (n > h2->send_window)
+            n = h2->send_window;
+        if (n > stream->send_window)
+            n = stream->send_window;
+        if (n > h2->max_frame)
+            n = h2->max_frame;
+        if (n <= 0)
+            break;
+
+        int flags = end && sent + n == len ? END_STREAM : 0;
+        write_frame(h2, DATA, flags, stream->id, data + sent, n);
+
+        h2->send_window -= n;
+        stream->send_window -= n;
+        sent += n;
+    }
+
+    return sent;
+}
+
+static void stream_flush(struct ws_h2_stream *stream)
+{
+    if (!stream->open || stream->reset)
+        return;
+
+    if (stream->pending_len > 0) {
+        size_t n = stream_write(stream, stream->pending, stream->pending_len,
+            stream->end_pending);
+
+        stream->pending_len -= n;
+        memmove(stream->pending, stream->pending + n, stream->pending_len);
+
+        if (stream->pending_len > 0)
+            return;
+
+        if (n > 0 && stream->end_pending) {
+            // went out with the last DATA frame
+            stream->end_pending = 0;
+            return;
+        }
+
+        // it can take more input now
+        grant(stream->h2, stream);
+    }
+
+    if (stream->end_pending) {
+        write_frame(stream->h2, DATA, END_STREAM, stream->id, NULL, 0);
+        stream->end_pending = 0;
+    }
+}
+
+static void flush_all(struct ws_h2 *h2)
+{
+    for (struct ws_h2_stream *stream = h2->streams; stream;
+        stream = stream->next)
+        stream_flush(stream);
+}
+
+// the request headers, collected into the stream's parser
+struct request {
+    struct ws_parser *parser;
+    int connect;
+    int websocket;
+    int bad;
+    int path;
+    int num_headers;
+};
+
+static int append(struct ws_parser *parser, const char *str, size_t len)
+{
+    // the strings are nul terminated
+    if (memchr(str, '\0', len) ||
+        parser->buffer_len + len + 1 >= WS_BUFFER_SIZE)
+        return -1;
+
+    int offset = parser->buffer_len;
+    memcpy(parser->buffer + offset, str, len);
+    parser->buffer[offset + len] = '\0';
+    parser->buffer_len += len + 1;
+
+    return offset;
+}
+
+static int equals(const char *a, size_t a_len, const char *b)
+{
+    return a_len == strlen(b) && memcmp(a, b, a_len) == 0;
+}
+
+static void request_field(const char *name, size_t name_len,
+    const char *value, size_t value_len, void *data)
+{
+    struct request *req = data;
+
+    if (name_len > 0 && name[0] == ':') {
+        // pseudo headers come first
+        if (req->num_headers > 0)
+            req->bad = 1;
+
+        if (equals(name, name_len, ":method"))
+            req->connect = equals(value, value_len, "CONNECT");
+        else if (equals(name, name_len, ":protocol"))
+            req->websocket = equals(value, value_len, "websocket");
+        else if (equals(name, name_len, ":path") && req->path == -1 &&
+            (req->path = append(req->parser, value, value_len)) == -1)
+            req->bad = 1;
+
+        return;
+    }
+
+    if (append(req->parser, name, name_len) == -1 ||
+        append(req->parser, value, value_len) == -1) {
+        req->bad = 1;
+        return;
+    }
+
+    req->num_headers++;
+}
+
+// point the parser's header at the collected strings, like the http
+// handshake does
+static void request_header(struct request *req)
+{
+    struct ws_parser *parser = req->parser;
+    struct ws_header *header = &parser->header;
+
+    header->resource = parser->buffer + req->path;
+    header->headers = calloc(req->num_headers + 1, sizeof(char *));
+    header->values = calloc(req->num_headers + 1, sizeof(char *));
+
+    size_t pos = 0;
+    for (int i = 0; i < req->num_headers; i++) {
+        if (pos == (size_t)req->path)
+            pos += strlen(parser->buffer + pos) + 1;
+
+        header->headers[i] = parser->buffer + pos;
+        pos += strlen(parser->buffer + pos) + 1;
+        header->values[i] = parser->buffer + pos;
+        pos += strlen(parser->buffer + pos) + 1;
+    }
+}
+
+static int headers_end(struct ws_h2 *h2)
+{
+    uint32_t id = h2->block_stream;
+    int flags = h2->block_flags;
+    size_t len = h2->block_len;
+
+    h2->block_stream = 0;
+    h2->block_len = 0;
+
+    if (id <= h2->last_stream) {
+        // trailers or a closed stream, decoded to keep the table in sync
+        if (ws_hpack_decode(&h2->hpack, h2->block, len, NULL, NULL))
+            return fail(h2, WS_H2_COMPRESSION_ERROR);
+
+        struct ws_h2_stream *stream = stream_find(h2, id);
+        if (stream)
+            ws_h2_reset(stream, WS_H2_PROTOCOL_ERROR);
+        else
+            write_rst_stream(h2, id, WS_H2_STREAM_CLOSED);
+
+        return 0;
+    }
+
+    h2->last_stream = id;
+
+    struct ws_h2_stream *stream = stream_new(h2, id);
+    struct request req = { &stream->parser, 0, 0, 0, -1, 0 };
+
+    if (ws_hpack_decode(&h2->hpack, h2->block, len, request_field, &req)) {
+        stream_free(stream);
+        return fail(h2, WS_H2_COMPRESSION_ERROR);
+    }
+
+    if (h2->num_streams >= WS_H2_MAX_STREAMS) {
+        write_rst_stream(h2, id, WS_H2_REFUSED_STREAM);
+        stream_free(stream);
+        return 0;
+    }
+
+    int status = 0;
+
+    // a websocket CONNECT keeps the stream open, rfc 8441 section 4
+    if (req.bad || !req.connect || !req.websocket || req.path == -1 ||
+        (flags & END_STREAM)) {
+        status = 400;
+    }
+    else {
+        request_header(&req);
+
+        if (h2->connect_cb)
+            status = h2->connect_cb(stream, &stream->parser.header, h2->data);
+    }
+
+    if (status) {
+        write_status(h2, id, status);
+        stream_free(stream);
+        return 0;
+    }
+
+    write_status(h2, id, 200);
+
+    stream->open = 1;
+    stream->next = h2->streams;
+    h2->streams = stream;
+    h2->num_streams++;
+
+    stream_flush(stream);
+    return 0;
+}
+
+static int block_append(struct ws_h2 *h2, const char *data, size_t len)
+{
+    if (h2->block_len + len > WS_H2_MAX_HEADERS)
+        return fail(h2, WS_H2_ENHANCE_YOUR_CALM);
+
+    memcpy(h2->block + h2->block_len, data, len);
+    h2->block_len += len;
+
+    if (h2->frame_flags & END_HEADERS)
+        return headers_end(h2);
+
+    return 0;
+}
+
+static int read_headers(struct ws_h2 *h2)
+{
+    uint32_t id = h2->frame_stream;
+
+    // clients open odd numbered streams
+    if (id == 0 || id % 2 == 0)
+        return fail(h2, WS_H2_PROTOCOL_ERROR);
+
+    size_t start = 0, pad = 0;
+
+    if (h2->frame_flags & PADDED) {
+        if (h2->frame_len < 1)
+            return fail(h2, WS_H2_PROTOCOL_ERROR);
+
+        pad = (uint8_t)h2->payload[0];
+        start = 1;
+    }
+
+    // priorities are ignored
+    if (h2->frame_flags & PRIORITY_FLAG)
+        start += 5;
+
+    if (start + pad > h2->frame_len)
+        return fail(h2, WS_H2_PROTOCOL_ERROR);
+
+    h2->block_stream = id;
+    h2->block_flags = h2->frame_flags;
+
+    return block_append(h2, h2->payload + start, h2->frame_len - start - pad);
+}
+
+static int read_settings(struct ws_h2 *h2)
+{
+    if (h2->frame_stream != 0)
+        return fail(h2, WS_H2_PROTOCOL_ERROR);
+
+    if (h2->frame_flags & ACK)
+        return h2->frame_len == 0 ? 0 : fail(h2, WS_H2_FRAME_SIZE_ERROR);
+
+    if (h2->frame_len % 6)
+        return fail(h2, WS_H2_FRAME_SIZE_ERROR);
+
+    for (size_t i = 0; i < h2->frame_len; i += 6) {
+        const uint8_t *p = (const uint8_t *)h2->payload + i;
+        int id = p[0] << 8 | p[1];
+        uint32_t value = read32(h2->payload + i + 2);
+
+        if (id == SETTINGS_INITIAL_WINDOW_SIZE) {
+            if (value > MAX_WINDOW)
+                return fail(h2, WS_H2_FLOW_CONTROL_ERROR);
+
+            // applies to the open streams too, rfc 9113 section 6.9.2
+            int64_t delta = value - h2->initial_window;
+            h2->initial_window = value;
+
+            for (struct ws_h2_stream *stream = h2->streams; stream;
+                stream = stream->next) {
+                stream->send_window += delta;
+                if (stream->send_window > MAX_WINDOW)
+                    return fail(h2, WS_H2_FLOW_CONTROL_ERROR);
+            }
+        }
+        else if (id == SETTINGS_MAX_FRAME_SIZE) {
+            if (value < 16384 || value > 16777215)
+                return fail(h2, WS_H2_PROTOCOL_ERROR);
+
+            h2->max_frame = value;
+        }
+    }
+
+    h2->settings = 1;
+    write_frame(h2, SETTINGS, ACK, 0, NULL, 0);
+
+    flush_all(h2);
+    return 0;
+}
+
+static int read_window_update(struct ws_h2 *h2)
+{
+    if (h2->frame_len != 4)
+        return fail(h2, WS_H2_FRAME_SIZE_ERROR);
+
+    uint32_t increment = read32(h2->payload) & MAX_WINDOW;
+
+    if (h2->frame_stream == 0) {
+        if (increment == 0)
+            return fail(h2, WS_H2_PROTOCOL_ERROR);
+
+        h2->send_window += increment;
+        if (h2->send_window > MAX_WINDOW)
+            return fail(h2, WS_H2_FLOW_CONTROL_ERROR);
+
+        flush_all(h2);
+        return 0;
+    }
+
+    struct ws_h2_stream *stream = stream_find(h2, h2->frame_stream);
+    if (stream == NULL)
+        return 0;
+
+    stream->send_window += increment;
+
+    if (increment == 0)
+        ws_h2_reset(stream, WS_H2_PROTOCOL_ERROR);
+    else if (stream->send_window > MAX_WINDOW)
+        ws_h2_reset(stream, WS_H2_FLOW_CONTROL_ERROR);
+    else
+        stream_flush(stream);
+
+    return 0;
+}
+
+// a buffered frame is complete
+static int read_frame(struct ws_h2 *h2)
+{
+    switch (h2->frame_type) {
+    case HEADERS:
+        return read_headers(h2);
+
+    case CONTINUATION:
+        return block_append(h2, h2->payload, h2->frame_len);
+
+    case SETTINGS:
+        return read_settings(h2);
+
+    case WINDOW_UPDATE:
+        return read_window_update(h2);
+
+    case RST_STREAM: {
+        if (h2->frame_len != 4)
+            return fail(h2, WS_H2_FRAME_SIZE_ERROR);
+        if (h2->frame_stream == 0)
+            return fail(h2, WS_H2_PROTOCOL_ERROR);
+
+        struct ws_h2_stream *stream = stream_find(h2, h2->frame_stream);
+        if (stream)
+            stream->reset = 1;
+
+        return 0;
+    }
+
+    case PING:
+        if (h2->frame_len != 8)
+            return fail(h2, WS_H2_FRAME_SIZE_ERROR);
+        if (h2->frame_stream != 0)
+            return fail(h2, WS_H2_PROTOCOL_ERROR);
+
+        if (!(h2->frame_flags & ACK))
+            write_frame(h2, PING, ACK, 0, h2->payload, 8);
+
+        return 0;
+
+    case PUSH_PROMISE:
+        // servers push, clients don't
+        return fail(h2, WS_H2_PROTOCOL_ERROR);
+
+    default:
+        // PRIORITY, GOAWAY and unknown types
+        return 0;
+    }
+}
+
+// a frame header is complete
+static int frame_begin(struct ws_h2 *h2)
+{
+    const uint8_t *p = h2->header;
+
+    h2->frame_len = p[0] << 16 | p[1] << 8 | p[2];
+    h2->frame_type = p[3];
+    h2->frame_flags = p[4];
+    h2->frame_stream = read32((const char *)p + 5) & MAX_WINDOW;
+    h2->frame_read = 0;
+
+    if (h2->frame_len > WS_H2_MAX_FRAME)
+        return fail(h2, WS_H2_FRAME_SIZE_ERROR);
+
+    // the client preface ends with SETTINGS, and a header block with
+    // nothing in between
+    if ((!h2->settings && h2->frame_type != SETTINGS) ||
+        (h2->block_stream && (h2->frame_type != CONTINUATION ||
+        h2->frame_stream != h2->block_stream)) ||
+        (!h2->block_stream && h2->frame_type == CONTINUATION))
+        return fail(h2, WS_H2_PROTOCOL_ERROR);
+
+    if (h2->frame_type != DATA)
+        return 0;
+
+    if (h2->frame_stream == 0 || h2->frame_stream > h2->last_stream)
+        return fail(h2, WS_H2_PROTOCOL_ERROR);
+
+    // padding counts against the windows too
+    h2->recv_window -= h2->frame_len;
+    if (h2->recv_window < 0)
+        return fail(h2, WS_H2_FLOW_CONTROL_ERROR);
+
+    if ((h2->frame_flags & PADDED) && h2->frame_len == 0)
+        return fail(h2, WS_H2_PROTOCOL_ERROR);
+
+    h2->pad_len = h2->frame_flags & PADDED ? -1 : 0;
+    h2->target = stream_find(h2, h2->frame_stream);
+
+    struct ws_h2_stream *stream = h2->target;
+    if (stream == NULL || stream->reset || stream->remote_closed) {
+        h2->target = NULL;
+        return 0;
+    }
+
+    stream->recv_window -= h2->frame_len;
+    if (stream->recv_window < 0) {
+        ws_h2_reset(stream, WS_H2_FLOW_CONTROL_ERROR);
+        h2->target = NULL;
+    }
+
+    return 0;
+}
+
+// a DATA frame is complete
+static void data_end(struct ws_h2 *h2)
+{
+    struct ws_h2_stream *stream = h2->target;
+    h2->target = NULL;
+
+    if (stream == NULL || stream->reset) {
+        grant(h2, NULL);
+        return;
+    }
+
+    if (h2->frame_flags & END_STREAM) {
+        // the client is done, so are we
+        stream->remote_closed = 1;
+        ws_h2_close(stream);
+    }
+
+    grant(h2, stream);
+}
+
+// DATA payload, padding is skipped
+static int read_data(struct ws_h2 *h2, char *data, size_t len)
+{
+    if (h2->pad_len == -1) {
+        h2->pad_len = (uint8_t)data[0];
+        h2->frame_read = 1;
+
+        if (h2->pad_len >= (int)h2->frame_len)
+            return fail(h2, WS_H2_PROTOCOL_ERROR);
+
+        return 1;
+    }
+
+    size_t end = h2->frame_len - h2->pad_len;
+    size_t n;
+
+    if (h2->frame_read < end) {
+        n = end - h2->frame_read;
+        if (n > len)
+            n = len;
+
+        struct ws_h2_stream *stream = h2->target;
+        if (stream && !stream->reset &&
+            ws_parse_all(&stream->parser, data, n) == -1)
+            ws_h2_reset(stream, stream->parser.errno == WS_RATE_LIMITED ?
+                WS_H2_ENHANCE_YOUR_CALM : WS_H2_PROTOCOL_ERROR);
+    }
+    else {
+        n = h2->frame_len - h2->frame_read;
+        if (n > len)
+            n = len;
+    }
+
+    h2->frame_read += n;
+    return n;
+}
+
+static int parse(struct ws_h2 *h2, char *data, size_t len)
+{
+    while (len > 0) {
+        if (h2->preface_len < WS_H2_PREFACE_LEN) {
+            if (data[0] != WS_H2_PREFACE[h2->preface_len])
+                return -1;
+
+            if (++h2->preface_len == WS_H2_PREFACE_LEN) {
+                // our preface, only the extended CONNECT is new
+                char payload[12] = { 0 };
+                payload[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+                write32(payload + 2, WS_H2_MAX_STREAMS);
+                payload[7] = SETTINGS_ENABLE_CONNECT_PROTOCOL;
+                write32(payload + 8, 1);
+                write_frame(h2, SETTINGS, 0, 0, payload, sizeof(payload));
+            }
+
+            data++;
+            len--;
+            continue;
+        }
+
+        if (h2->header_len < WS_H2_FRAME_HEADER_SIZE) {
+            h2->header[h2->header_len++] = data[0];
+            data++;
+            len--;
+
+            if (h2->header_len < WS_H2_FRAME_HEADER_SIZE)
+                continue;
+
+            if (frame_begin(h2) == -1)
+                return -1;
+        }
+        else if (h2->frame_type == DATA) {
+            int n = read_data(h2, data, len);
+            if (n == -1)
+                return -1;
+
+            data += n;
+            len -= n;
+        }
+        else {
+            size_t n = h2->frame_len - h2->frame_read;
+            if (n > len)
+                n = len;
+
+            memcpy(h2->payload + h2->frame_read, data, n);
+            h2->frame_read += n;
+            data += n;
+            len -= n;
+        }
+
+        if (h2->frame_read < h2->frame_len)
+            continue;
+
+        // the whole frame is in
+        h2->header_len = 0;
+
+        if (h2->frame_type == DATA)
+            data_end(h2);
+        else if (read_frame(h2) == -1)
+            return -1;
+
+        sweep(h2);
+
+        if (h2->failed)
+            return -1;
+    }
+
+    return 0;
+}
+
+// interface
+
+void ws_h2_init(struct ws_h2 *h2)
+{
+    memset(h2, 0, sizeof(struct ws_h2));
+    ws_hpack_init(&h2->hpack);
+
+    h2->send_window = WS_H2_WINDOW;
+    h2->recv_window = WS_H2_WINDOW;
+    h2->initial_window = WS_H2_WINDOW;
+    h2->max_frame = WS_H2_MAX_FRAME;
+}
+
+// calls close_cb for the streams still open, not from the callbacks
+void ws_h2_free(struct ws_h2 *h2)
+{
+    while (h2->streams) {
+        struct ws_h2_stream *stream = h2->streams;
+        h2->streams = stream->next;
+
+        if (h2->close_cb)
+            h2->close_cb(stream, h2->data);
+
+        stream_free(stream);
+    }
+
+    h2->num_streams = 0;
+    ws_hpack_free(&h2->hpack);
+}
+
+// feed bytes from the connection, starting with the client preface
+// returns -1 on a connection error, after writing a GOAWAY unless the
+// input wasn't http/2 at all. the connection should be closed then
+int ws_h2_parse(struct ws_h2 *h2, char *data, size_t len)
+{
+    if (h2->failed)
+        return -1;
+
+    h2->parsing++;
+    int ret = parse(h2, data, len);
+    h2->parsing--;
+
+    if (ret == -1)
+        h2->failed = 1;
+
+    return ret;
+}
+
+// queue data, websocket frames from ws_write_frame_header and their
+// payload, sent in DATA frames as the peer's windows allow
+// returns -1 if the stream is closing
+int ws_h2_send(struct ws_h2_stream *stream, const char *data, size_t len)
+{
+    if (stream->reset || stream->local_closed)
+        return -1;
+
+    size_t sent = 0;
+    if (stream->open && stream->pending_len == 0)
+        sent = stream_write(stream, data, len, 0);
+
+    if (sent == len)
+        return 0;
+
+    size_t need = stream->pending_len + len - sent;
+    if (need > stream->pending_size) {
+        stream->pending_size = need * 2;
+        stream->pending = realloc(stream->pending, stream->pending_size);
+    }
+
+    memcpy(stream->pending + stream->pending_len, data + sent, len - sent);
+    stream->pending_len = need;
+    return 0;
+}
+
+// end our side with END_STREAM once the queued data is out, the stream
+// is freed when the peer ends its side too
+void ws_h2_close(struct ws_h2_stream *stream)
+{
+    if (stream->reset || stream->local_closed)
+        return;
+
+    stream->local_closed = 1;
+    stream->end_pending = 1;
+    stream_flush(stream);
+
+    release(stream->h2);
+}
+
+// abort the stream with RST_STREAM, dropping queued data
+void ws_h2_reset(struct ws_h2_stream *stream, uint32_t error)
+{
+    if (stream->reset)
+        return;
+
+    write_rst_stream(stream->h2, stream->id, error);
+    stream->reset = 1;
+    stream->pending_len = 0;
+
+    release(stream->h2);
+}
+
+// stop returning flow control credit, e.g. while the connection's output
+// is backed up, and catch up when hold is cleared
+void ws_h2_hold(struct ws_h2 *h2, int hold)
+{
+    h2->hold = hold;
+    if (hold)
+        return;
+
+    grant(h2, NULL);
+    for (struct ws_h2_stream *stream = h2->streams; stream;
+        stream = stream->next)
+        grant(h2, stream);
+}
@@ -0,0 +1,209 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef WS_H2_H
+#define WS_H2_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "ws.h"
+
+// websockets over http/2 (rfc 8441), server side, over cleartext http/2
+// with prior knowledge (h2c). many websockets share one connection, each
+// a CONNECT stream with :protocol websocket whose DATA frames carry
+// websocket frames for its own ws_parser. like the parser it does no i/o,
+// input goes to ws_h2_parse and output comes out of write_cb
+
+#define WS_H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define WS_H2_PREFACE_LEN 24
+
+#define WS_H2_FRAME_HEADER_SIZE 9
+
+// frame payloads, the default SETTINGS_MAX_FRAME_SIZE which we never raise
+#define WS_H2_MAX_FRAME 16384
+
+// a header block, HEADERS and CONTINUATION frames together
+#define WS_H2_MAX_HEADERS 16384
+
+// flow control window granted to the peer, per stream and connection
+#define WS_H2_WINDOW 65535
+
+// concurrent streams per connection, advertised in SETTINGS
+#define WS_H2_MAX_STREAMS 100
+
+// error codes for GOAWAY and RST_STREAM
+#define WS_H2_NO_ERROR 0x0
+#define WS_H2_PROTOCOL_ERROR 0x1
+#define WS_H2_INTERNAL_ERROR 0x2
+#define WS_H2_FLOW_CONTROL_ERROR 0x3
+#define WS_H2_STREAM_CLOSED 0x5
+#define WS_H2_FRAME_SIZE_ERROR 0x6
+#define WS_H2_REFUSED_STREAM 0x7
+#define WS_H2_CANCEL 0x8
+#define WS_H2_COMPRESSION_ERROR 0x9
+#define WS_H2_ENHANCE_YOUR_CALM 0xb
+
+// hpack decoder (rfc 7541), the dynamic table is held to its default
+// size, the only one we advertise
+#define WS_HPACK_TABLE_SIZE 4096
+#define WS_HPACK_MAX_ENTRIES (WS_HPACK_TABLE_SIZE / 32)
+
+struct ws_hpack_entry {
+    char *data;
+    size_t name_len;
+    size_t value_len;
+};
+
+struct ws_hpack {
+    // ring of entries, first is the newest
+    struct ws_hpack_entry entries[WS_HPACK_MAX_ENTRIES];
+    size_t first;
+    size_t count;
+
+    // rfc 7541 sizes, name and value plus 32 per entry
+    size_t size;
+    size_t max_size;
+
+    // decoded name and value of the current field
+    char *buffer;
+    size_t buffer_size;
+};
+
+typedef void (ws_hpack_cb)(const char *name, size_t name_len,
+    const char *value, size_t value_len, void *data);
+
+struct ws_h2;
+
+struct ws_h2_stream {
+    uint32_t id;
+    struct ws_h2 *h2;
+
+    // websocket frames from the DATA frames, set the callbacks in
+    // connect_cb, data defaults to the stream
+    struct ws_parser parser;
+
+    // credit from the peer and credit granted to it
+    int64_t send_window;
+    int64_t recv_window;
+
+    // output waiting for send window
+    char *pending;
+    size_t pending_len;
+    size_t pending_size;
+
+    // answered with 200, END_STREAM sent (or due after pending) and
+    // received, or reset by either side
+    int open;
+    int local_closed;
+    int end_pending;
+    int remote_closed;
+    int reset;
+
+    // user data
+    void *data;
+
+    struct ws_h2_stream *next;
+};
+
+struct ws_h2 {
+    // connection preface bytes matched so far
+    size_t preface_len;
+
+    // frame being read
+    uint8_t header[WS_H2_FRAME_HEADER_SIZE];
+    size_t header_len;
+    uint32_t frame_len;
+    uint32_t frame_read;
+    int frame_type;
+    int frame_flags;
+    uint32_t frame_stream;
+
+    // DATA frames go straight to the target's parser, -1 pad_len until
+    // the pad length is read
+    struct ws_h2_stream *target;
+    int pad_len;
+
+    // other frames are buffered
+    char payload[WS_H2_MAX_FRAME];
+
+    // header block being assembled, block_stream is 0 if none
+    char block[WS_H2_MAX_HEADERS];
+    size_t block_len;
+    uint32_t block_stream;
+    int block_flags;
+
+    struct ws_hpack hpack;
+
+    struct ws_h2_stream *streams;
+    int num_streams;
+    uint32_t last_stream;
+
+    // flow control, the peer's settings and our windows
+    int64_t send_window;
+    int64_t recv_window;
+    int64_t initial_window;
+    uint32_t max_frame;
+
+    // window updates held back, see ws_h2_hold
+    int hold;
+
+    // the client's SETTINGS arrived, streams may be freed, GOAWAY sent
+    int settings;
+    int parsing;
+    int failed;
+
+    // a new websocket, set up stream->parser and return 0 to accept it
+    // or an http status to refuse it with. refused streams are freed
+    // without close_cb, data sent from here goes out after the 200
+    int (*connect_cb)(struct ws_h2_stream *stream, struct ws_header *header,
+        void *data);
+
+    // the stream closed both ways or was reset, called between frames or
+    // from ws_h2_close and ws_h2_reset, it's freed afterwards
+    void (*close_cb)(struct ws_h2_stream *stream, void *data);
+
+    // bytes for the peer
+    void (*write_cb)(const char *out, size_t len, void *data);
+
+    // private data for the callbacks
+    void *data;
+};
+
+WS_API void ws_hpack_init(struct ws_hpack *hpack);
+WS_API void ws_hpack_free(struct ws_hpack *hpack);
+WS_API int ws_hpack_decode(struct ws_hpack *hpack, const char *in,
+    size_t len, ws_hpack_cb *cb, void *data);
+
+WS_API void ws_h2_init(struct ws_h2 *h2);
+WS_API void ws_h2_free(struct ws_h2 *h2);
+WS_API int ws_h2_parse(struct ws_h2 *h2, char *data, size_t len);
+
+WS_API int ws_h2_send(struct ws_h2_stream *stream, const char *data,
+    size_t len);
+WS_API void ws_h2_close(struct ws_h2_stream *stream);
+WS_API void ws_h2_reset(struct ws_h2_stream *stream, uint32_t error);
+WS_API void ws_h2_hold(struct ws_h2 *h2, int hold);
+
+#endif
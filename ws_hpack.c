@@ -0,0 +1,402 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "ws_h2.h"
+
+// rfc 7541 appendix a
+static const char *const static_table[][2] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+#define STATIC_ENTRIES (sizeof(static_table) / sizeof(static_table[0]))
+
+// the huffman code of rfc 7541 appendix b is canonical, so symbols in code
+// order and the number of codes of each length are enough to decode it
+static const uint8_t huffman_counts[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+
+#define HUFFMAN_EOS 256
+
+static const uint16_t huffman_symbols[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+    52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+    110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76, 77,
+    78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118, 119,
+    120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39, 43, 124,
+    35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92, 195, 208,
+    128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+    179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154,
+    156, 160, 163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190,
+    196, 198, 228, 232, 233, 1, 135, 137, 138, 139, 140, 141, 143, 147,
+    149, 150, 151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+    183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159, 171, 206,
+    215, 225, 236, 237, 199, 207, 234, 235, 192, 193, 200, 201, 202, 205,
+    210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211, 212, 214,
+    221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+    2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20, 21, 23, 24,
+    25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22, 256,
+};
+
+// returns -1 on an invalid code, eos or bad padding
+static int huffman_decode(const uint8_t *in, size_t len, char *out,
+    size_t *out_len)
+{
+    int code = 0, first = 0, index = 0, bits = 0;
+    size_t n = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        for (int b = 7; b >= 0; b--) {
+            code = code << 1 | (in[i] >> b & 1);
+            bits++;
+
+            int count = huffman_counts[bits];
+            if (code - first < count) {
+                int symbol = huffman_symbols[index + code - first];
+                if (symbol == HUFFMAN_EOS)
+                    return -1;
+
+                out[n++] = symbol;
+                code = first = index = bits = 0;
+                continue;
+            }
+
+            if (bits == 30)
+                return -1;
+
+            index += count;
+            first = (first + count) << 1;
+        }
+    }
+
+    // at most 7 bits of padding, the start of eos
+    if (bits > 7 || code != (1 << bits) - 1)
+        return -1;
+
+    *out_len = n;
+    return 0;
+}
+
+// prefixed integer, returns the bytes used or -1
+static int decode_int(const uint8_t *in, size_t len, int prefix,
+    uint32_t *out)
+{
+    if (len == 0)
+        return -1;
+
+    uint32_t max = (1 << prefix) - 1;
+    uint32_t value = in[0] & max;
+
+    if (value < max) {
+        *out = value;
+        return 1;
+    }
+
+    // nothing we accept needs more than four continuation bytes
+    for (size_t i = 1; i < len && i <= 4; i++) {
+        value += (uint32_t)(in[i] & 0x7F) << (7 * (i - 1));
+
+        if (!(in[i] & 0x80)) {
+            *out = value;
+            return i + 1;
+        }
+    }
+
+    return -1;
+}
+
+static void reserve(struct ws_hpack *hpack, size_t size)
+{
+    if (size <= hpack->buffer_size)
+        return;
+
+    hpack->buffer_size = size > 256 ? size : 256;
+    hpack->buffer = realloc(hpack->buffer, hpack->buffer_size);
+}
+
+// string literal, appended to the buffer at *pos
+// returns the bytes used or -1
+static int decode_string(struct ws_hpack *hpack, const uint8_t *in,
+    size_t len, size_t *pos, size_t *out_len)
+{
+    uint32_t n;
+    int used = decode_int(in, len, 7, &n);
+    if (used == -1 || n > len - used)
+        return -1;
+
+    int huffman = in[0] & 0x80;
+
+    // codes are at least 5 bits long
+    reserve(hpack, *pos + (huffman ? n * 8 / 5 : n) + 1);
+
+    if (huffman) {
+        if (huffman_decode(in + used, n, hpack->buffer + *pos, out_len))
+            return -1;
+    }
+    else {
+        memcpy(hpack->buffer + *pos, in + used, n);
+        *out_len = n;
+    }
+
+    *pos += *out_len;
+    return used + n;
+}
+
+static void table_evict(struct ws_hpack *hpack, size_t limit)
+{
+    while (hpack->count > 0 && hpack->size > limit) {
+        size_t last = (hpack->first + hpack->count - 1) % WS_HPACK_MAX_ENTRIES;
+        struct ws_hpack_entry *entry = &hpack->entries[last];
+
+        hpack->size -= entry->name_len + entry->value_len + 32;
+        hpack->count--;
+        free(entry->data);
+    }
+}
+
+static void table_add(struct ws_hpack *hpack, const char *name,
+    size_t name_len, const char *value, size_t value_len)
+{
+    size_t size = name_len + value_len + 32;
+
+    // an entry larger than the table just empties it
+    if (size > hpack->max_size) {
+        table_evict(hpack, 0);
+        return;
+    }
+
+    table_evict(hpack, hpack->max_size - size);
+
+    hpack->first = (hpack->first + WS_HPACK_MAX_ENTRIES - 1) %
+        WS_HPACK_MAX_ENTRIES;
+    hpack->count++;
+    hpack->size += size;
+
+    struct ws_hpack_entry *entry = &hpack->entries[hpack->first];
+    entry->data = malloc(name_len + value_len + 1);
+    entry->name_len = name_len;
+    entry->value_len = value_len;
+    memcpy(entry->data, name, name_len);
+    memcpy(entry->data + name_len, value, value_len);
+}
+
+// static entries first, then the dynamic table from the newest
+static int table_get(struct ws_hpack *hpack, uint32_t index,
+    const char **name, size_t *name_len, const char **value,
+    size_t *value_len)
+{
+    if (index == 0)
+        return -1;
+
+    if (index <= STATIC_ENTRIES) {
+        *name = static_table[index - 1][0];
+        *name_len = strlen(*name);
+        *value = static_table[index - 1][1];
+        *value_len = strlen(*value);
+        return 0;
+    }
+
+    index -= STATIC_ENTRIES + 1;
+    if (index >= hpack->count)
+        return -1;
+
+    struct ws_hpack_entry *entry =
+        &hpack->entries[(hpack->first + index) % WS_HPACK_MAX_ENTRIES];
+
+    *name = entry->data;
+    *name_len = entry->name_len;
+    *value = entry->data + entry->name_len;
+    *value_len = entry->value_len;
+    return 0;
+}
+
+// interface
+
+void ws_hpack_init(struct ws_hpack *hpack)
+{
+    memset(hpack, 0, sizeof(struct ws_hpack));
+    hpack->max_size = WS_HPACK_TABLE_SIZE;
+}
+
+void ws_hpack_free(struct ws_hpack *hpack)
+{
+    table_evict(hpack, 0);
+    free(hpack->buffer);
+    hpack->buffer = NULL;
+    hpack->buffer_size = 0;
+}
+
+// decode a whole header block, calling cb for every field
+// returns -1 on a compression error, the connection can't go on then
+int ws_hpack_decode(struct ws_hpack *hpack, const char *in, size_t len,
+    ws_hpack_cb *cb, void *data)
+{
+    const uint8_t *p = (const uint8_t *)in;
+
+    while (len > 0) {
+        uint32_t index;
+        int used;
+        const char *name, *value;
+        size_t name_len, value_len;
+
+        if (p[0] & 0x80) {
+            // indexed field
+            used = decode_int(p, len, 7, &index);
+            if (used == -1 || table_get(hpack, index, &name, &name_len,
+                &value, &value_len))
+                return -1;
+
+            if (cb)
+                cb(name, name_len, value, value_len, data);
+
+            p += used;
+            len -= used;
+            continue;
+        }
+
+        if ((p[0] & 0xE0) == 0x20) {
+            // dynamic table size update
+            used = decode_int(p, len, 5, &index);
+            if (used == -1 || index > WS_HPACK_TABLE_SIZE)
+                return -1;
+
+            hpack->max_size = index;
+            table_evict(hpack, index);
+
+            p += used;
+            len -= used;
+            continue;
+        }
+
+        // literal, with incremental indexing, without or never indexed
+        int indexing = (p[0] & 0xC0) == 0x40;
+        used = decode_int(p, len, indexing ? 6 : 4, &index);
+        if (used == -1)
+            return -1;
+
+        p += used;
+        len -= used;
+
+        // the name is copied, adding the field may evict its entry
+        size_t pos = 0;
+
+        if (index) {
+            if (table_get(hpack, index, &name, &name_len, &value, &value_len))
+                return -1;
+
+            reserve(hpack, name_len + 1);
+            memcpy(hpack->buffer, name, name_len);
+            pos = name_len;
+        }
+        else {
+            used = decode_string(hpack, p, len, &pos, &name_len);
+            if (used == -1)
+                return -1;
+
+            p += used;
+            len -= used;
+        }
+
+        used = decode_string(hpack, p, len, &pos, &value_len);
+        if (used == -1)
+            return -1;
+
+        p += used;
+        len -= used;
+
+        name = hpack->buffer;
+        value = hpack->buffer + name_len;
+
+        if (cb)
+            cb(name, name_len, value, value_len, data);
+
+        if (indexing)
+            table_add(hpack, name, name_len, value, value_len);
+    }
+
+    return 0;
+}
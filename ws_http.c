@@ -23,57 +23,184 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <strings.h>
 #include "ws.h"
 #include "sha1.h"
 #include "base64.h"
+#include "ws_metrics.h"
 
 #define GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 #define GUID_LEN 36
 
-static void compute_challenge(const char *key, char *encoded)
+// writes the 28 byte accept key for key to out, not null terminated
+static void compute_challenge(const char *key, char *out)
 {
-    char buf[GUID_LEN + strlen(key) + 1];
-
-    buf[0] = '\0';
-    strcat(buf, key);
-    strcat(buf, GUID);
-
     unsigned char result[SHA1_RESULTLEN];
     struct sha1_ctxt ctx;
     sha1_init(&ctx);
-    sha1_loop(&ctx, (unsigned char *)buf, strlen(buf));
+    sha1_loop(&ctx, (const unsigned char *)key, strlen(key));
+    sha1_loop(&ctx, (const unsigned char *)GUID, GUID_LEN);
     sha1_result(&ctx, result);
 
-    base64_encode(encoded, (unsigned char *)result, SHA1_RESULTLEN);
+    char encoded[base64_encode_len(SHA1_RESULTLEN)];
+    base64_encode(encoded, result, SHA1_RESULTLEN);
+    memcpy(out, encoded, WS_ACCEPT_KEY_LEN);
 }
 
-static const char *http_reply =
+static const char http_reply[] =
     "HTTP/1.1 101 Switching Protocols\r\n"
     "Upgrade: websocket\r\n"
     "Connection: Upgrade\r\n"
     "Sec-WebSocket-Accept: ";
 
-void ws_write_http_handshake(char *out, char *key)
+#define REPLY_LEN (sizeof(http_reply) - 1)
+
+// writes at most WS_HTTP_RESPONSE_SIZE bytes to out, null terminated
+// returns the length of the response
+int ws_write_http_handshake(char *out, char *key)
 {
-    char encoded[base64_encode_len(SHA1_RESULTLEN)];
+    char *p = out;
+
+    memcpy(p, http_reply, REPLY_LEN);
+    p += REPLY_LEN;
 
-    compute_challenge(key, encoded);
+    compute_challenge(key, p);
+    p += WS_ACCEPT_KEY_LEN;
 
-    strcpy(out, http_reply);
-    strcat(out, encoded);
-    strcat(out, "\r\n\r\n");
+    memcpy(p, "\r\n\r\n", 5);
+    return p + 4 - out;
 }
 
-static const char *http_error =
+static const char http_error[] =
     "HTTP/1.1 400 Bad Request\r\n"
     "Sec-WebSocket-Version: 13\r\n"
     "\r\n";
 
-void ws_write_http_error(char *out)
+// returns the length of the response
+int ws_write_http_error(char *out)
+{
+    memcpy(out, http_error, sizeof(http_error));
+    return sizeof(http_error) - 1;
+}
+
+static int same(const char *a, const char *b)
+{
+    if (!a || !b)
+        return a == b;
+
+    return !strcmp(a, b);
+}
+
+static char *copy(const char *str)
+{
+    if (!str)
+        return NULL;
+
+    char *dup = malloc(strlen(str) + 1);
+    strcpy(dup, str);
+    return dup;
+}
+
+// lays out the full response once, leaving room for the accept key
+static struct ws_handshake *handshake_new(const char *protocol,
+    const char *extensions)
 {
-    strcpy(out, http_error);
+    size_t size = REPLY_LEN + WS_ACCEPT_KEY_LEN + 4;
+    if (protocol)
+        size += strlen("Sec-WebSocket-Protocol: \r\n") + strlen(protocol);
+    if (extensions)
+        size += strlen("Sec-WebSocket-Extensions: \r\n") + strlen(extensions);
+
+    struct ws_handshake *handshake =
+        malloc(sizeof(struct ws_handshake) + size + 1);
+
+    handshake->refs = 0;
+    handshake->protocol = copy(protocol);
+    handshake->extensions = copy(extensions);
+
+    char *p = handshake->data;
+    p += sprintf(p, "%s", http_reply);
+    memset(p, '=', WS_ACCEPT_KEY_LEN);
+    p += WS_ACCEPT_KEY_LEN;
+    p += sprintf(p, "\r\n");
+    if (protocol)
+        p += sprintf(p, "Sec-WebSocket-Protocol: %s\r\n", protocol);
+    if (extensions)
+        p += sprintf(p, "Sec-WebSocket-Extensions: %s\r\n", extensions);
+    p += sprintf(p, "\r\n");
+
+    handshake->len = p - handshake->data;
+    return handshake;
+}
+
+// returns the response for the given subprotocol and extensions, either
+// of which may be NULL, building it on first use
+// the caller holds a reference until ws_handshake_unref
+struct ws_handshake *ws_handshake_get(struct ws_handshake_cache *cache,
+    const char *protocol, const char *extensions)
+{
+    struct ws_handshake *handshake;
+
+    for (handshake = cache->list; handshake; handshake = handshake->next)
+        if (same(handshake->protocol, protocol) &&
+            same(handshake->extensions, extensions))
+            break;
+
+    if (!handshake) {
+        handshake = handshake_new(protocol, extensions);
+        handshake->next = cache->list;
+        cache->list = handshake;
+    }
+
+    handshake->refs++;
+    return handshake;
+}
+
+static void handshake_free(struct ws_handshake *handshake)
+{
+    free(handshake->protocol);
+    free(handshake->extensions);
+    free(handshake);
+}
+
+void ws_handshake_unref(struct ws_handshake_cache *cache,
+    struct ws_handshake *handshake)
+{
+    if (--handshake->refs > 0)
+        return;
+
+    struct ws_handshake **p = &cache->list;
+    while (*p != handshake)
+        p = &(*p)->next;
+
+    *p = handshake->next;
+    handshake_free(handshake);
+}
+
+// frees every response, including ones still referenced
+void ws_handshake_cache_free(struct ws_handshake_cache *cache)
+{
+    while (cache->list) {
+        struct ws_handshake *next = cache->list->next;
+        handshake_free(cache->list);
+        cache->list = next;
+    }
+}
+
+// writes the response with the accept key for key to out
+// returns the length of the response, or -1 if size is too small
+int ws_handshake_write(const struct ws_handshake *handshake, char *out,
+    size_t size, const char *key)
+{
+    if (handshake->len > size)
+        return -1;
+
+    memcpy(out, handshake->data, handshake->len);
+    compute_challenge(key, out + REPLY_LEN);
+
+    return handshake->len;
 }
 
 static char *split(char *line, const char *delim)
@@ -96,7 +223,7 @@ static char *split(char *line, const char *delim)
     return str;
 }
 
-int parse_http_header(struct ws_parser *parser)
+static int parse_http_header(struct ws_parser *parser)
 {
     char *next = split(parser->buffer, "\r\n");
 
@@ -170,6 +297,7 @@ int ws_read_http_header(struct ws_parser *parser, char *data, size_t len)
     for (; pos < len; pos++) {
         if (parser->buffer_len == WS_BUFFER_SIZE - 1) {
             parser->errno = WS_BUFFER_OVERFLOW;
+            WS_COUNT(WS_HANDSHAKES_BUFFER_OVERFLOW, 1);
             return -1;
         }
 
@@ -184,12 +312,15 @@ int ws_read_http_header(struct ws_parser *parser, char *data, size_t len)
 
             if (parse_http_header(parser) == -1) {
                 parser->errno = WS_BAD_REQUEST;
+                WS_COUNT(WS_HANDSHAKES_BAD_REQUEST, 1);
                 return -1;
             }
 
-            break;
+            WS_COUNT(WS_HANDSHAKES_ACCEPTED, 1);
+
+            return pos + 1;
         }
     }
 
-    return pos + 1;
+    return len;
 }
@@ -0,0 +1,180 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "ws_metrics.h"
+
+static const char *counter_names[WS_NUM_COUNTERS] = {
+    "ws_frames_parsed",
+    "ws_bytes_unmasked",
+    "ws_handshakes_accepted",
+    "ws_handshakes_bad_request",
+    "ws_handshakes_buffer_overflow",
+    "sev_accepts",
+    "sev_syscalls",
+    "sev_bytes_read",
+    "sev_bytes_written",
+    "ws_rate_limit_errors",
+    "sev_zerocopy_sends",
+    "sev_zerocopy_copied",
+};
+
+static const char *histogram_names[WS_NUM_HISTOGRAMS] = {
+    "ws_parse_ns",
+    "ws_callback_ns",
+    "sev_read_ns",
+    "sev_queue_bytes",
+    "sev_rx_kernel_ns",
+    "ws_rx_callback_ns",
+    "sev_tx_wire_ns",
+};
+
+// every thread's metrics, threads only ever push
+static struct ws_metrics *all_metrics;
+
+#ifdef WS_METRICS
+
+// the single header build defines it in ws_metrics.h
+# ifndef WS_AMALGAMATION
+__thread struct ws_metrics *ws_metrics_tls;
+# endif
+
+struct ws_metrics *ws_metrics_register(void)
+{
+    struct ws_metrics *metrics = calloc(1, sizeof(struct ws_metrics));
+
+    struct ws_metrics *head = __atomic_load_n(&all_metrics, __ATOMIC_RELAXED);
+    do {
+        metrics->next = head;
+    } while (!__atomic_compare_exchange_n(&all_metrics, &head, metrics, 1,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    ws_metrics_tls = metrics;
+    return metrics;
+}
+
+uint64_t ws_metrics_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#endif
+
+// lowest value that falls in bucket
+static uint64_t bucket_value(int bucket)
+{
+    if (bucket < (1 << WS_HISTOGRAM_SUB))
+        return bucket;
+
+    int hi = bucket >> WS_HISTOGRAM_SUB;
+    uint64_t m = bucket & ((1 << WS_HISTOGRAM_SUB) - 1);
+
+    return ((1 << WS_HISTOGRAM_SUB) + m) << (hi - 1);
+}
+
+// sum the metrics of all threads, without stopping them
+void ws_metrics_aggregate(struct ws_metrics *out)
+{
+    memset(out, 0, sizeof(struct ws_metrics));
+
+    struct ws_metrics *metrics = __atomic_load_n(&all_metrics,
+        __ATOMIC_ACQUIRE);
+
+    for (; metrics; metrics = metrics->next) {
+        for (int i = 0; i < WS_NUM_COUNTERS; i++)
+            out->counters[i] += __atomic_load_n(&metrics->counters[i],
+                __ATOMIC_RELAXED);
+
+        for (int i = 0; i < WS_NUM_HISTOGRAMS; i++)
+            for (int j = 0; j < WS_HISTOGRAM_BUCKETS; j++)
+                out->histograms[i][j] += __atomic_load_n(
+                    &metrics->histograms[i][j], __ATOMIC_RELAXED);
+    }
+}
+
+// lower bound of the bucket holding the given quantile
+uint64_t ws_histogram_value(const uint64_t *buckets, double quantile)
+{
+    uint64_t count = 0;
+    for (int i = 0; i < WS_HISTOGRAM_BUCKETS; i++)
+        count += buckets[i];
+
+    if (count == 0)
+        return 0;
+
+    uint64_t rank = quantile * (count - 1) + 1;
+    uint64_t seen = 0;
+
+    for (int i = 0; i < WS_HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank)
+            return bucket_value(i);
+    }
+
+    return bucket_value(WS_HISTOGRAM_BUCKETS - 1);
+}
+
+// writes one "name value" line per counter and a quantile line per
+// histogram, returns the length like snprintf
+size_t ws_metrics_snapshot(char *out, size_t len)
+{
+    struct ws_metrics *metrics = malloc(sizeof(struct ws_metrics));
+    ws_metrics_aggregate(metrics);
+
+    size_t pos = 0;
+
+#define APPEND(...) \
+    pos += snprintf(out + (pos < len ? pos : len), \
+        pos < len ? len - pos : 0, __VA_ARGS__)
+
+    for (int i = 0; i < WS_NUM_COUNTERS; i++)
+        APPEND("%s %llu\n", counter_names[i],
+            (unsigned long long)metrics->counters[i]);
+
+    for (int i = 0; i < WS_NUM_HISTOGRAMS; i++) {
+        uint64_t *buckets = metrics->histograms[i];
+        uint64_t count = 0;
+        for (int j = 0; j < WS_HISTOGRAM_BUCKETS; j++)
+            count += buckets[j];
+
+        APPEND("%s count=%llu p50=%llu p90=%llu p99=%llu p999=%llu "
+            "max=%llu\n", histogram_names[i], (unsigned long long)count,
+            (unsigned long long)ws_histogram_value(buckets, 0.5),
+            (unsigned long long)ws_histogram_value(buckets, 0.9),
+            (unsigned long long)ws_histogram_value(buckets, 0.99),
+            (unsigned long long)ws_histogram_value(buckets, 0.999),
+            (unsigned long long)ws_histogram_value(buckets, 1.0));
+    }
+
+#undef APPEND
+
+    free(metrics);
+    return pos;
+}
@@ -0,0 +1,133 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef WS_METRICS_H
+#define WS_METRICS_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+// static in the single header build, see amalgamate.sh
+#ifndef WS_API
+# define WS_API
+#endif
+
+// build with -DWS_METRICS to collect these, otherwise they compile away
+
+// counters
+#define WS_FRAMES_PARSED 0
+#define WS_BYTES_UNMASKED 1
+#define WS_HANDSHAKES_ACCEPTED 2
+#define WS_HANDSHAKES_BAD_REQUEST 3
+#define WS_HANDSHAKES_BUFFER_OVERFLOW 4
+#define SEV_ACCEPTS 5
+#define SEV_SYSCALLS 6
+#define SEV_BYTES_READ 7
+#define SEV_BYTES_WRITTEN 8
+#define WS_RATE_LIMIT_ERRORS 9
+#define SEV_ZEROCOPY_SENDS 10
+#define SEV_ZEROCOPY_COPIED 11 // zero copy sends the kernel copied anyway
+#define WS_NUM_COUNTERS 12
+
+// histograms
+#define WS_PARSE_NS 0 // ws_parse_all, excluding callbacks
+#define WS_CALLBACK_NS 1 // header_cb and frame_cb
+#define SEV_READ_NS 2 // read_cb
+#define SEV_QUEUE_BYTES 3 // write queue depth after each send
+
+// where a message's latency goes, the sev ones need sev_server.timestamps
+#define SEV_RX_KERNEL_NS 4 // kernel receive timestamp to read_cb
+#define WS_RX_CALLBACK_NS 5 // ws_parse_all to frame_cb, per chunk
+#define SEV_TX_WIRE_NS 6 // sev_send to the kernel transmit timestamp
+#define WS_NUM_HISTOGRAMS 7
+
+// log-linear buckets: 2^WS_HISTOGRAM_SUB linear steps per power of two
+#define WS_HISTOGRAM_SUB 3
+#define WS_HISTOGRAM_BUCKETS (64 << WS_HISTOGRAM_SUB)
+
+// one per thread, only written by its thread
+struct ws_metrics {
+    uint64_t counters[WS_NUM_COUNTERS];
+    uint64_t histograms[WS_NUM_HISTOGRAMS][WS_HISTOGRAM_BUCKETS];
+
+    struct ws_metrics *next;
+};
+
+WS_API void ws_metrics_aggregate(struct ws_metrics *out);
+WS_API size_t ws_metrics_snapshot(char *out, size_t len);
+
+WS_API uint64_t ws_histogram_value(const uint64_t *buckets, double quantile);
+
+#ifdef WS_METRICS
+
+# ifdef WS_AMALGAMATION
+static __thread struct ws_metrics *ws_metrics_tls;
+# else
+extern __thread struct ws_metrics *ws_metrics_tls;
+# endif
+
+WS_API struct ws_metrics *ws_metrics_register(void);
+WS_API uint64_t ws_metrics_clock(void);
+
+static inline struct ws_metrics *ws_metrics_local(void)
+{
+    struct ws_metrics *metrics = ws_metrics_tls;
+    return metrics ? metrics : ws_metrics_register();
+}
+
+// relaxed stores, so snapshots from other threads read whole values
+static inline void ws_metrics_add(uint64_t *p, uint64_t n)
+{
+    __atomic_store_n(p, *p + n, __ATOMIC_RELAXED);
+}
+
+static inline int ws_histogram_bucket(uint64_t v)
+{
+    if (v < (1 << WS_HISTOGRAM_SUB))
+        return v;
+
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - WS_HISTOGRAM_SUB;
+
+    return ((shift + 1) << WS_HISTOGRAM_SUB) +
+        ((v >> shift) & ((1 << WS_HISTOGRAM_SUB) - 1));
+}
+
+# define WS_COUNT(id, n) \
+    ws_metrics_add(&ws_metrics_local()->counters[id], (n))
+# define WS_RECORD(id, v) \
+    ws_metrics_add(&ws_metrics_local()->histograms[id] \
+        [ws_histogram_bucket(v)], 1)
+# define WS_CLOCK() ws_metrics_clock()
+
+#else
+
+# define WS_COUNT(id, n) ((void)(n))
+# define WS_RECORD(id, v) ((void)(v))
+# define WS_CLOCK() 0
+
+#endif
+
+#endif